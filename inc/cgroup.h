@@ -0,0 +1,30 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Jul-14 16:20 (EDT)
+  Function: run each task in its own cgroup
+
+*/
+
+#ifndef __mrquincy_cgroup_h_
+#define __mrquincy_cgroup_h_
+
+struct CGroupStats {
+    long long	cpu_usec;
+    long long	mem_peak;	// bytes
+    long long	io_bytes;
+
+    CGroupStats(){ cpu_usec = 0; mem_peak = 0; io_bytes = 0; }
+};
+
+extern void cgroup_init(void);
+extern int  cgroup_name(const char *, string *);
+extern int  cgroup_create(const string *);
+extern void cgroup_enter(const string *);
+extern void cgroup_adopt(int);
+extern void cgroup_leave(void);
+extern int  cgroup_kill(const string *);
+extern void cgroup_stats(const string *, CGroupStats *);
+extern void cgroup_remove(const string *);
+
+#endif // __mrquincy_cgroup_h_
@@ -19,6 +19,8 @@ using std::string;
 #define FILE_HW_MEM	"/var/run/adcopy.mem"
 #define FILE_HW_CPU	"/var/run/adcopy.cpu"
 
+#define SHARE_DEFAULT	10
+
 struct sockaddr;
 class NetAddr;
 
@@ -28,8 +30,15 @@ struct ACL {
 };
 
 
+// fair share weights, by traceinfo prefix (eg. user)
+struct Share {
+    string	prefix;
+    int		weight;
+};
+
 typedef list<struct ACL*> ACL_List;
 typedef list<NetAddr *>   NetAddr_List;
+typedef list<struct Share*> Share_List;
 
 class Config {
 public:
@@ -51,22 +60,39 @@ public:
 
     ACL_List		acls;
     NetAddr_List	seedpeers;
+    Share_List		shares;
 
     string		error_mailto;
     string		error_mailfrom;
     string		plan_prog;
+    int			result_cache;		// keep job results this long (secs), 0 => off
+    int			task_mem_reserve;	// MB, keep this much memory free of tasks
+    int			task_max_write;		// MB/s, start no more tasks when disks are this busy, 0 => off
+    string		cgroup_root;		// run each task in a cgroup under here, empty => off
+    int			task_cpu_weight;	// cgroup limits, 0 => system default
+    int			task_io_weight;
+    int			task_mem_max;		// MB
+    int			xfer_net_rate;		// MB/s, sending files to peers, 0 => unlimited
+    int			xfer_disk_rate;		// MB/s, saving files from peers
+    int			xfer_job_rate;		// MB/s, saving files, each job
+    int			net_compress;		// compress large requests. all servers must understand them
+    int			src_by_hash;		// send large programs by hash. all servers must understand them
+
+    string		text;			// the file, as read. tasks get this copy
 
     int check_acl(const sockaddr *);
+    int share_weight(const string *, string *) const;
 protected:
     Config();
     ~Config();
 
-    friend int read_config(const char*);
+    friend int read_config_text(const string *);
 };
 
 extern Config *config;
 
 extern int read_config(const char *);
+extern int read_config_text(const string *);
 
 #endif // __mrquincy_config_h_
 
@@ -21,11 +21,15 @@ using std::string;
 
 class Job;
 
+#define JOB_DELETE_AT_END	-1
+
 class Delete {
 public:
     string		_filename;
+    int			_release;	// delete once this step finishes
+    long long		_size;
 
-    Delete(const string *);
+    Delete(const string *, int);
 
     DISALLOW_COPY(Delete);
 };
@@ -40,10 +44,18 @@ public:
     int			_n_fails;		// tasks which failed on this server
     int			_n_task_redo;		// replacement tasks sent to this server
     hrtime_t		_last_task;		// time of last task start
+    hrtime_t		_last_fail;
+    int			_load;			// from peerdb
+    int			_disk_free;		// MB, -1 if unknown
+    int			_fair_slots;		// our share of its task slots, -1 if unknown
+    int			_task_slots;		// all of its task slots, -1 if unknown
+    int			_dc;			// index into job's _datacenters
+    string		_rack;			// empty if unknown
 
     list<Delete*>	_to_delete;
 
-    Server(){ _isup = 1; _n_task_running = _n_xfer_running = _n_xfer_peering = _n_dele_running = _n_fails = 0; _n_task_redo = 0; _last_task = 0;}
+    Server(){ _isup = 1; _n_task_running = _n_xfer_running = _n_xfer_peering = _n_dele_running = _n_fails = 0; _n_task_redo = 0; _last_task = 0;
+        _last_fail = 0; _load = 0; _disk_free = -1; _fair_slots = -1; _task_slots = -1; _dc = 0; }
     ~Server();
 
     bool too_many_xfers_run(void) const;
@@ -53,6 +65,12 @@ public:
     DISALLOW_COPY(Server);
 };
 
+// how far apart are two servers?
+#define TOPO_SAME		0
+#define TOPO_RACK		1
+#define TOPO_DC			2
+#define TOPO_XDC		3
+
 #define JOB_TODO_STATE_NOTREADY 0
 #define JOB_TODO_STATE_PENDING	1
 #define JOB_TODO_STATE_RUNNING	2
@@ -62,6 +80,7 @@ class ToDo {
 protected:
     Job			*_job;
     string		_xid;
+    int			_stepno;
     int			_serveridx;
     int			_state;
     int			_tries;
@@ -81,6 +100,8 @@ protected:
     virtual void	cancel(void) = 0;
     virtual void	finished(int) = 0;
     virtual void	failed(bool) = 0;
+    virtual void	outsize(const ACPMRMActionStatus *) { }
+    virtual void	usage(const ACPMRMActionStatus *) { }
     void		timedout(void);
     void		retry_or_abort(bool);
     int			start_check(void);
@@ -89,6 +110,7 @@ protected:
 
 public:
     virtual int		start(void) = 0;
+    virtual int		urgency(void) const { return 0; }	// lower starts first
     bool		is_finished(void){ return _state == JOB_TODO_STATE_FINISHED; }
 
     friend class Job;
@@ -99,22 +121,38 @@ class TaskToDo : public ToDo {
     ACPMRMTaskCreate	_g;
     long long		_totalsize;	// map only
     int			_taskno;
+    int			_outserver;	// where the output ended up
+    bool		_speculative;	// a backup for a slow task
+    vector<int>		_replicas;	// map only: other servers with the files
 
     // stats
     hrtime_t		_run_start;
     int			_run_time;
+    long long		_cpu_usec;	// from the task's cgroup
+    long long		_mem_peak;
+    long long		_io_bytes;
 
     TaskToDo		*_replacedby;
     TaskToDo		*_replaces;
     list<ToDo*>		_prerequisite;
+    vector<Delete*>	_outdeles;	// one per outfile, on this server
+    vector<int>		_inbackup;	// where the backup copy of each infile went
+    int			_n_infile_have;	// infiles already on its server
+    vector<long long>	_pushed;	// outfiles already on their consumer's server: size, 0 => no
+    vector<int>		_pushto;	// where each outfile was pushed: server idx, -1 => nowhere
 
     TaskToDo(Job *, int, int);
     int			read_map_plan(FILE*);
-    int			wire_files(int, int, int);
+    int			wire_files(void);
     void		create_xfers(void);
+    void		wire_push(void);
     void		create_deles(void);
     int			replace(int);
     int			replace(void);
+    int			infile_index(int, int);
+    int			infile_backup(int);
+    void		spec_done(void);
+    double		spec_size(void) const;
     void		cancel_light(void);
     void		discard(void);
     virtual int		maybe_start(void);
@@ -123,18 +161,23 @@ class TaskToDo : public ToDo {
     virtual void	cancel(void);
     virtual void	finished(int);
     virtual void	failed(bool);
+    virtual void	outsize(const ACPMRMActionStatus *);
+    virtual void	usage(const ACPMRMActionStatus *);
 
 public:
     virtual int		start(void);
 
     friend class Job;
     friend class Step;
+    friend class XferToDo;
     DISALLOW_COPY(TaskToDo);
 };
 
 class XferToDo : public ToDo {
     ACPMRMFileXfer	_g;
     int			_peeridx;
+    Delete		*_dele;		// the copy
+    TaskToDo		*_consumer;	// the task waiting for it, 0 => a backup copy
 
     virtual int		maybe_start(void);
     virtual int		maybe_replace(bool);
@@ -145,31 +188,49 @@ class XferToDo : public ToDo {
 
 public:
     virtual int		start(void);
+    virtual int		urgency(void) const;
 
-    XferToDo(Job*, const string *, int, int);
+    XferToDo(Job*, int, const string *, int, int);
+    void		add_source(int);
 
     friend class Job;
+    friend class TaskToDo;
     DISALLOW_COPY(XferToDo);
 };
 
+#define JOB_STEP_STATE_WAITING	0
+#define JOB_STEP_STATE_RUNNING	1
+#define JOB_STEP_STATE_FINISHED	2
+
+// the steps form a graph. each step reads the output of its inputs.
 class Step {
     string		_phase;
+    int			_stepno;
     int			_width;
+    int			_state;
+    bool		_is_map;
+    bool		_broadcast;	// every task sees all of the input
+    string		_srchash;	// the program is sent by hash (see jobsrc.cc). empty => inline
 
+    vector<int>		_inputs;	// steps feeding this one
+    vector<int>		_outputs;	// steps consuming this one
     vector<TaskToDo*>	_tasks;
 
     // stats
     hrtime_t		_run_start;
     int			_run_time;
     long long		_xfer_size;
+    long long		_xdc_size;	// xfered between datacenters
     int			_n_xfers_run;
 
-    Step(){ _run_start = 0; _run_time = 0; _xfer_size = 0; _n_xfers_run = 0; _width = 0; }
+    Step(){ _run_start = 0; _run_time = 0; _xfer_size = 0; _xdc_size = 0; _n_xfers_run = 0; _width = 0; _stepno = 0;
+        _state = JOB_STEP_STATE_WAITING; _is_map = 0; _broadcast = 0; }
     ~Step();
     int			read_map_plan(Job *, FILE*);
     void		report_final_stats(Job *);
 
     friend class Job;
+    friend class ToDo;
     friend class XferToDo;
     friend class TaskToDo;
     DISALLOW_COPY(Step);
@@ -193,12 +254,18 @@ class Job {
     long long		_totalmapsize;
     bool		_want_abort;
     int             	_state;
-    int             	_stepno;
     int             	_n_task_running;
     int             	_n_xfer_running;
     int			_n_threads;
+    string		_cachekey;
+    bool		_cache_hit;
+    bool		_dele_ready;	// a step finished, its inputs can go
+    bool		_dele_running;	// the step deletes are running (in their own thread)
+    string		_sharegroup;	// fair share
+    int			_shareweight;
 
     vector<Server*> 	_servers;
+    vector<string>	_datacenters;
     list<ToDo*>     	_running;
     list<ToDo*>     	_pending;
     list<XferToDo*>	_xfers;
@@ -212,37 +279,65 @@ class Job {
     int			_n_xfers_run;
     int             	_n_deleted;
     int			_n_fails;
+    long long		_disk_used;	// intermediate files, all servers
+    long long		_disk_peak;
 
     void		abort(void);
-    int			update(const string*, const string*, int, int);
+    int			update(const string*, const string*, int, int, const ACPMRMActionStatus *g=0);
+    void		update(const ACPMRMActionStatusBatch *, const vector<int> *);
     void		send_eu_msg_x(const char *, const char *) const;
+    void		send_eu_msg_x(const char *, const char *, int) const;
 
     int			plan(void);
+    int			plan_graph(void);
     int			plan_servers(void);
     int			plan_map(void);
+    int			plan_map(int, const string *);
     int			plan_reduce(void);
     int			plan_files(void);
 
+    int			cache_plan(void);
+    int			cache_lookup(void);
+    void		cache_save(void);
+    void		cache_xfer_x(TaskToDo *);
+    void		cache_report(void);
+    int			cache_nfile(void) const;
+
     int			start_step(void);
-    int			start_step_x(void);
-    int			next_step_x(void);
+    int			start_step_x(int);
+    int			update_steps_x(void);
     int			cleanup(void);
     int			stop_tasks(void);
+    void		stop_warm(void);
     int			try_to_do_something(bool);
     int			maybe_start_something_x(void);
     int			check_timeouts(void);
     int			maybe_specexec(void);
+    int			maybe_specexec_x(Step *, int *);
     ToDo*		find_todo_x(const string *) const;
     void		thread_done(void);
 
     int			server_index(const char *);
+    int			backup_server(int);
+    void		update_servers(void);
+    void		update_servers_x(void);
+    int			server_score_x(int, int, int, bool);
+    int			best_server_x(int, const vector<int> *, const vector<int> *extra=0);
+    void		topology_x(void);
+    int			distance_x(int, int) const;
+    int			reduce_dc_x(const Step *, vector<double> *);
+    int			best_replica_x(const vector<int> *, int);
+    int			backup_dst_x(TaskToDo *, TaskToDo *);
+    void		phase_names_x(string *) const;
     void		enrunning_x(ToDo*);
     void		derunning_x(ToDo*);
     void		depending_x(ToDo*);
     void		log_progress(bool);
     void		json(const char *, string *);
-    void		add_delete_x(const string *, int);
+    Delete*		add_delete_x(const string *, int, int);
     void		do_deletes(void);
+    void		do_step_deletes(void);
+    void		disk_used_x(Delete *, long long);
     void		report_final_stats(void);
     float		efficency_x(void);
 
@@ -251,7 +346,7 @@ public:
     ~Job();
     int			init(int, const char *, int);
     int			priority(void){ return _g.priority(); }
-    int			current_width(void){ return _plan[_stepno]->_tasks.size(); }
+    int			step_width(int s){ return _plan[s]->_tasks.size(); }
     void		run(void);
     void		kvetch(const char *m, const char *a=0, const char *b=0, const char *c=0, const char *d=0) const;		// errors
     void		inform(const char *m, const char *a=0, const char *b=0, const char *c=0, const char *d=0) const;		// diags
@@ -259,6 +354,7 @@ public:
     void		report(const char *m, const char *a=0, const char *b=0, const char *c=0, const char *d=0) const;		// stats
     void		notify_finish(void) const;
     void		send_server_list(int);
+    void		run_step_deletes(void);
 
     friend class QueuedJob;
     friend class Step;
@@ -273,7 +369,9 @@ public:
 
 #define TODOSTARTMAX		20		// maximum actions to start at a time
 #define TODOTIMEOUT		30
+#define TODOSLOWFACTOR		4		// more time, if the server is slow (but not down)
 #define TODOMAXFAIL		3
+#define TODOURGENCYBACKUP	1000000		// backup copies go after everything else
 #define JOBMAXTHREAD		5
 
 #endif // __mrquincy_job_h_
@@ -26,6 +26,7 @@ public:
 
 private:
     DISALLOW_COPY(Mutex);
+    friend class CondVar;
 };
 
 // ################################################################
@@ -66,5 +67,24 @@ private:
     DISALLOW_COPY(RWLock);
 };
 
+// ################################################################
+
+// use with a locked Mutex
+class CondVar {
+private:
+    pthread_cond_t _cond;
+
+public:
+    CondVar();
+    ~CondVar();
+    void wait(Mutex *);
+    int  timedwait(Mutex *, int);		// 0 => signaled
+    void signal(void);
+    void broadcast(void);
+
+private:
+    DISALLOW_COPY(CondVar);
+};
+
 
 #endif //__mrquincy_lock_h_
@@ -14,20 +14,30 @@ using std::vector;
 
 
 class MapOutSet;
+class MapPusher;
 class ACPMRMTaskCreate;
 
+// something that takes records, one at a time
+class RecordSink {
+public:
+    virtual ~RecordSink() {};
+    virtual void output(const char *, int) = 0;
+};
+
 class BufferedInput {
     char	*_buf;
     int		_bufsiz;
     int		_curpos;
     int		_fd;
+    long long	_nread;
 
 
 public:
     BufferedInput(int);
     ~BufferedInput();
 
-    void read(MapOutSet *);
+    void read(RecordSink *);
+    long long nread(void) const { return _nread; }
 
 };
 
@@ -66,18 +76,46 @@ public:
     virtual void close(void);
 };
 
+// compressed, in blocks, each sent to the consumer as it is written
+// (a file of concatenated gzip members is still a gzip file)
+class PushMapOutput : public MapOutput {
+    int		_fd;
+    string	_buf;		// waiting to be compressed
+    MapPusher	*_pusher;
+    int		_idx;
+
+    void _flush(bool);
+public:
+    PushMapOutput(const char *, MapPusher *, int);
+    virtual ~PushMapOutput() {}
+    virtual void output(const char *, int);
+    virtual void close(void);
+};
+
 //****************************************************************
 
-class MapOutSet {
+// outfiles are divided into groups, one per consumer
+struct MapOutGroup {
+    int				_start;
+    int				_nfile;
+    bool			_broadcast;	// every record to every file
+};
+
+class MapOutSet : public RecordSink {
     int				_nfile;
     vector<MapOutput*>		_file;
+    vector<MapOutGroup>		_group;
+    MapPusher			*_pusher;	// 0 => not pushing
 
 public:
     MapOutSet(const ACPMRMTaskCreate*);
 
-    void output(const char *, int);
+    virtual void output(const char *, int);
     void close(void);
+    bool pushed(int) const;
 };
 
 
+extern int split_record(const char *, int, const char **, int *, const char **, int *);
+
 #endif // __mrquincy_mapio_h_
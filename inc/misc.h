@@ -30,12 +30,19 @@ inline int probability(float p){ return random() < p * 0x7FFFFFFF; }
 #  define ATOMIC_SETPTR(a,b)		((a)  = (b))
 #  define ATOMIC_ADD32(a,b)		((a) += (b))
 #  define ATOMIC_ADD64(a,b)		((a) += (b))
+#  define ATOMIC_LOADPTR(a)		(a)
+#  define MEMBAR_FULL()
 #else
 #  define ATOMIC_SET32(a,b)		atomic_swap_32( (uint32_t*)&a, b )
 #  define ATOMIC_SET64(a,b)		atomic_swap_64( (uint64_t*)&a, b )
 #  define ATOMIC_SETPTR(a,b)		atomic_swap_ptr( &a, b)
 #  define ATOMIC_ADD32(a,b)		atomic_add_32(  (uint32_t*)&a, b )
 #  define ATOMIC_ADD64(a,b)		atomic_add_64(  (uint64_t*)&a, b )
+#  define ATOMIC_LOADPTR(a)		atomic_loadptr( &(a) )
+#  define MEMBAR_FULL()			membar_enter()
+
+// load, and read nothing through it before the load
+template <class T> inline T *atomic_loadptr(T * volatile *a){ T *v = *a; membar_consumer(); return v; }
 #endif
 
 
@@ -0,0 +1,63 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Jul-21 14:30 (EDT)
+  Function: run native plugins in the task process
+
+*/
+
+#ifndef __mrquincy_native_h_
+#define __mrquincy_native_h_
+
+#include "plugin.h"
+#include "mapio.h"
+
+#include <vector>
+#include <map>
+using std::vector;
+using std::map;
+
+class EUConsole;
+
+class NativeProg : public RecordSink {
+    void			*_dl;
+    const struct mrq_plugin	*_plugin;
+    bool			_is_map;
+    int				_err;
+    MapOutSet			*_out;
+    EUConsole			*_eu;
+    int				_savefd;
+    struct mrq_emit		_emit;
+    string			_line;		// output record
+
+    // reduce: the current key, and its values
+    bool			_havekey;
+    string			_key;
+    vector<string>		_vals;
+    long long			_valsize;
+    bool			_truncated;
+    int				_group_max;	// limit the values buffered per key
+    long long			_group_maxsize;
+
+    // map: output waiting to be combined
+    bool			_combining;
+    map<string, vector<string> > _comb;
+    int				_combsize;
+
+    void _reduce(void);
+    void _combine(void);
+    void _write(const char *, int, const char *, int);
+
+public:
+    NativeProg(const char *, const ACPMRMTaskCreate *, MapOutSet *, EUConsole *, int);
+    virtual ~NativeProg();
+
+    virtual void output(const char *, int);
+    int  finish(void);
+    void emit(const char *, int, const char *, int);
+    void print(const char *, int);
+};
+
+extern bool native_prog(const string *);
+
+#endif // __mrquincy_native_h_
@@ -21,6 +21,8 @@ using std::string;
 #define PORT_MRQUINCY	3504
 #define PORT_CONSOLE	3502
 
+#define UDPMAXSIZE	16384		// largest udp request we accept
+
 typedef unsigned char uchar;
 
 struct NetAddr {
@@ -63,6 +65,8 @@ typedef struct {
 # define PHMT_MR_DIAGMSG	22
 # define PHMT_MR_XFERSTATUS	23
 # define PHMT_MR_STATUS		24
+# define PHMT_MR_STATUSBATCH	25
+# define PHMT_MR_PUSH		26
 
 
 // ...
@@ -71,6 +75,7 @@ typedef struct {
 # define PHFLAG_ISERROR		0x4
 # define PHFLAGS_DATA_ENCR	0x8
 # define PHFLAGS_CONT_ENCR	0x10
+# define PHFLAGS_DATA_GZIP	0x20	// data: 4 byte length, zlib stream
 } protocol_header;
 
 class NTD {
@@ -111,6 +116,7 @@ extern uint32_t myipv4;
 extern char     myhostname[];
 extern string   myserver_id;
 extern string   mydatacenter;
+extern string   myrack;
 extern NetAddr  mynetaddr;
 extern string   myipandport;
 extern int udp4_fd;
@@ -122,15 +128,19 @@ extern void cvt_header_from_network(protocol_header *);
 extern void cvt_header_to_network(protocol_header *);
 
 extern int tcp_connect(NetAddr *, int);
+extern int parse_addr(const char *, NetAddr *);
 extern int read_to(int, char *, int, int);
 extern int write_to(int, const char *, int, int);
 extern int sendfile_to(int, int, int, int);
+class TokenBucket;
+extern int sendfile_range(int, int, long long, int, int, TokenBucket *tb=0);
 extern int tcp_read_proto(int, int);
 
 extern int reply_ok(NTD*);
 extern int reply_error(NTD*, int, const char*);
 extern int write_request(NTD*, int reqno, google::protobuf::Message *g, int contlen, int to);
 extern int write_reply(NTD *, google::protobuf::Message *g, int contlen, int to);
+extern int write_reply_data(NTD *, const string *, int contlen, int to);
 extern int read_proto(NTD *, int, int);
 extern void toss_request(int, NetAddr*,    int, google::protobuf::Message *);
 extern void toss_request(int, const char*, int, google::protobuf::Message *);
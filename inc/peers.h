@@ -12,11 +12,13 @@
 #include "lock.h"
 #include <list>
 #include <string>
+#include <tr1/unordered_map>
 using std::list;
 using std::string;
+using std::tr1::unordered_map;
 
 class ACPMRMStatus;
-class ACPMRMStatusReply;
+class ACPMRMStatusRequest;
 
 
 #define PEER_STATUS_UNK		0
@@ -26,6 +28,31 @@ class ACPMRMStatusReply;
 #define PEER_STATUS_SCEPTICAL	4
 #define PEER_STATUS_DEAD	5
 
+// suspicion levels (phi)
+#define PHI_SUSPECT	3.0	// late. probably busy, maybe down
+#define PHI_DOWN	8.0	// down
+
+#define PHIWINDOW	64	// heartbeat intervals remembered
+
+
+// phi accrual failure detector (Hayashibara, et al.)
+// rather than yes/no, how unlikely is it that we would not have
+// heard from it in this long, given how often we usually do?
+class PhiAccrual {
+    hrtime_t		_last;
+    int			_n, _pos;
+    int			_hist[PHIWINDOW];
+    double		_sum, _sumsq;
+
+public:
+    PhiAccrual()	{ _last = 0; _n = _pos = 0; _sum = _sumsq = 0; }
+    void heartbeat(hrtime_t);
+    bool usable(void) const;
+    void estimate(hrtime_t *, float *, float *) const;	// last, mean, stddev
+};
+
+extern float phi_accrual(hrtime_t, float, float);	// since last, mean, stddev
+
 
 class Peer {
 
@@ -37,6 +64,10 @@ class Peer {
 
     const char 		*_id;		// server_id
     ACPMRMStatus 	*_gstatus;
+    string		_wire;		// _gstatus, serialized for replies
+    PhiAccrual		_hb;		// when we hear new status
+
+    void _serialize(void);
 
 public:
     NetAddr		bestaddr;
@@ -49,7 +80,6 @@ protected:
     void is_up(void);
     void is_down(void);
     void maybe_down(void);
-    void status_reply(ACPMRMStatus*) const ;	// add status to reply
     int  status(void) const { return _status; }
 
 
@@ -60,43 +90,97 @@ protected:
 
 /****************************************************************/
 
+// what the scheduler needs to know about a peer
+struct PeerSnapEnt {
+    int			status;		// PEER_STATUS_*
+    NetAddr		*addr;		// the Peer's - valid until it leaves the graveyard
+    ACPMRMStatus	*g;		// metrics + shares
+    hrtime_t		hb_last;	// heartbeat estimate, for phi
+    float		hb_mean;
+    float		hb_std;
+};
+
+// an immutable copy of the peer db, for readers
+class PeerSnap {
+    unordered_map<string, PeerSnapEnt>	_peers;
+    uint64_t				_epoch;		// replaced during this epoch
+
+    ~PeerSnap();
+    const PeerSnapEnt *find(const char *) const;
+
+    friend class PeerDB;
+    friend class PeerSnapRef;
+};
+
+class PeerDB;
+
+// a reader's hold on the current snapshot. keep it on the stack (see peerdb.cc)
+class PeerSnapRef {
+    const PeerSnap	*_s;
+public:
+    PeerSnapRef(PeerDB *);
+    ~PeerSnapRef();
+    const PeerSnapEnt *find(const char *id) const { return _s->find(id); }
+};
+
 class PeerDB {
 
     RWLock	_lock;
     list<Peer*>	_allpeers;
     list<Peer*>	_sceptical;
     list<Peer*> _graveyard;
+    unordered_map<string, Peer*> _index;	// allpeers + sceptical
+
+    PeerSnap * volatile _snap;	// readers use this, without locking
+    volatile uint64_t _epoch;	// the snapshot generation
+    list<PeerSnap*> _retired;	// until no reader can still be using them
+    bool	_dirty;
+    hrtime_t	_snaptime;
 
+    // lock held:
     void _upgrade(Peer*);	// sceptical -> allpeers
     void _kill(Peer*);		// * -> graveyard
     Peer *_find(const char *);
+    void _changed(void);
+    void _publish(void);
 
 public:
     void add_peer(ACPMRMStatus*g);
     void add_sceptical(ACPMRMStatus*g);
-    void reply_peers(ACPMRMStatusReply *);
+    void reply_peers(const ACPMRMStatusRequest *, string *);
+    void digest(ACPMRMStatusRequest *);
     Peer *find(const char *);
     NetAddr *find_addr(const char*);
     bool is_it_up(const char *);
     int current_load(const char *);
+    int current_disk(const char *);
+    int basedir(const char *, string *, string *);
+    int fair_slots(const char *, const string *, int);
+    int spec_running(void);
+    int task_slots(const char *);
     Peer *random(void);
     void peer_up(const char*);
     void peer_dn(const char*);
     void cleanup(void);
     int  report(NTD*);
     void getall( list<NetAddr> *);
+    void refresh(void);
+    float suspicion(const char*);
+    void topology(const char*, string *, string *);
 
 protected:
-    PeerDB()	{};
+    PeerDB()	{ _snap = new PeerSnap; _epoch = 1; _dirty = 0; _snaptime = 0; };
     ~PeerDB();
     DISALLOW_COPY(PeerDB);
 
     friend void peerdb_init(void);
+    friend class PeerSnapRef;
 };
 
 extern PeerDB *peerdb;
 
 void about_myself(ACPMRMStatus *);
+void wire_status(string *, const ACPMRMStatus *);
 
 
 
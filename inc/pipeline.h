@@ -14,9 +14,21 @@ class ACPMRMTaskCreate;
 class Pipeline {
     int		_pid;
     int		_inpid;
+    int		_inexit;	// the input pipeline's exit status, -1 => not yet collected
+    bool	_framed;	// the input goes through the framer
     string	_tmpfile;
+    bool	_warm;		// running in a warm worker
+    bool	_native;	// no program, the task process runs a plugin
+    int		_statfd;	// the worker reports on this
+    string	_statbuf;
+    string	_warmdir;	// our fifos
 
     void _cleanup(void);
+    int  _frame_exit(int);
+    void _warm_remove(void);
+    int  _warm_start(const ACPMRMTaskCreate *, int *, int *, int *, int *);
+    int  _warm_request(const string *, int);
+    int  _warm_status(const char *, int, int *);
 public:
     Pipeline(const ACPMRMTaskCreate *, int*);
     ~Pipeline();
@@ -24,6 +36,8 @@ public:
     void abort(void);
     void done(void){ _cleanup(); }
     bool still_producing(void);
+    bool native(void) const { return _native; }
+    const char *native_file(void) const { return _tmpfile.c_str(); }
 };
 
 
@@ -0,0 +1,71 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Jul-21 13:08 (EDT)
+  Function: native (C/C++) map/reduce plugins
+
+*/
+
+#ifndef __mrquincy_plugin_h_
+#define __mrquincy_plugin_h_
+
+// a job section may be a shared object instead of a script.
+// the task process loads it and calls it directly, no pipes, no
+// separate program, no parsing + re-encoding every record.
+//
+// the plugin exports:
+//   const struct mrq_plugin *mrquincy_plugin(void);
+//
+// keys and values are json text, exactly as they appear in the
+// intermediate files: eg. key "\"foo\"" or "123", value "{\"n\":1}"
+// map records are the raw input lines (without the newline)
+//
+// this is a C ABI. only add to the end of the structs, and bump the version.
+
+#define MRQ_PLUGIN_VERSION	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mrq_emit {
+    void	*ctx;
+    // output a key + value
+    void	(*emit)(struct mrq_emit *, const char *key, int keylen, const char *val, int vallen);
+    // send text to the end-user's stdout
+    void	(*print)(struct mrq_emit *, const char *buf, int len);
+};
+
+// the values for one key. they are buffered in memory,
+// use the job's groupmax + groupmaxsize to limit them
+struct mrq_iter {
+    void	*ctx;
+    // 1 => val set, 0 => no more
+    int		(*next)(struct mrq_iter *, const char **val, int *vallen);
+};
+
+// return 0 on success, anything else fails the task
+struct mrq_plugin {
+    int		version;	// MRQ_PLUGIN_VERSION
+
+    // optional. phase: "map", "reduce/0", ...
+    int		(*init)(const char *phase);
+    // for map sections
+    int		(*map)(const char *rec, int len, struct mrq_emit *);
+    // optional. applied to map output, on the map server
+    int		(*combine)(const char *key, int keylen, struct mrq_iter *, struct mrq_emit *);
+    // for reduce + final sections
+    int		(*reduce)(const char *key, int keylen, struct mrq_iter *, struct mrq_emit *);
+    // optional. at the end of the task
+    int		(*finish)(struct mrq_emit *);
+};
+
+typedef const struct mrq_plugin *(*mrq_plugin_f)(void);
+
+#define MRQ_PLUGIN_SYMBOL	"mrquincy_plugin"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __mrquincy_plugin_h_
@@ -0,0 +1,76 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Aug-06 15:22 (EDT)
+  Function: push map output to the consumers, as it is written
+
+*/
+
+#ifndef __mrquincy_push_h_
+#define __mrquincy_push_h_
+
+#include "lock.h"
+#include "crypto.h"
+
+#include <vector>
+#include <list>
+using std::vector;
+using std::list;
+
+class ACPMRMTaskCreate;
+
+#define PUSH_SENDING	0
+#define PUSH_FAILED	1
+#define PUSH_DONE	2
+
+struct PushBlock {
+    int			file;		// outfile index
+    long long		off;
+    string		data;
+    bool		last;		// => hash of the whole file
+    string		hash;
+};
+
+class MapPusher;
+
+struct PushDest {
+    MapPusher		*pusher;
+    string		addr;		// ipaddr:port
+    int			fd;		// -1 => not connected
+    bool		failed;
+    bool		running;	// has a thread
+    list<PushBlock*>	queue;
+
+    PushDest(){ pusher = 0; fd = -1; failed = 0; running = 0; }
+};
+
+// one connection + thread per destination server
+// blocks for each file are sent in order, verified at the end, then committed
+class MapPusher {
+    Mutex		_lock;
+    CondVar		_cond;
+    string		_source;	// the taskid
+    long long		_qsize;		// bytes waiting to be sent
+    int			_nthread;
+    bool		_closing;
+
+    vector<string>	_file;		// outfile names
+    vector<int>		_dest;		// each file: index into _dests, -1 => not pushed
+    vector<char>	_state;		// PUSH_*
+    vector<long long>	_size;		// so far
+    vector<HashSHA1*>	_hash;
+    vector<PushDest*>	_dests;
+
+    int  _send(PushDest *, PushBlock *);
+public:
+    MapPusher(const ACPMRMTaskCreate *);
+    ~MapPusher();
+
+    bool wants(int i) const { return _dest[i] != -1; }
+    bool pushed(int i) const { return _state[i] == PUSH_DONE; }
+    void send(int, const char *, int, bool);
+    void finish(void);
+    void run(PushDest *);
+};
+
+#endif // __mrquincy_push_h_
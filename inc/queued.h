@@ -11,32 +11,90 @@
 
 #include "mrmagoo.pb.h"
 
+#include <vector>
+#include <map>
+#include <tr1/unordered_map>
+using std::vector;
+using std::map;
+using std::tr1::unordered_map;
+
+
 class QueueElem {
     int			_prio;
+    long long		_seq;		// fifo within a priority
     hrtime_t		_last_status;
     void		*_elem;
     string		_id;
+    string		_group;		// fair share group
+    int			_weight;
+    int			_heappos;	// -1 => running
+    list<QueueElem*>::iterator _runpos;
 
-    QueueElem(void* x, const char *id, int p){ _prio = p; _elem = x; _id = id; }
+    QueueElem(void* x, const char *id, int p){ _prio = p; _elem = x; _id = id; _weight = 1; _seq = 0; _heappos = -1; }
+    static bool before(const QueueElem *a, const QueueElem *b){
+        return (a->_prio < b->_prio) || (a->_prio == b->_prio && a->_seq < b->_seq);
+    }
 
     friend class Queued;
+    friend class QueueGroup;
     friend class QueuedTask;
     friend class QueuedXfer;
     friend class QueuedJob;
 };
 
+// the queued elems of one fair share group, a heap in priority order
+class QueueGroup {
+    vector<QueueElem*>	_heap;
+    int			_nrunning;
+    int			_weight;
+
+    QueueGroup(){ _nrunning = 0; _weight = 1; }
+    void _set(int, QueueElem*);
+    void _up(int);
+    void _down(int);
+    void push(QueueElem*);
+    void remove(QueueElem*);
+    QueueElem *top(void) const { return _heap.empty() ? 0 : _heap[0]; }
+
+    friend class Queued;
+};
+
 class Queued {
 protected:
     RWLock		_lock;
-    list<QueueElem*>	_queue;
     list<QueueElem*>	_running;
+    int			_nrunning;
+    int			_nqueued;
+    long long		_seq;
+    unordered_map<string, QueueElem*>	_index;		// by id
+    unordered_map<void*, QueueElem*>	_byelem;
+    map<string, QueueGroup*>		_groups;
+
+    Mutex		_wakelock;
+    CondVar		_wake;
+    int			_kick;
+
+    QueueElem  *_next_x(void);
+    QueueElem  *_find_x(const char *);
+    QueueGroup *_group_x(const QueueElem *);
+    void _run_x(QueueElem *);
+    void _remove_x(QueueElem *);
+    void _queued_x(vector<QueueElem*> *);
+    void _status_x(QueueElem *, hrtime_t, map<string,ACPMRMActionStatusBatch> *);
 
 public:
+    Queued() { _nrunning = 0; _nqueued = 0; _seq = 0; _kick = 0; }
     int  nrunning(void);
     void start_more(int);
+    void send_statuses(void);
+    void start_dispatch(void);
+    void dispatch(void);
+    void wakeup(void);
+    virtual int max_running(void) = 0;
     bool is_dupe(const char *);
     virtual void start(void*) = 0;
     virtual void send_status(void*) = 0;
+    virtual const string *status1(void*, ACPMRMActionStatus*) { return 0; }	// => master
     virtual void json1(const char *, void *, string *) = 0;
     void shutdown(void);
     virtual void _abort_q(void*) = 0;
@@ -45,14 +103,18 @@ public:
     void json(string *);
     void abort(const char *);
 
-    void start_or_queue(void*, const char *, int, int);
+    void share_status(ACPMRMStatus *);
+
+    void start_or_queue(void*, const char *, int, int, const string *group=0, int weight=1);
 };
 
 class QueuedXfer : public Queued {
 
 public:
+    virtual int  max_running(void);
     virtual void start(void*);
     virtual void send_status(void*);
+    virtual const string *status1(void*, ACPMRMActionStatus*);
     virtual void json1(const char *, void *, string *);
     virtual void _abort_q(void*);
     virtual void _abort_r(void*) {};
@@ -61,16 +123,21 @@ public:
 class QueuedTask : public Queued {
 
 public:
+    virtual int  max_running(void);
     virtual void start(void*);
     virtual void send_status(void*);
+    virtual const string *status1(void*, ACPMRMActionStatus*);
     virtual void json1(const char *, void *, string *);
     virtual void _abort_q(void*);
     virtual void _abort_r(void*);
+
+    void measure(void);
 };
 
 class QueuedJob : public Queued {
 
 public:
+    virtual int  max_running(void);
     virtual void start(void*);
     virtual void send_status(void*) {};
     virtual void json1(const char *, void *, string *);
@@ -78,6 +145,7 @@ public:
     virtual void _abort_r(void*);
 
     int  update(ACPMRMActionStatus*);
+    void update(const ACPMRMActionStatusBatch*, vector<int>*);
 };
 
 
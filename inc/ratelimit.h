@@ -0,0 +1,38 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Aug-04 12:10 (EDT)
+  Function: limit file transfer bandwidth
+
+*/
+
+#ifndef __mrquincy_ratelimit_h_
+#define __mrquincy_ratelimit_h_
+
+#include "lock.h"
+#include "hrtime.h"
+
+#define RATECHUNK	(256 * 1024)	// take tokens at least this often
+
+class TokenBucket {
+    Mutex		_lock;
+    long long		_rate;		// bytes/sec, 0 => unlimited
+    double		_tokens;	// may go negative, someone is waiting
+    hrtime_t		_last;
+
+public:
+    int			_refs;		// per job buckets
+
+    TokenBucket(){ _rate = 0; _tokens = 0; _last = 0; _refs = 0; }
+    void set_rate(long long);
+    void take(long long);
+};
+
+extern TokenBucket xfer_net_tb;		// sending, all files
+extern TokenBucket xfer_disk_tb;	// receiving, all files
+
+extern void ratelimit_update(void);
+extern TokenBucket *ratelimit_job(const string *);
+extern void ratelimit_job_done(TokenBucket *);
+
+#endif // __mrquincy_ratelimit_h_
@@ -67,6 +67,11 @@ sub compile {
     $me->{job}{options} = $mrc->options();
     $me->{job}{section} = $mrj;
 
+    # do not use a previously cached result
+    $me->{job}{cache} = 0 if $mrc->config('nocache');
+    # send map output to the reducers as it is written
+    $me->{job}{push}  = 1 if $mrc->config('push');
+
     return $me;
 }
 
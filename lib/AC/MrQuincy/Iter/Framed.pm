@@ -0,0 +1,83 @@
+# -*- perl -*-
+
+# Copyright (c) 2014
+# Author: Jeff Weisberg <jaw @ solvemedia.com>
+# Created: 2014-Jul-23 10:17 (EDT)
+# Function: iterate over reduce input, already grouped by key
+
+package AC::MrQuincy::Iter::Framed;
+use AC::MrQuincy::Iter;
+use JSON;
+our @ISA = 'AC::MrQuincy::Iter';
+use strict;
+
+# the daemon sends (see pipeline.cc):
+#   K key
+#   value
+#   ...
+#   E
+
+my $json = JSON->new->allow_nonref;
+
+sub new {
+    my $class = shift;
+    my $fd    = shift;
+
+    return bless {
+        fd	=> $fd,
+    }, $class;
+}
+
+sub key {
+    my $me = shift;
+
+    my $fd = $me->{fd};
+
+    # skip any values the program did not want
+    while( defined(my $l = <$fd>) ){
+        next unless $l =~ /^K (.*)/;
+
+        $me->{ingroup} = 1;
+        $me->{key}     = $json->decode($1);
+        return $me->{key};
+    }
+
+    return;	# eof
+}
+
+sub _next {
+    my $me = shift;
+
+    return (undef, 1) unless $me->{ingroup};
+
+    my $fd = $me->{fd};
+    my $l  = <$fd>;
+
+    if( !defined($l) || $l eq "E\n" ){
+        # end of key
+        $me->{ingroup} = 0;
+        return (undef, 1);
+    }
+
+    return $json->decode($l);
+}
+
+# no need to decode anything
+sub count {
+    my $me = shift;
+
+    return 0 unless $me->{ingroup};
+
+    my $fd = $me->{fd};
+    my $n  = 0;
+
+    while( defined(my $l = <$fd>) ){
+        last if $l eq "E\n";
+        $n ++;
+    }
+
+    $me->{ingroup} = 0;
+    return $n;
+}
+
+1;
@@ -7,10 +7,16 @@
 
 package AC::MrQuincy::Runtime;
 use AC::MrQuincy::Iter::File;
+use AC::MrQuincy::Iter::Framed;
 use AC::Import;
 use JSON;
+use Fcntl qw(:DEFAULT :flock);
+use POSIX qw(mkfifo :sys_wait_h);
 use strict;
 
+my $WARMMAX	= 100;		# recycle the worker after this many tasks
+my $WARMIDLE	= 60;		# or when idle this long (eg. the job finished)
+
 sub new {
     my $class = shift;
     my $conf  = shift;
@@ -76,4 +82,154 @@ sub print {
     print @_;
 }
 
+################################################################
+# warm workers (see pipeline.cc)
+# the daemon starts us with MRQUINCY_WARM=dir, instead of once per task.
+# each task's request arrives on dir/ctl, naming a directory of fifos.
+# we fork a child to run it, so tasks cannot disturb each other,
+# but the interpreter, modules, and program are only loaded once.
+
+sub run {
+    my $me   = shift;
+    my $task = shift;
+
+    my $dir = $ENV{MRQUINCY_WARM};
+    return $task->() unless $dir;
+
+    $me->warm_loop( $dir, $ENV{MRQUINCY_WARMMAX} || $WARMMAX, $task );
+    exit 0;
+}
+
+sub warm_loop {
+    my $me   = shift;
+    my $dir  = shift;
+    my $max  = shift;
+    my $task = shift;
+
+    # only one worker per job + phase
+    open( my $lock, '>>', "$dir/lock" ) || return;
+    flock( $lock, LOCK_EX ) || return;
+
+    if( sysopen( my $fd, "$dir/ctl", O_WRONLY | O_NONBLOCK ) ){
+        # someone is already listening
+        return;
+    }
+
+    unlink "$dir/ctl";
+    mkfifo( "$dir/ctl", 0600 ) || return;
+    chmod 0600, "$dir/ctl";
+    sysopen( my $ctl, "$dir/ctl", O_RDWR ) || return;
+    flock( $lock, LOCK_UN );
+
+    # task directories are made next to ours: jobdir/t...
+    my($jobdir) = $dir =~ m|^(.*)/[^/]+$|;
+
+    $me->{warmctl}  = $ctl;
+    $me->{warmjob}  = $jobdir;
+    $me->{warmkids} = {};
+
+    my $ntask = 0;
+    my $idle  = time();
+    my $buf   = '';
+    my $quit;
+
+    while( $ntask < $max && !$quit ){
+        $me->warm_reap();
+
+        my $rin = '';
+        vec($rin, fileno($ctl), 1) = 1;
+
+        unless( select($rin, undef, undef, 1) > 0 ){
+            last if !keys(%{$me->{warmkids}}) && time() - $idle > $WARMIDLE;
+            next;
+        }
+
+        sysread( $ctl, $buf, 8192, length($buf) ) || next;
+        $idle = time();
+
+        while( $buf =~ s/^(.*)\n// ){
+            my $req = $1;
+            # the job is over (see pipeline_warm_stop)
+            if( $req eq 'quit' ){
+                $quit = 1;
+                last;
+            }
+            $me->warm_task( $req, $task );
+            $ntask ++;
+        }
+    }
+
+    # no new requests, finish any that already arrived
+    flock( $lock, LOCK_EX );
+    unlink "$dir/ctl";
+    unlink "$dir/lock";
+    rmdir  $dir;
+    flock( $lock, LOCK_UN );
+
+    fcntl( $ctl, F_SETFL, O_NONBLOCK );
+    while( sysread( $ctl, $buf, 8192, length($buf) ) ){ }
+    while( !$quit && $buf =~ s/^(.*)\n// ){
+        my $req = $1;
+        $quit = 1 if $req eq 'quit';
+        $me->warm_task( $req, $task ) unless $quit;
+    }
+    close $ctl;
+
+    # anything still running belongs to an aborted job
+    kill 'KILL', map { -$_ } keys %{$me->{warmkids}} if $quit;
+
+    while( keys %{$me->{warmkids}} ){
+        $me->warm_reap();
+        sleep 1;
+    }
+}
+
+sub warm_task {
+    my $me   = shift;
+    my $tdir = shift;
+    my $task = shift;
+
+    # only our own job's task directories
+    my $jobdir = $me->{warmjob};
+    return unless defined $jobdir && $tdir =~ m|^\Q$jobdir\E/t[-\w+=]+$|;
+    return if -l $tdir || ! -d _ || (stat _)[4] != $>;
+
+    # the task is no longer waiting?
+    sysopen( my $st, "$tdir/status", O_WRONLY | O_NONBLOCK ) || return;
+
+    my $pid = fork();
+    return unless defined $pid;
+
+    unless( $pid ){
+        close $me->{warmctl};
+        # so the task, and anything it starts, can be killed together
+        setpgrp(0, 0);
+
+        open( STDIN,  '<', "$tdir/in"  ) || POSIX::_exit(1);
+        open( STDOUT, '>', "$tdir/out" ) || POSIX::_exit(1);
+        open( STDERR, '>', "$tdir/err" ) || POSIX::_exit(1);
+        open( STDDAT, '>', "$tdir/dat" ) || POSIX::_exit(1);
+        select STDDAT; $| = 1;
+        select STDOUT; $| = 1;
+
+        $task->();
+        exit 0;
+    }
+
+    syswrite( $st, "pid $pid\n" );
+    $me->{warmkids}{$pid} = $st;
+}
+
+# tell the task how it went
+sub warm_reap {
+    my $me = shift;
+
+    while( (my $pid = waitpid(-1, WNOHANG)) > 0 ){
+        my $st = delete $me->{warmkids}{$pid};
+        next unless $st;
+        syswrite( $st, "exit $?\n" );
+        close $st;
+    }
+}
+
 1;
@@ -11,6 +11,7 @@ use AC::MrQuincy::Submit::Compile::Perl;
 use AC::MrQuincy::Submit::Compile::Raw;
 use AC::MrQuincy::Submit::Compile::Ruby;
 use AC::MrQuincy::Submit::Compile::Python;
+use AC::MrQuincy::Submit::Compile::Native;
 use JSON;
 use strict;
 
@@ -41,6 +42,9 @@ sub compile {
     if( $parse->{lang} eq 'python' ){
         return compile_python( $me, $parse );
     }
+    if( $parse->{lang} eq 'native' ){
+        return compile_native( $me, $parse );
+    }
     if( $parse->{lang} eq 'bash' ){
         return compile_bash( $me, $parse );
     }
@@ -66,6 +70,27 @@ sub options {
     return encode_json( $me->{config} || {} );
 }
 
+# the job graph. by default, each section reads the one before it.
+# sections are numbered: the maps (in order), the reduces, then final
+#   input     => comma separated list of section numbers
+#   partition => hash | broadcast
+# a map with attrs gets its own planner options: the job's, plus its attrs
+sub section_graph {
+    my $me  = shift;
+    my $job = shift;
+    my $sec = shift;
+
+    my $attr = $sec->{attr} || {};
+    $job->{input}     = [ map { int } split /\s*,\s*/, $attr->{input} ] if defined $attr->{input};
+    $job->{partition} = $attr->{partition} if defined $attr->{partition};
+
+    if( $job->{phase} eq 'map' && %$attr ){
+        $job->{options} = encode_json( { %{ $me->{config} || {} }, %$attr } );
+    }
+
+    return $job;
+}
+
 
 sub config {
     my $me    = shift;
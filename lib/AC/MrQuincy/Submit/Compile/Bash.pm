@@ -21,7 +21,9 @@ sub compile_bash {
 
     # there is no init section
 
-    push @job, compile_map( $comp, $prog );
+    for my $i (0 .. @{$prog->{map}}-1){
+        push @job, compile_map( $comp, $prog, $i );
+    }
     if( $prog->{reduce} ){
         for my $i (0 .. @{$prog->{reduce}}-1){
             push @job, compile_reduce( $comp, $prog, $i );
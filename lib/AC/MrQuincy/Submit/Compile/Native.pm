@@ -0,0 +1,78 @@
+# -*- perl -*-
+
+# Copyright (c) 2014
+# Author: Jeff Weisberg <jaw @ solvemedia.com>
+# Created: 2014-Jul-21 16:02 (EDT)
+# Function: native plugins (see inc/plugin.h)
+
+package AC::MrQuincy::Submit::Compile::Native;
+use AC::Import;
+use AC::Dumper;
+use strict;
+
+our @EXPORT = 'compile_native';
+
+# each section names a shared object:
+#   <%map>
+#     /home/me/lib/wordcount.so
+#   </%map>
+# one plugin may serve several sections, it is told which
+
+sub compile_native {
+    my $comp  = shift;
+    my $parse = shift;
+
+    my $prog = $parse->{content};
+
+    my @job;
+
+    for my $m (@{$prog->{map}}){
+        push @job, section($comp, 'map', $m);
+    }
+
+    if( $prog->{reduce} ){
+        for my $i (0 .. @{$prog->{reduce}}-1){
+            push @job, section($comp, "reduce/$i", $prog->{reduce}[$i]);
+        }
+    }
+
+    if( $prog->{final} ){
+        push @job, section($comp, 'final', $prog->{final});
+    }
+
+    return \@job;
+}
+
+sub section {
+    my $comp = shift;
+    my $name = shift;
+    my $sec  = shift;
+
+    my($file) = $sec->{code} =~ /^\s*(\S+)/m;
+    die "section $name: no plugin specified\n" unless $file;
+
+    open(my $fd, '<', $file) || die "cannot open plugin $file: $!\n";
+    local $/ = undef;
+    my $so = <$fd>;
+    close $fd;
+
+    die "section $name: $file is not a shared object\n" unless $so =~ /^\x7fELF/;
+
+    my $job = {
+        phase	=> $name,
+        src	=> $so,
+        maxrun	=> $comp->config( 'maxrun',      $sec ),
+        timeout => $comp->config( 'tasktimeout', $sec ),
+        width	=> $comp->config( 'taskwidth',   $sec ),
+    };
+
+    # the plugin's reduce gets each key's values all at once. limit them
+    unless( $name eq 'map' ){
+        $job->{group_max}     = int($comp->config( 'groupmax',     $sec )) if $comp->config( 'groupmax',     $sec );
+        $job->{group_maxsize} = int($comp->config( 'groupmaxsize', $sec )) if $comp->config( 'groupmaxsize', $sec );
+    }
+
+    return $comp->section_graph( $job, $sec );
+}
+
+1;
@@ -39,7 +39,9 @@ sub compile_perl {
 
     $comp->{initjs} ||= encode_json({});
 
-    push @job, compile_map( $comp, $prog );
+    for my $i (0 .. @{$prog->{map}}-1){
+        push @job, compile_map( $comp, $prog, $i );
+    }
     if( $prog->{reduce} ){
         for my $i (0 .. @{$prog->{reduce}}-1){
             push @job, compile_reduce( $comp, $prog, $i );
@@ -144,27 +146,37 @@ __END_OF_INITRES_$uniq\__
 EOCOMMON
     ;
 
+    # warm: compile once, the runtime runs the loop for each task
+    my $warm = $comp->config( 'warmtasks', $sec );
+
     $code .= "{\n";
     $code .= $sec->{init} if $sec->{init};
     $code .= "\nsub program {\n$sec->{code}\nreturn;\n}\n";
+    $code .= "\$R->run( sub {\n" if $warm;
     $code .= $loop;
     $code .= "sub { " . $sec->{cleanup} . "\n}->();\n" if $sec->{cleanup};
+    $code .= "});\n" if $warm;
     $code .= "}\n";
 
-    return {
+    my $job = {
         phase	=> $name,
         maxrun	=> $comp->config( 'maxrun',      $sec ),
         timeout => $comp->config( 'tasktimeout', $sec ),
         width	=> $comp->config( 'taskwidth',   $sec ),
         src	=> $code,
     };
+
+    $job->{warm} = int($warm) if $warm;
+
+    return $comp->section_graph( $job, $sec );
 }
 
 sub compile_map {
     my $comp = shift;
     my $prog = shift;
+    my $nmap = shift;
 
-    my $sec = $prog->{map};
+    my $sec = $prog->{map}[$nmap];
 
     my $loop = "\nwhile(<>){\n";
     $loop   .= "\t" . 'my $d = $_;' . "\n";
@@ -206,7 +218,7 @@ sub compile_reduce {
     my $loop = <<'EOW';
 
 do {
-  my $iter = AC::MrQuincy::Iter::File->new( \*STDIN );
+  my $iter = AC::MrQuincy::Iter::Framed->new( \*STDIN );
   while( defined(my $k = $iter->key()) ){
 
       my($key, $data) = program( $k, $iter );
@@ -217,7 +229,14 @@ do {
 EOW
     ;
 
-    return compile_common($comp, $prog, $sec, "reduce/$nred", $loop);
+    my $job = compile_common($comp, $prog, $sec, "reduce/$nred", $loop);
+
+    # the daemon groups the input by key, and limits the groups
+    $job->{framed}        = 1;
+    $job->{group_max}     = int($comp->config( 'groupmax',     $sec )) if $comp->config( 'groupmax',     $sec );
+    $job->{group_maxsize} = int($comp->config( 'groupmaxsize', $sec )) if $comp->config( 'groupmaxsize', $sec );
+
+    return $job;
 }
 
 sub compile_final {
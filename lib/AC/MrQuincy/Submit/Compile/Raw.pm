@@ -21,16 +21,18 @@ sub compile_raw {
 
     my @job;
 
-    push @job, section($comp, 'map', $prog->{map}{code});
+    for my $m (@{$prog->{map}}){
+        push @job, section($comp, 'map', $m);
+    }
 
     if( $prog->{reduce} ){
         for my $i (0 .. @{$prog->{reduce}}-1){
-            push @job, section($comp, "reduce/$i", $prog->{reduce}[$i]{code});
+            push @job, section($comp, "reduce/$i", $prog->{reduce}[$i]);
         }
     }
 
     if( $prog->{final} ){
-        push @job, section($comp, 'final', $prog->{final}{code});
+        push @job, section($comp, 'final', $prog->{final});
     }
 
     return \@job;
@@ -39,14 +41,16 @@ sub compile_raw {
 sub section {
     my $comp = shift;
     my $name = shift;
-    my $code = shift;
+    my $sec  = shift;
 
-    return {
+    my $job = {
         phase	=> $name,
-        src	=> $code,
-        maxrun	=> $comp->config( 'maxrun',     ),
-        timeout => $comp->config( 'tasktimeout' ),
+        src	=> $sec->{code},
+        maxrun	=> $comp->config( 'maxrun',      $sec ),
+        timeout => $comp->config( 'tasktimeout', $sec ),
     };
+
+    return $comp->section_graph( $job, $sec );
 }
 
 
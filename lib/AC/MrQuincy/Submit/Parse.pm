@@ -14,7 +14,7 @@ my %PARSE = (
     doc 	=> { tag => 'block',   multi => 1, },
     init	=> { tag => 'block',   multi => 0, },
     common	=> { tag => 'simple',  multi => 0, },
-    map		=> { tag => 'block',   multi => 0, required => 1, },
+    map		=> { tag => 'block',   multi => 1, required => 1, },
     reduce	=> { tag => 'block',   multi => 1, },
     final	=> { tag => 'block',   multi => 0, },
     readinput	=> { tag => 'block',   multi => 0, },
@@ -35,7 +35,7 @@ sub new {
         # file | text
     }, $class;
 
-    $me->{nolineinfo} = 1 if $me->{lang} eq 'raw'; # ...
+    $me->{nolineinfo} = 1 if $me->{lang} eq 'raw' || $me->{lang} eq 'native'; # ...
 
     if( $me->{file} ){
         open(my $fd, $me->{file}) || $me->_die("cannot open file: $!");
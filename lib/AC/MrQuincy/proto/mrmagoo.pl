@@ -70,6 +70,31 @@ use Google::ProtocolBuffers;
                     Google::ProtocolBuffers::Constants::TYPE_INT32(), 
                     'final_amount', 5, undef
                 ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'outsize', 6, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'cpu_usec', 7, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'mem_peak', 8, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'io_bytes', 9, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_BOOL(), 
+                    'pushed', 10, undef
+                ],
 
             ],
             { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
@@ -200,6 +225,11 @@ use Google::ProtocolBuffers;
                     Google::ProtocolBuffers::Constants::TYPE_STRING(), 
                     'console', 7, undef
                 ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'priority', 8, undef
+                ],
 
             ],
             { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
@@ -265,6 +295,56 @@ use Google::ProtocolBuffers;
                     Google::ProtocolBuffers::Constants::TYPE_INT32(), 
                     'priority', 13, undef
                 ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'stdoutfile', 14, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    'ACPMRMOutGroup', 
+                    'outgroup', 15, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'sharegroup', 16, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'shareweight', 17, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'warm', 18, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_BOOL(), 
+                    'framed', 19, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'group_max', 20, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'group_maxsize', 21, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'pushto', 22, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'jobsrc_hash', 23, undef
+                ],
 
             ],
             { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
@@ -300,6 +380,41 @@ use Google::ProtocolBuffers;
                     Google::ProtocolBuffers::Constants::TYPE_INT32(), 
                     'width', 5, undef
                 ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'input', 6, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'partition', 7, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'options', 8, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'warm', 9, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_BOOL(), 
+                    'framed', 10, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'group_max', 11, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'group_maxsize', 12, undef
+                ],
 
             ],
             { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
@@ -315,6 +430,11 @@ use Google::ProtocolBuffers;
                     'ACPMRMStatus', 
                     'myself', 1, undef
                 ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    'ACPMRMStatusDigest', 
+                    'digest', 2, undef
+                ],
 
             ],
             { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
@@ -400,6 +520,56 @@ use Google::ProtocolBuffers;
                     Google::ProtocolBuffers::Constants::TYPE_INT32(), 
                     'cpu_metric', 18, undef
                 ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'task_slots', 19, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    'ACPMRMShareUse', 
+                    'share', 20, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'mem_metric', 21, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'write_metric', 22, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'task_mem', 23, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'task_rss', 24, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'rack', 25, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'basedir', 26, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'basedir_id', 27, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'spec_running', 28, undef
+                ],
 
             ],
             { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
@@ -440,11 +610,102 @@ use Google::ProtocolBuffers;
                     Google::ProtocolBuffers::Constants::TYPE_INT32(), 
                     'priority', 8, undef
                 ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'cache', 9, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_BOOL(), 
+                    'push', 10, undef
+                ],
 
             ],
             { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
         );
     }
 
+    unless (ACPMRMOutGroup->can('_pb_fields_list')) {
+        Google::ProtocolBuffers->create_message(
+            'ACPMRMOutGroup',
+            [
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REQUIRED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'nfile', 1, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'partition', 2, undef
+                ],
+
+            ],
+            { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
+        );
+    }
+    unless (ACPMRMShareUse->can('_pb_fields_list')) {
+        Google::ProtocolBuffers->create_message(
+            'ACPMRMShareUse',
+            [
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REQUIRED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'group', 1, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'weight', 2, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'running', 3, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'queued', 4, undef
+                ],
+
+            ],
+            { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
+        );
+    }
+    unless (ACPMRMActionStatusBatch->can('_pb_fields_list')) {
+        Google::ProtocolBuffers->create_message(
+            'ACPMRMActionStatusBatch',
+            [
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    'ACPMRMActionStatus', 
+                    'status', 1, undef
+                ],
+
+            ],
+            { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
+        );
+    }
+    unless (ACPMRMStatusDigest->can('_pb_fields_list')) {
+        Google::ProtocolBuffers->create_message(
+            'ACPMRMStatusDigest',
+            [
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REQUIRED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'server_id', 1, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REQUIRED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'timestamp', 2, undef
+                ],
+
+            ],
+            { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
+        );
+    }
 }
 1;
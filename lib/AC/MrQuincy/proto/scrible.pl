@@ -20,6 +20,21 @@ use Google::ProtocolBuffers;
                     Google::ProtocolBuffers::Constants::TYPE_STRING(), 
                     'hash_sha1', 2, undef
                 ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'offset', 3, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'length', 4, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'source', 5, undef
+                ],
 
             ],
             { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
@@ -45,6 +60,16 @@ use Google::ProtocolBuffers;
                     Google::ProtocolBuffers::Constants::TYPE_STRING(), 
                     'hash_sha1', 3, undef
                 ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'file_size', 4, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'partial_size', 5, undef
+                ],
 
             ],
             { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
@@ -0,0 +1,244 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Jul-08 11:42 (EDT)
+  Function: how much more work can this server take?
+
+*/
+
+#define CURRENT_SUBSYSTEM	't'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "network.h"
+#include "lock.h"
+#include "hrtime.h"
+
+#include "mrmagoo.pb.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/statvfs.h>
+
+#include <vector>
+#include <map>
+using std::vector;
+using std::map;
+
+
+#define MINTASKMEM	64		// MB - assume at least this much per task
+#define MINDISKFREE	1024		// MB - start no new tasks with less
+#define TASKMAXFACTOR	2		// never more than this many tasks per core
+#define TASKDEFFACTOR	3 / 2		// when we cannot measure anything
+#define EWMAWEIGHT	8		// typical task memory: 1/8 new, 7/8 old
+
+
+// instead of a fixed number of task slots, start tasks as long as
+// memory, disk space, and disk bandwidth allow
+//
+// we measure (once a second):
+//   memory available, disk free, disk write rate,
+//   memory used by each running task (all of the processes in its pipeline)
+// and remember how much a task typically needs at its peak.
+// tasks that have not yet grown to that size are counted as if they had.
+
+static Mutex     cap_lock;
+static int       cap_mem_avail  = -1;	// MB, -1 => unknown
+static int       cap_disk_free  = -1;	// MB
+static int       cap_write_rate = -1;	// KB/s
+static int       cap_task_mem   = 0;	// MB, typical peak
+static int       cap_task_rss   = 0;	// MB, running tasks
+static int       cap_task_limit = 0;
+static long long cap_pgpgout    = 0;
+static hrtime_t  cap_pgpgout_t  = 0;
+
+
+static int
+default_limit(void){
+    return config->hw_cpus ? config->hw_cpus * TASKDEFFACTOR : 1;
+}
+
+#ifdef __linux__
+
+// read "name value" from a /proc file
+static long long
+proc_value(const char *file, const char *name){
+    char buf[256];
+    long long v = -1;
+    int nl = strlen(name);
+
+    FILE *f = fopen(file, "r");
+    if( !f ) return -1;
+
+    while( fgets(buf, sizeof(buf), f) ){
+        if( strncmp(buf, name, nl) ) continue;
+        if( buf[nl] != ' ' && buf[nl] != ':' ) continue;
+        v = atoll( buf + nl + 1 );
+        break;
+    }
+    fclose(f);
+
+    return v;
+}
+
+// resident memory (MB) by process group
+// each task runs in its own session, so its pgrp is the task pid
+void
+capacity_rss(map<int,int> *dst){
+    char file[sizeof(((struct dirent*)0)->d_name) + 16];
+    char buf[1024];
+    static long pagekb = 0;
+
+    if( !pagekb ) pagekb = sysconf(_SC_PAGESIZE) / 1024;
+
+    DIR *d = opendir("/proc");
+    if( !d ) return;
+
+    map<int,long> kb;
+    struct dirent *de;
+
+    while( (de = readdir(d)) ){
+        if( de->d_name[0] < '0' || de->d_name[0] > '9' ) continue;
+
+        snprintf(file, sizeof(file), "/proc/%s/stat", de->d_name);
+        FILE *f = fopen(file, "r");
+        if( !f ) continue;
+        int l = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        if( l <= 0 ) continue;
+        buf[l] = 0;
+
+        // the command name may contain anything, skip past it
+        char *p = strrchr(buf, ')');
+        if( !p ) continue;
+
+        int pgrp;
+        long rss;
+        if( sscanf(p + 1, " %*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+                   &pgrp, &rss) != 2 ) continue;
+
+        kb[pgrp] += rss * pagekb;
+    }
+    closedir(d);
+
+    for(map<int,long>::iterator it=kb.begin(); it != kb.end(); it++){
+        (*dst)[ it->first ] = it->second / 1024;
+    }
+}
+
+static void
+measure_system(void){
+
+    long long avail = proc_value("/proc/meminfo", "MemAvailable");
+    cap_mem_avail = (avail < 0) ? -1 : avail / 1024;
+
+    // KB written to disk, since boot
+    long long out = proc_value("/proc/vmstat", "pgpgout");
+    hrtime_t now  = lr_now();
+
+    if( out >= 0 && cap_pgpgout_t && now > cap_pgpgout_t )
+        cap_write_rate = (out - cap_pgpgout) / (now - cap_pgpgout_t);
+    if( out >= 0 ){
+        cap_pgpgout   = out;
+        cap_pgpgout_t = now;
+    }
+}
+
+#else
+
+void
+capacity_rss(map<int,int> *dst){
+}
+
+static void
+measure_system(void){
+}
+
+#endif
+
+// taskrss: MB, each running task
+void
+capacity_update(const vector<int> *taskrss){
+    struct statvfs vfs;
+
+    cap_lock.lock();
+
+    measure_system();
+
+    if( ! statvfs( config->basedir.c_str(), &vfs ) )
+        cap_disk_free = vfs.f_bavail / 2048;
+
+    int nrun = taskrss->size();
+    int est  = cap_task_mem > MINTASKMEM ? cap_task_mem : MINTASKMEM;
+    int used = 0, growth = 0;
+
+    for(int i=0; i<nrun; i++){
+        int r = (*taskrss)[i];
+        used += r;
+        if( r < est ) growth += est - r;
+    }
+    cap_task_rss = used;
+
+    int limit = default_limit();
+
+    if( cap_mem_avail >= 0 ){
+        int extra = (cap_mem_avail - config->task_mem_reserve - growth) / est;
+        if( extra < 0 ) extra = 0;
+
+        limit = config->hw_cpus ? config->hw_cpus * TASKMAXFACTOR : TASKMAXFACTOR;
+        if( nrun + extra < limit ) limit = nrun + extra;
+    }
+
+    // disks full or busy - finish what we have first
+    if( cap_disk_free >= 0 && cap_disk_free < MINDISKFREE && nrun < limit )
+        limit = nrun;
+    if( config->task_max_write && cap_write_rate > config->task_max_write * 1024 && nrun < limit )
+        limit = nrun;
+
+    if( limit < 1 ) limit = 1;
+
+    if( limit != cap_task_limit )
+        DEBUG("task limit %d (mem %d, task %d, disk %d, write %d)", limit, cap_mem_avail, est, cap_disk_free, cap_write_rate);
+
+    cap_task_limit = limit;
+    cap_lock.unlock();
+}
+
+// a task finished, using this much (MB) at its peak
+void
+capacity_task_done(int peak){
+
+    if( peak <= 0 ) return;
+
+    cap_lock.lock();
+    if( !cap_task_mem )
+        cap_task_mem = peak;
+    else
+        cap_task_mem = (cap_task_mem * (EWMAWEIGHT - 1) + peak) / EWMAWEIGHT;
+    cap_lock.unlock();
+}
+
+// how many tasks may run at once, right now
+int
+capacity_task_limit(void){
+
+    // not yet measured
+    if( !cap_task_limit ) return default_limit();
+    return cap_task_limit;
+}
+
+// for status gossip
+void
+capacity_status(ACPMRMStatus *g){
+
+    cap_lock.lock();
+    if( cap_mem_avail  >= 0 ) g->set_mem_metric( cap_mem_avail );
+    if( cap_write_rate >= 0 ) g->set_write_metric( cap_write_rate );
+    g->set_task_mem( cap_task_mem );
+    g->set_task_rss( cap_task_rss );
+    cap_lock.unlock();
+}
@@ -0,0 +1,305 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Jul-14 16:20 (EDT)
+  Function: run each task in its own cgroup
+
+*/
+
+#define CURRENT_SUBSYSTEM	't'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "cgroup.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+#define RMTRIES		10	// the kernel may take a moment to empty it
+#define WARMCGROUP	"warm"	// warm workers live here, between tasks
+
+
+// cgroup v2. config:
+//   cgroup	  /sys/fs/cgroup/mrquincy  - must be writable by us
+//   taskcpuweight  100			   - cpu.weight
+//   taskmemmax     4096		   - MB, memory.max
+//   taskioweight   100			   - io.weight
+//
+// the task, and everything it starts, is limited, accounted, and killed together
+
+static bool cg_enabled = 0;
+static char cg_mine[256];	// the cgroup this process entered
+
+
+#ifdef __linux__
+
+static int
+write_file(const char *file, const char *val){
+
+    int fd = open(file, O_WRONLY);
+    if( fd < 0 ) return 0;
+
+    int l = strlen(val);
+    int w = write(fd, val, l);
+    close(fd);
+
+    return w == l;
+}
+
+static int
+write_cg(const string *cg, const char *name, const char *val){
+    string file = *cg;
+    file.append( "/" );
+    file.append( name );
+
+    return write_file( file.c_str(), val );
+}
+
+static FILE *
+open_cg(const string *cg, const char *name){
+    string file = *cg;
+    file.append( "/" );
+    file.append( name );
+
+    return fopen( file.c_str(), "r" );
+}
+
+// "name value" lines, sum the values of the named field(s)
+static long long
+read_cg_stat(const string *cg, const char *file, const char *name){
+    char buf[1024];
+    long long v = 0;
+    int nl = strlen(name);
+
+    FILE *f = open_cg(cg, file);
+    if( !f ) return 0;
+
+    while( fgets(buf, sizeof(buf), f) ){
+        // io.stat: "8:0 rbytes=1 wbytes=2 ..."
+        for(char *p=buf; (p = strstr(p, name)); p += nl){
+            if( p != buf && p[-1] != ' ' ) continue;
+            if( p[nl] != ' ' && p[nl] != '=' ) continue;
+            v += atoll( p + nl + 1 );
+        }
+    }
+    fclose(f);
+
+    return v;
+}
+
+static long long
+read_cg_value(const string *cg, const char *file){
+    char buf[64];
+    long long v = 0;
+
+    FILE *f = open_cg(cg, file);
+    if( !f ) return 0;
+    if( fgets(buf, sizeof(buf), f) ) v = atoll(buf);
+    fclose(f);
+
+    return v;
+}
+
+void
+cgroup_init(void){
+    string root = config->cgroup_root;
+
+    if( root.empty() ) return;
+
+    mkdir( root.c_str(), 0755 );
+
+    // let our children use the controllers
+    if( ! write_cg( &root, "cgroup.subtree_control", "+cpu +memory +io" ) ){
+        // some may not be available, try one at a time
+        write_cg( &root, "cgroup.subtree_control", "+cpu" );
+        write_cg( &root, "cgroup.subtree_control", "+memory" );
+        write_cg( &root, "cgroup.subtree_control", "+io" );
+    }
+
+    struct stat st;
+    string procs = root;
+    procs.append( "/cgroup.procs" );
+
+    if( stat(procs.c_str(), &st) == -1 ){
+        PROBLEM("cannot use cgroup %s: %s", root.c_str(), strerror(errno));
+        return;
+    }
+
+    cg_enabled = 1;
+    VERBOSE("tasks run in cgroup %s", root.c_str());
+
+    string warm;
+    cgroup_name( WARMCGROUP, &warm );
+    mkdir( warm.c_str(), 0755 );
+}
+
+// the name of a task's cgroup. 0 => not using cgroups
+int
+cgroup_name(const char *name, string *cg){
+
+    cg->clear();
+    if( !cg_enabled ) return 0;
+
+    cg->assign( config->cgroup_root );
+    cg->append( "/" );
+    cg->append( name );
+    return 1;
+}
+
+// create a cgroup for a task. 0 => none
+int
+cgroup_create(const string *cg){
+    char buf[64];
+
+    if( cg->empty() ) return 0;
+
+    // leftover from a crash?
+    rmdir( cg->c_str() );
+
+    if( mkdir( cg->c_str(), 0755 ) == -1 ){
+        VERBOSE("cannot create cgroup %s: %s", cg->c_str(), strerror(errno));
+        return 0;
+    }
+
+    if( config->task_cpu_weight ){
+        snprintf(buf, sizeof(buf), "%d", config->task_cpu_weight);
+        write_cg( cg, "cpu.weight", buf );
+    }
+    if( config->task_io_weight ){
+        snprintf(buf, sizeof(buf), "default %d", config->task_io_weight);
+        write_cg( cg, "io.weight", buf );
+    }
+    if( config->task_mem_max ){
+        snprintf(buf, sizeof(buf), "%lld", config->task_mem_max * 1048576LL);
+        write_cg( cg, "memory.max", buf );
+        // swapping is not better than dying
+        write_cg( cg, "memory.swap.max", "0" );
+    }
+
+    return 1;
+}
+
+// in the child, after fork. no mallocing
+void
+cgroup_enter(const string *cg){
+    char file[256];
+
+    if( cg->empty() ) return;
+
+    snprintf(file, sizeof(file), "%s/cgroup.procs", cg->c_str());
+    if( ! write_file( file, "0" ) ){
+        VERBOSE("cannot enter cgroup %s: %s", cg->c_str(), strerror(errno));
+        return;
+    }
+
+    snprintf(cg_mine, sizeof(cg_mine), "%s", cg->c_str());
+}
+
+// put another process into our cgroup (eg. a warm worker running our task)
+void
+cgroup_adopt(int pid){
+    char file[300];
+    char val[32];
+
+    if( !cg_mine[0] ) return;
+
+    snprintf(file, sizeof(file), "%s/cgroup.procs", cg_mine);
+    snprintf(val,  sizeof(val),  "%d", pid);
+    if( ! write_file( file, val ) )
+        VERBOSE("cannot move %d to cgroup %s: %s", pid, cg_mine, strerror(errno));
+}
+
+// move out of the task's cgroup, into the shared warm one
+// in the child, after fork. no mallocing
+void
+cgroup_leave(void){
+    char file[300];
+
+    if( !cg_mine[0] ) return;
+
+    char *p = strrchr(cg_mine, '/');
+    if( !p ) return;
+    *p = 0;
+
+    snprintf(file, sizeof(file), "%s/" WARMCGROUP "/cgroup.procs", cg_mine);
+    write_file( file, "0" );
+    cg_mine[0] = 0;
+}
+
+// kill everything in it. 0 => no cgroup
+int
+cgroup_kill(const string *cg){
+    char buf[32];
+
+    if( cg->empty() ) return 0;
+
+    // linux 5.14+
+    if( write_cg( cg, "cgroup.kill", "1" ) ) return 1;
+
+    // one at a time
+    FILE *f = open_cg(cg, "cgroup.procs");
+    if( !f ) return 0;
+
+    while( fgets(buf, sizeof(buf), f) ){
+        int pid = atoi(buf);
+        if( pid > 0 ) kill(pid, 9);
+    }
+    fclose(f);
+
+    return 1;
+}
+
+// add in its usage
+void
+cgroup_stats(const string *cg, CGroupStats *st){
+
+    if( cg->empty() ) return;
+
+    st->cpu_usec += read_cg_stat( cg, "cpu.stat", "usage_usec" );
+    st->io_bytes += read_cg_stat( cg, "io.stat",  "rbytes" );
+    st->io_bytes += read_cg_stat( cg, "io.stat",  "wbytes" );
+
+    // linux 5.19+
+    long long peak = read_cg_value( cg, "memory.peak" );
+    if( peak > st->mem_peak ) st->mem_peak = peak;
+}
+
+void
+cgroup_remove(const string *cg){
+
+    if( cg->empty() ) return;
+
+    for(int i=0; i<RMTRIES; i++){
+        if( ! rmdir( cg->c_str() ) ) break;
+        if( errno != EBUSY ){
+            VERBOSE("cannot remove cgroup %s: %s", cg->c_str(), strerror(errno));
+            break;
+        }
+        cgroup_kill( cg );
+        usleep( 100000 );
+    }
+}
+
+#else
+
+void cgroup_init(void){ }
+int  cgroup_name(const char *name, string *cg){ cg->clear(); return 0; }
+int  cgroup_create(const string *cg){ return 0; }
+void cgroup_enter(const string *cg){ }
+void cgroup_adopt(int pid){ }
+void cgroup_leave(void){ }
+int  cgroup_kill(const string *cg){ return 0; }
+void cgroup_stats(const string *cg, CGroupStats *st){ }
+void cgroup_remove(const string *cg){ }
+
+#endif
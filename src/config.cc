@@ -60,6 +60,7 @@ static int set_debug(Config *, string *);
 static int set_trace(Config *, string *);
 static int add_acl(Config *, string *);
 static int add_peer(Config *, string *);
+static int add_share(Config *, string *);
 static int ignore_conf(Config *cf, string *s) { return 0; }
 
 SET_INT_VAL(tcp_threads, 0);
@@ -71,12 +72,24 @@ SET_INT_VAL(debuglevel, 0);
 SET_INT_VAL(enable_scriblr, 0);
 SET_INT_VAL(available, 0);
 SET_INT_VAL(hw_cpus, 0);
+SET_INT_VAL(result_cache, 0);
+SET_INT_VAL(task_mem_reserve, 0);
+SET_INT_VAL(task_max_write, 0);
+SET_INT_VAL(task_cpu_weight, 0);
+SET_INT_VAL(task_io_weight, 0);
+SET_INT_VAL(task_mem_max, 0);
+SET_INT_VAL(xfer_net_rate, 0);
+SET_INT_VAL(xfer_disk_rate, 0);
+SET_INT_VAL(xfer_job_rate, 0);
+SET_INT_VAL(net_compress, 0);
+SET_INT_VAL(src_by_hash, 0);
 
 SET_STR_VAL(environment);
 SET_STR_VAL(basedir);
 SET_STR_VAL(error_mailto);
 SET_STR_VAL(error_mailfrom);
 SET_STR_VAL(plan_prog);
+SET_STR_VAL(cgroup_root);
 
 static struct {
     const char *word;
@@ -100,6 +113,19 @@ static struct {
     { "seedpeer",	add_peer 	   },
     { "syslog",		ignore_conf        },	// NYI
     { "planprog",	set_plan_prog      },
+    { "resultcache",	set_result_cache   },
+    { "share",		add_share	   },
+    { "taskmemreserve",	set_task_mem_reserve },
+    { "taskmaxwrite",	set_task_max_write },
+    { "cgroup",		set_cgroup_root    },
+    { "taskcpuweight",	set_task_cpu_weight },
+    { "taskioweight",	set_task_io_weight },
+    { "taskmemmax",	set_task_mem_max   },
+    { "xfernetrate",	set_xfer_net_rate  },
+    { "xferdiskrate",	set_xfer_disk_rate },
+    { "xferjobrate",	set_xfer_job_rate  },
+    { "netcompress",	set_net_compress   },
+    { "srcbyhash",	set_src_by_hash    },
     // ...
 };
 
@@ -145,18 +171,18 @@ store_value(Config *cf, string *k, string *v){
 
 
 static int
-read_token(FILE *f, string *k, int spacep){
+read_token(const string *t, int *pos, string *k, int spacep){
     int c;
 
     k->clear();
 
     while(1){
-	c = fgetc(f);
+	c = (*pos < t->length()) ? (unsigned char)(*t)[(*pos)++] : EOF;
 	if(c == EOF) return -1;
 	if(c == '#'){
 	    // eat til eol
 	    while(1){
-		c = fgetc(f);
+		c = (*pos < t->length()) ? (unsigned char)(*t)[(*pos)++] : EOF;
 		if(c == EOF)  return -1;
 		if(c == '\n') break;
 	    }
@@ -182,31 +208,46 @@ read_token(FILE *f, string *k, int spacep){
 int
 read_config(const char *filename){
     FILE *f;
-    Config *cf;
-    int i;
-    string k, v;
-    int rt = 0;
+    string text;
+    char buf[4096];
 
     f = fopen(filename, "r");
     if(!f){
 	FATAL("cannot open file '%s': %s", filename, strerror(errno));
     }
 
+    while(1){
+        int r = fread(buf, 1, sizeof(buf), f);
+        if( r <= 0 ) break;
+        text.append(buf, r);
+    }
+    fclose(f);
+
+    return read_config_text( &text );
+}
+
+// a task gets the daemon's config this way (see task.cc)
+int
+read_config_text(const string *text){
+    Config *cf;
+    int i, pos = 0;
+    string k, v;
+
     cf = new Config;
+    cf->text = *text;
 
     while(1){
-	i = read_token(f, &k, 0);
+	i = read_token(text, &pos, &k, 0);
 	if(i == -1) break;	// eof
 	if(i == 0){
 	    store_value(cf, &k, 0);
 	    continue;
 	}
-	i = read_token(f, &v, 1);
+	i = read_token(text, &pos, &v, 1);
 	store_value(cf, &k, &v);
 	if(i == -1) break;	// eof
     }
 
-    fclose(f);
     Config *old = config;
     ATOMIC_SETPTR( config, cf);
 
@@ -336,6 +377,27 @@ add_peer(Config *cf, string *v){
     return 0;
 }
 
+// prefix weight
+static int
+add_share(Config *cf, string *v){
+
+    if( !v ) return 0;
+
+    int p = v->find_first_of(" \t");
+    if( p == string::npos ) FATAL("invalid share '%s', expected: share prefix weight", v->c_str());
+
+    struct Share *sh = new struct Share;
+    sh->prefix.assign( *v, 0, p );
+    sh->weight = atoi( v->c_str() + p );
+    if( sh->weight < 1 ) sh->weight = 1;
+
+    cf->shares.push_back( sh );
+
+    DEBUG("share %s => %d", sh->prefix.c_str(), sh->weight);
+
+    return 0;
+}
+
 //################################################################
 
 static int
@@ -367,6 +429,17 @@ Config::Config(){
     available      = 1;
     udp_threads	   = 2;
     tcp_threads	   = 4;
+    result_cache   = 0;
+    task_mem_reserve = 512;
+    task_max_write = 0;
+    task_cpu_weight = 0;
+    task_io_weight = 0;
+    task_mem_max   = 0;
+    xfer_net_rate  = 0;
+    xfer_disk_rate = 0;
+    xfer_job_rate  = 0;
+    net_compress   = 0;
+    src_by_hash    = 0;
     environment.assign("unknown");
 
     memset(debugflags, 0, sizeof(debugflags));
@@ -384,6 +457,31 @@ Config::~Config(){
         NetAddr *a = *it;
         delete a;
     }
+    for(Share_List::iterator it=shares.begin(); it != shares.end(); it++){
+        Share *s = *it;
+        delete s;
+    }
+}
+
+//################################################################
+
+// find the longest matching prefix. jobs sharing a prefix share a group
+int
+Config::share_weight(const string *trace, string *group) const {
+    const Share *best = 0;
+
+    for(Share_List::const_iterator it=shares.begin(); it != shares.end(); it++){
+        const Share *s = *it;
+
+        if( trace->compare(0, s->prefix.size(), s->prefix) ) continue;
+        if( !best || best->prefix.size() < s->prefix.size() ) best = s;
+    }
+
+    if( !best ) return SHARE_DEFAULT;
+
+    group->assign( "share:" );
+    group->append( best->prefix );
+    return best->weight;
 }
 
 //################################################################
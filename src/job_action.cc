@@ -21,6 +21,7 @@
 #include "job.h"
 
 #include <unistd.h>
+#include <arpa/inet.h>
 
 #include "mrmagoo.pb.h"
 #include "std_reply.pb.h"
@@ -33,6 +34,7 @@
 #define SERVERTASKMAX		10
 #define SERVERXFERMAX		20
 #define SERVERTASKDELAY		2
+#define FAIRSLACK		2	// keep a few extra queued on the server
 
 
 void
@@ -54,7 +56,7 @@ Job::depending_x(ToDo *t){
 void
 ToDo::retry_or_abort(bool did_timeout){
 
-    if( _job->_n_fails > _job->current_width() * TODOMAXFAIL / 2){
+    if( _job->_n_fails > _job->step_width(_stepno) * TODOMAXFAIL / 2){
         _job->abort();
         return;
     }
@@ -62,9 +64,9 @@ ToDo::retry_or_abort(bool did_timeout){
     if( ++_tries >= TODOMAXFAIL ){
         const char *serv = _job->_servers[_serveridx]->name.c_str();
 
-        // cannot replace a map task
         // only replace if the failure is likely because the server is down
-        if( _job->_stepno && (did_timeout || !peerdb->is_it_up(serv) )){
+        // (a map task can only be replaced if another server has the files)
+        if( did_timeout || !peerdb->is_it_up(serv) ){
             maybe_replace(1);
         }else{
             _job->abort();
@@ -105,9 +107,11 @@ TaskToDo::failed(bool did_timeout){
     _job->derunning_x(this);
     _job->_servers[ _serveridx ]->_n_task_running --;
     _job->_servers[ _serveridx ]->_n_fails ++;
+    _job->_servers[ _serveridx ]->_last_fail = lr_now();
     _job->_n_task_running --;
     _job->_n_fails ++;
     _state = JOB_TODO_STATE_FINISHED;
+    spec_done();
 
     TaskToDo *alt = _replaces ? _replaces : _replacedby;
     if( alt ){
@@ -128,6 +132,7 @@ XferToDo::failed(bool did_timeout){
     _job->_servers[ _serveridx ]->_n_xfer_running --;
     _job->_servers[ _peeridx   ]->_n_xfer_peering --;
     _job->_servers[ _serveridx ]->_n_fails ++;
+    _job->_servers[ _serveridx ]->_last_fail = lr_now();
     _job->_n_xfer_running --;
     _job->_n_fails ++;
     _state = JOB_TODO_STATE_FINISHED;
@@ -173,9 +178,15 @@ Server::too_many_tasks(void) const {
 
     int taskmax = cpus ? 2 * cpus : SERVERTASKMAX;
 
+    // the server knows how much it can handle (memory, disk, ...)
+    if( _task_slots > 0 && _task_slots + FAIRSLACK < taskmax ) taskmax = _task_slots + FAIRSLACK;
+
     if( _n_task_running >= taskmax ) return 1;
     if( _last_task + SERVERTASKDELAY > lr_now() ) return 1;
 
+    // the server is shared with other jobs, don't take more than our share
+    if( _fair_slots > 0 && _n_task_running >= _fair_slots + FAIRSLACK ) return 1;
+
     return 0;
 }
 
@@ -207,6 +218,11 @@ TaskToDo::maybe_start(void){
     if( !_tries )
         create_deles();
 
+    // where the consumers are now
+    _g.clear_pushto();
+    _pushto.clear();
+    if( _job->_g.push() ) wire_push();
+
     _job->inform("starting task %s - %s on %s", _xid.c_str(), _g.phase().c_str(),
                  _job->_servers[ _serveridx ]->name.c_str());
 
@@ -252,6 +268,8 @@ XferToDo::maybe_start(void){
     if( _job->_n_xfer_running >= xfermax ) return 0;
     if( ! start_check() ) return 0;
 
+    // so the server runs the most needed first
+    _g.set_priority( urgency() );
 
     _job->inform("starting xfer %s - %s : %s", _xid.c_str(), _g.filename().c_str(),
                  _job->_servers[ _serveridx ]->name.c_str());
@@ -318,6 +336,7 @@ void
 TaskToDo::discard(void){
 
     DEBUG("discard %s %d", _xid.c_str(), _state);
+    spec_done();
     if( _state == JOB_TODO_STATE_PENDING ){
         _job->depending_x(this);
         _state = JOB_TODO_STATE_FINISHED;
@@ -390,6 +409,7 @@ TaskToDo::finished(int amount){
         _job->_n_task_running --;
     }
     _state = JOB_TODO_STATE_FINISHED;
+    spec_done();
 
     // so how slow was it?
     if( amount ){
@@ -400,6 +420,9 @@ TaskToDo::finished(int amount){
 
     _job->_task_run_time += _run_time;
 
+    // the output is here
+    (_replaces ? _replaces : this)->_outserver = _serveridx;
+
     create_xfers();
 
     // if this was replaced, abort the replacement (and vv)
@@ -417,16 +440,47 @@ XferToDo::finished(int amount){
     _job->_servers[ _peeridx   ]->_n_xfer_peering --;
     _job->_n_xfer_running --;
 
+    if( _dele ) _job->disk_used_x(_dele, amount);
+    if( _consumer ) _consumer->_n_infile_have ++;
+
     // tally up file xfer sizes
-    _job->_plan[ _job->_stepno ]->_xfer_size += amount;
-    _job->_plan[ _job->_stepno ]->_n_xfers_run ++;
+    _job->_plan[ _stepno ]->_xfer_size += amount;
+    _job->_plan[ _stepno ]->_n_xfers_run ++;
+    if( _job->distance_x(_peeridx, _serveridx) == TOPO_XDC )
+        _job->_plan[ _stepno ]->_xdc_size += amount;
+
+}
+
+// how big are the output files?
+void
+TaskToDo::outsize(const ACPMRMActionStatus *g){
+
+    for(int i=0; i<g->outsize_size() && i<_outdeles.size(); i++){
+        _job->disk_used_x(_outdeles[i], g->outsize(i));
+    }
+
+    _pushed.clear();
+    for(int i=0; i<g->pushed_size() && i<g->outsize_size(); i++){
+        _pushed.push_back( g->pushed(i) ? g->outsize(i) : 0 );
+    }
+}
+
+// what did it use?
+void
+TaskToDo::usage(const ACPMRMActionStatus *g){
 
+    _cpu_usec = g->cpu_usec();
+    _mem_peak = g->mem_peak();
+    _io_bytes = g->io_bytes();
 }
 
-XferToDo::XferToDo(Job *j, const string *name, int src, int dst){
+XferToDo::XferToDo(Job *j, int stepno, const string *name, int src, int dst){
 
     unique( &_xid );
     _job         = j;
+    _stepno      = stepno;
+    _dele        = 0;
+    _consumer    = 0;
     _serveridx   = dst;
     _peeridx     = src;
     _state       = JOB_TODO_STATE_PENDING;
@@ -442,31 +496,110 @@ XferToDo::XferToDo(Job *j, const string *name, int src, int dst){
 
 }
 
+// the file that completes a task's input unblocks it, those go first.
+// count the consumer's infiles still missing (including those not yet produced)
+int
+XferToDo::urgency(void) const {
+
+    if( !_consumer ) return TODOURGENCYBACKUP;
+
+    int n = _consumer->_g.infile_size() - _consumer->_n_infile_have;
+    return n > 0 ? n : 0;
+}
+
+// another copy of the file, if the first location fails
 void
-TaskToDo::create_xfers(void){
+XferToDo::add_source(int src){
+    _g.add_location( _job->_servers[src]->name.c_str() );
+}
 
-    // files from last step can stay where they are
-    if( _job->_stepno == _job->_plan.size() - 1 ) return;
+// push mode: each outfile goes straight to its consumer's server, as the task writes it
+// (same order as wire_files + create_xfers)
+void
+TaskToDo::wire_push(void){
+    char buf[64];
 
-    // for all outfiles
-    // new Xfer -> job pend
+    Step *step = _job->_plan[ _stepno ];
+    if( step->_outputs.empty() ) return;
 
-    int nserv = _job->_servers.size();
-    int noutf = _g.outfile_size();
+    for(int o=0; o<step->_outputs.size(); o++){
+        Step *dstep = _job->_plan[ step->_outputs[o] ];
 
-    for(int i=0; i<noutf; i++){
-        int dst = i % nserv;
+        for(int i=0; i<dstep->_tasks.size(); i++){
+            int dst = dstep->_tasks[i]->_serveridx;
 
-        // if file will be processed on this server, we do not need to copy it
-        // instead, make a backup copy on another server
-        if( _serveridx == dst ) dst = (i+1) % nserv;
+            if( dst == _serveridx ){
+                _g.add_pushto( "" );
+                _pushto.push_back( -1 );
+                continue;
+            }
 
-        // just one server?
-        if( _serveridx == dst ) continue;
+            struct in_addr a;
+            a.s_addr = _job->_servers[dst]->ipv4;
+            snprintf(buf, sizeof(buf), "%s:%d", inet_ntoa(a), _job->_servers[dst]->port);
+            _g.add_pushto( buf );
+            _pushto.push_back( dst );
+        }
+    }
+}
 
-        XferToDo *x = new XferToDo(_job, &_g.outfile(i), _serveridx, dst);
-        _job->_pending.push_back(x);
-        _job->_xfers.push_back(x);
+void
+TaskToDo::create_xfers(void){
+
+    Step *step = _job->_plan[ _stepno ];
+
+    // files from final steps can stay where they are
+    // (except the result, which might get cached)
+    if( step->_outputs.empty() ){
+        _job->cache_xfer_x(this);
+        return;
+    }
+
+    // for all outfiles, send to the consuming task's server
+    // new Xfer -> job pend
+
+    int nout = 0;
+
+    for(int o=0; o<step->_outputs.size(); o++){
+        Step *dstep = _job->_plan[ step->_outputs[o] ];
+
+        for(int i=0; i<dstep->_tasks.size(); i++, nout++){
+            TaskToDo *ct = dstep->_tasks[i];
+            int dst = ct->_serveridx;
+
+            // if file will be processed on this server, we do not need to copy it
+            // instead, make a backup copy on another server
+            TaskToDo *consumer = ct;
+            if( dst == _serveridx ){
+                ct->_n_infile_have ++;
+                consumer = 0;
+                dst = _job->backup_dst_x(this, ct);
+            }
+
+            // just one server?
+            if( _serveridx == dst ) continue;
+
+            // already pushed there? (the consumer may have moved since the task started)
+            if( consumer && nout < _pushed.size() && _pushed[nout]
+                && nout < _pushto.size() && _pushto[nout] == dst ){
+                Delete *d = _job->add_delete_x(&_g.outfile(nout), dst, dstep->_stepno);
+                _job->disk_used_x(d, _pushed[nout]);
+                ct->_n_infile_have ++;
+                continue;
+            }
+            // pushed to where it used to be - clean that up too
+            if( nout < _pushed.size() && _pushed[nout]
+                && nout < _pushto.size() && _pushto[nout] >= 0 && _pushto[nout] != dst ){
+                Delete *d = _job->add_delete_x(&_g.outfile(nout), _pushto[nout], dstep->_stepno);
+                _job->disk_used_x(d, _pushed[nout]);
+            }
+
+            XferToDo *x = new XferToDo(_job, _stepno, &_g.outfile(nout), _serveridx, dst);
+            x->_consumer = consumer;
+            x->_dele = _job->add_delete_x(&_g.outfile(nout), dst, dstep->_stepno);
+            _job->_pending.push_back(x);
+            _job->_xfers.push_back(x);
+        }
     }
 }
 
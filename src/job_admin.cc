@@ -41,6 +41,7 @@ extern int scriblr_delete_file(const string *);
 
 
 #define MAXJOB		(config->hw_cpus ? config->hw_cpus : 1)		// maximum number of running jobs
+#define CACHEEXPIRE	300						// check the result cache this often
 
 
 // keep a queue of jobs
@@ -49,11 +50,13 @@ extern int scriblr_delete_file(const string *);
 static QueuedJob jobq;
 
 static void *job_periodic(void*);
+extern void job_cache_expire(void);
 
 
 
 void
 job_init(void){
+    jobq.start_dispatch();
     start_thread(job_periodic, 0);
 }
 
@@ -65,9 +68,14 @@ job_shutdown(void){
 static void *
 job_periodic(void *notused){
 
+    int n = 0;
+
     while(1){
-        // can we start any queued jobs?
-        jobq.start_more(MAXJOB);
+        // queued jobs are started by the dispatcher
+        jobq.send_statuses();
+
+        // and every so often, tidy up the result cache
+        if( ! (n++ % CACHEEXPIRE) ) job_cache_expire();
         sleep(1);
     }
 }
@@ -109,10 +117,14 @@ Job::init(int fd, const char *buf, int len){
         DEBUG("console: %s", cons.c_str());
     }
 
+    // fair share group: by traceinfo prefix, or just this job
+    _shareweight = config->share_weight( & _g.traceinfo(), &_sharegroup );
+    if( _sharegroup.empty() ) _sharegroup.assign( _id );
+
     int prio = priority();
     if( !prio ) prio = lr_now() >> 8;
 
-    jobq.start_or_queue( (void*)this, _id, prio, MAXJOB );
+    jobq.start_or_queue( (void*)this, _id, prio, MAXJOB, &_sharegroup, _shareweight );
 
     return 1;
 }
@@ -157,6 +169,27 @@ handle_jobabort(NTD *ntd){
     return reply_ok(ntd);
 }
 
+// status for an unknown job
+// must be something orphaned when something restarted
+// tell the slave to abort the task
+static int
+orphaned(NTD *ntd, const ACPMRMActionStatus *req){
+
+    // arrived late, just ignore
+    if( req->phase() == "FINISHED" || req->phase() == "FAILED" )
+        return 0;
+
+    if( !ntd->is_tcp ){
+        ACPMRMTaskAbort ab;
+        ab.set_jobid( req->jobid().c_str() );
+        ab.set_taskid( req->xid().c_str() );
+        DEBUG("sending job 404 to %s for %s %s %s", inet_ntoa(ntd->peer.sin_addr), req->jobid().c_str(), req->xid().c_str(), req->phase().c_str());
+        toss_request(udp4_fd, & ntd->peer, PHMT_MR_TASKABORT, &ab);
+    }
+
+    return 1;
+}
+
 // task + xfer status updates
 int
 handle_jobstatus(NTD *ntd){
@@ -179,22 +212,37 @@ handle_jobstatus(NTD *ntd){
     if( f )
         return reply_ok(ntd);
 
-    // arrived late, just ignore
-    if( req.phase() == "FINISHED" || req.phase() == "FAILED" )
+    if( !orphaned(ntd, &req) )
         return reply_ok(ntd);
 
+    return reply_error(ntd, 404, "ToDo Not Found");
+}
 
-    // not found - must be something orphaned when something restarted
-    // tell the slave to abort the task
-    if( !ntd->is_tcp ){
-        ACPMRMTaskAbort ab;
-        ab.set_jobid( req.jobid().c_str() );
-        ab.set_taskid( req.xid().c_str() );
-        DEBUG("sending job 404 to %s for %s %s %s", inet_ntoa(ntd->peer.sin_addr), req.jobid().c_str(), req.xid().c_str(), req.phase().c_str());
-        toss_request(udp4_fd, & ntd->peer, PHMT_MR_TASKABORT, &ab);
+// periodic task + xfer statuses, all at once
+int
+handle_statusbatch(NTD *ntd){
+    protocol_header  *phi = (protocol_header*) ntd->gpbuf_in;
+    ACPMRMActionStatusBatch req;
+    vector<int> notfound;
+
+    // parse request
+    req.ParsePartialFromArray( ntd->in_data(), phi->data_length );
+
+    if( ! req.IsInitialized() ){
+        DEBUG("invalid request. missing required fields");
+        return 0;
     }
 
-    return reply_error(ntd, 404, "ToDo Not Found");
+    DEBUG("recvd %d job statuses", req.status_size());
+
+    jobq.update( &req, &notfound );
+
+    for(int i=0; i<notfound.size(); i++){
+        orphaned( ntd, & req.status( notfound[i] ) );
+    }
+
+    // no reply
+    return 0;
 }
 
 int
@@ -225,29 +273,48 @@ handle_mrdelete(NTD *ntd){
 int
 QueuedJob::update(ACPMRMActionStatus *g){
     Job *found = 0;
-    const string *id = & g->jobid();
 
     _lock.r_lock();
 
-    for(list<QueueElem*>::iterator it=_running.begin(); it != _running.end(); it++){
-        QueueElem *e = *it;
-        Job *j = (Job*)e->_elem;
-        if( !id->compare( j->_id ) ){
-            found = j;
-            break;
-        }
-    }
+    QueueElem *e = _find_x( g->jobid().c_str() );
+    if( e && e->_heappos == -1 ) found = (Job*)e->_elem;
 
     int s = 0;
 
     if( found )
-        s = found->update( & g->xid(), & g->phase(), g->progress(), g->final_amount() );
+        s = found->update( & g->xid(), & g->phase(), g->progress(), g->final_amount(), g );
 
     _lock.r_unlock();
 
     return s;
 }
 
+// apply each job's statuses together
+// notfound: the index of each status for a job we do not have
+void
+QueuedJob::update(const ACPMRMActionStatusBatch *g, vector<int> *notfound){
+    map<string, vector<int> > byjob;
+
+    for(int i=0; i<g->status_size(); i++){
+        byjob[ g->status(i).jobid() ].push_back(i);
+    }
+
+    _lock.r_lock();
+
+    for(map<string, vector<int> >::iterator it=byjob.begin(); it != byjob.end(); it++){
+        QueueElem *e = _find_x( it->first.c_str() );
+
+        if( e && e->_heappos == -1 ){
+            Job *j = (Job*)e->_elem;
+            j->update( g, & it->second );
+        }else{
+            notfound->insert( notfound->end(), it->second.begin(), it->second.end() );
+        }
+    }
+
+    _lock.r_unlock();
+}
+
 
 void
 QueuedJob::_abort_q(void *x){
@@ -276,6 +343,11 @@ start_job(void *x){
 }
 
 
+int
+QueuedJob::max_running(void){
+    return MAXJOB;
+}
+
 void
 QueuedJob::start(void *x){
     start_thread( start_job, x);
@@ -298,14 +370,24 @@ Job::json(const char *st, string *dst){
     ostringstream b;
 
     _lock.r_lock();
-    const char *ph = (_stepno >= _plan.size()) ? "cleanup" : _plan[_stepno]->_phase.c_str();
+    string phs;
+    phase_names_x( &phs );
+    const char *ph = phs.c_str();
     if( _state == JOB_STATE_PLANNING ) ph = "planning";
     if( _state == JOB_STATE_QUEUED   ) ph = "queued";
 
 
+    // our share of the cluster vs what we are using
+    int slots = 0;
+    for(int i=0; i<_servers.size(); i++){
+        if( _servers[i]->_fair_slots > 0 ) slots += _servers[i]->_fair_slots;
+    }
+
     b << "{\"jobid\": \""       << _id                    << "\", "
       << "\"state\": \""        << st                     << "\", "
       << "\"phase\": \""        << ph           	  << "\", "
+      << "\"share\": {\"group\": \"" << _sharegroup << "\", \"weight\": " << _shareweight
+      << ", \"slots\": "        << slots << ", \"running\": " << _n_task_running << "}, "
       << "\"traceinfo\": \""    << _g.traceinfo().c_str() << "\", "
       << "\"options\": "        << _g.options().c_str()   << ", "		// options is json
       << "\"start_time\": "     << _created
@@ -342,6 +424,22 @@ Job::send_eu_msg_x(const char *type, const char *msg) const{
     }
 }
 
+// binary safe, for replaying saved output
+void
+Job::send_eu_msg_x(const char *type, const char *msg, int len) const{
+
+    if( _g.has_console() ){
+        ACPMRMDiagMsg gm;
+
+        gm.set_jobid( _id );
+        gm.set_server_id( myserver_id.c_str() );
+        gm.set_type( type );
+        gm.set_msg(  msg, len );
+
+        toss_request( udp4_fd, _g.console().c_str(), PHMT_MR_DIAGMSG, &gm );
+    }
+}
+
 
 void
 Job::kvetch(const char *msg, const char *arg1, const char *arg2, const char *arg3, const char *arg4) const {
@@ -390,6 +488,19 @@ Job::notify_finish(void) const {
     send_eu_msg_x("finish", "");
 }
 
+// several steps may be running at once
+void
+Job::phase_names_x(string *dst) const {
+
+    for(int i=0; i<_plan.size(); i++){
+        if( _plan[i]->_state != JOB_STEP_STATE_RUNNING ) continue;
+        if( !dst->empty() ) dst->append( "+" );
+        dst->append( _plan[i]->_phase );
+    }
+
+    if( dst->empty() ) dst->assign( "cleanup" );
+}
+
 float
 Job::efficency_x(void){
 
@@ -404,8 +515,9 @@ void
 Job::log_progress(bool rp){
 
     _lock.r_lock();
-    const char *ph = (_stepno >= _plan.size()) ? "cleanup" : _plan[_stepno]->_phase.c_str();
-
+    string phs;
+    phase_names_x( &phs );
+    const char *ph = phs.c_str();
 
     ostringstream b;
 
@@ -423,6 +535,7 @@ Job::log_progress(bool rp){
           << ", task "         << _n_task_running
           << ", xfer "         << _n_xfer_running
           << ", pend "         << _pending.size()
+          << ", disk "         << _disk_used / 1000000 << "MB"
           << "; effcy "        << efficency_x()
           << "; (ran: task "   << _n_tasks_run
           << ", xfer "         << _n_xfers_run
@@ -473,7 +586,8 @@ Job::report_final_stats(void){
           << ", task "         << _n_tasks_run
           << ", failed "       << _n_fails
           << ", xfer "         << _n_xfers_run
-          << ", dele "         << _n_deleted	<< "; ";
+          << ", dele "         << _n_deleted
+          << ", disk peak "    << _disk_peak / 1000000 << " MB"	<< "; ";
 
         format_dt(_task_run_time, b);
         b << " cpu, ";
@@ -484,6 +598,7 @@ Job::report_final_stats(void){
     _lock.r_unlock();
 
     report("%s", b.str().c_str());
+    cache_report();
 }
 
 void
@@ -498,6 +613,7 @@ Step::report_final_stats(Job *j){
     float sum2=0;
     int   ntask = _tasks.size();
     int   nserv = j->_servers.size();
+    long long cpu=0, mem=0, io=0;
 
     if( !_run_start ) return;
     if( !_run_time  ) _run_time = lr_now() - _run_start;
@@ -511,12 +627,18 @@ Step::report_final_stats(Job *j){
         sum2 += t->_run_time * t->_run_time;
         if( !min || min > t->_run_time ) min = t->_run_time;
         if( max < t->_run_time )         max = t->_run_time;
+
+        cpu += t->_cpu_usec;
+        io  += t->_io_bytes;
+        if( mem < t->_mem_peak ) mem = t->_mem_peak;
     }
 
     // xfers...
     b << "phase " << _phase
       << ", "     << ntask 	  << " tasks"
-      << ", "     << _n_xfers_run << " xfers " << _xfer_size / 1000000 << "MB; ";
+      << ", "     << _n_xfers_run << " xfers " << _xfer_size / 1000000 << "MB";
+    if( _xdc_size ) b << " (" << _xdc_size / 1000000 << "MB cross-dc)";
+    b << "; ";
     format_dt(sum, b); 		b << " cpu, ";
     format_dt(_run_time, b);	b << " wall";
 
@@ -531,6 +653,13 @@ Step::report_final_stats(Job *j){
           << 100.0 * rsd 			  << " lumpy";	// lopsidedness - lower is better
     }
 
+    // measured by the servers
+    if( cpu ){
+        b << "\n    ";
+        format_dt(cpu / 1000000, b);
+        b << " cpu used, " << mem / 1000000 << " MB peak task, " << io / 1000000 << " MB io";
+    }
+
     j->send_eu_msg_x("report", b.str().c_str());
 }
 
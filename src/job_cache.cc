@@ -0,0 +1,377 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Jun-02 11:20 (EDT)
+  Function: job result cache
+
+*/
+#define CURRENT_SUBSYSTEM	'j'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "network.h"
+#include "runmode.h"
+#include "thread.h"
+#include "lock.h"
+#include "peers.h"
+#include "queued.h"
+#include "job.h"
+#include "crypto.h"
+
+#include "mrmagoo.pb.h"
+#include "std_reply.pb.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <sstream>
+using std::ostringstream;
+
+
+#define CACHEDIR		"mrtmp/cache"
+#define STDOUTSPEC		"mrtmp/j_%s/stdout_%03d_%03d"
+//                                          jobid  step task
+#define CACHESPEC		CACHEDIR "/%s/stdout_%03d_%03d"
+//                                         key   step task
+#define REPLAYSIZE		4096		// send this much at a time to the console
+
+
+// the result of a job is what its final steps (those whose output
+// nothing else consumes) write to stdout.
+// the same program, with the same options, reading the same input files,
+// produces the same result. so we keep a copy here, on the master,
+// and play it back instead of running the whole thing again.
+//
+// NB: the index file is written last, a cache entry without one is incomplete
+
+
+static int       cache_hits   = 0;
+static int       cache_misses = 0;
+static long long cache_saved  = 0;
+
+
+static void
+cache_dir(const string *key, string *dst){
+
+    dst->assign( config->basedir );
+    dst->append( "/" CACHEDIR "/" );
+    dst->append( *key );
+}
+
+// total number of result files
+int
+Job::cache_nfile(void) const {
+    int n = 0;
+
+    for(int s=0; s<_plan.size(); s++){
+        Step *st = _plan[s];
+        if( st->_outputs.empty() ) n += st->_tasks.size();
+    }
+    return n;
+}
+
+// key: program + options + planned input files (+sizes)
+int
+Job::cache_plan(void){
+    char buf[256];
+
+    if( !config->result_cache ) return 1;
+    if( _g.has_cache() && !_g.cache() ) return 1;
+
+    _lock.w_lock();
+
+    HashSHA1 h;
+
+    for(int i=0; i<_g.section_size(); i++){
+        const ACPMRMJobPhase *jp = &_g.section(i);
+
+        h.update( jp->phase().c_str(), jp->phase().size() + 1 );
+        h.update( jp->src().data(), jp->src().size() );
+
+        if( jp->has_width() ){
+            int w = jp->width();
+            h.update( (char*)&w, sizeof(w) );
+        }
+        for(int j=0; j<jp->input_size(); j++){
+            int in = jp->input(j);
+            h.update( (char*)&in, sizeof(in) );
+        }
+        h.update( jp->partition().c_str(), jp->partition().size() + 1 );
+        h.update( jp->options().c_str(),   jp->options().size() + 1 );
+    }
+
+    h.update( _g.options().c_str(), _g.options().size() + 1 );
+
+    for(int s=0; s<_plan.size(); s++){
+        Step *map = _plan[s];
+        if( !map->_is_map ) continue;
+
+        for(int i=0; i<map->_tasks.size(); i++){
+            TaskToDo *t = map->_tasks[i];
+
+            h.update( (char*)&s, sizeof(s) );
+            h.update( (char*)&t->_totalsize, sizeof(t->_totalsize) );
+            for(int j=0; j<t->_g.infile_size(); j++){
+                const string *f = & t->_g.infile(j);
+                h.update( f->c_str(), f->size() + 1 );
+            }
+        }
+    }
+
+    h.digest64(buf, sizeof(buf));
+
+    // safe encode: / => _
+    for(char *p=buf; *p; p++){
+        if( *p == '/' ) *p = '_';
+    }
+
+    _cachekey.assign( buf );
+    DEBUG("cache key %s", buf);
+
+    // save the stdout of the final steps
+    for(int s=0; s<_plan.size(); s++){
+        Step *last = _plan[s];
+        if( !last->_outputs.empty() ) continue;
+
+        for(int i=0; i<last->_tasks.size(); i++){
+            snprintf(buf, sizeof(buf), STDOUTSPEC, _id, s, i);
+            last->_tasks[i]->_g.set_stdoutfile( buf );
+        }
+    }
+
+    _lock.w_unlock();
+    return 1;
+}
+
+// do we already have the answer? send it to the end-user
+int
+Job::cache_lookup(void){
+    string dir;
+    struct stat st;
+    int nfile = 0;
+    long long input = 0;
+
+    if( _cachekey.empty() ) return 0;
+
+    cache_dir( &_cachekey, &dir );
+    string idx = dir;
+    idx.append( "/index" );
+
+    if( stat(idx.c_str(), &st) == -1 || st.st_mtime + config->result_cache < lr_now() ){
+        ATOMIC_ADD32(cache_misses, 1);
+        return 0;
+    }
+
+    FILE *f = fopen( idx.c_str(), "r" );
+    if( !f ){
+        ATOMIC_ADD32(cache_misses, 1);
+        return 0;
+    }
+    int n = fscanf(f, "files %d\ninput %lld\n", &nfile, &input);
+    fclose(f);
+
+    if( n != 2 || nfile != cache_nfile() ){
+        ATOMIC_ADD32(cache_misses, 1);
+        return 0;
+    }
+
+    // all of the files, or it is a miss. (before sending anything)
+    vector<int> fds;
+
+    for(int s=0; s<_plan.size(); s++){
+        Step *last = _plan[s];
+        if( !last->_outputs.empty() ) continue;
+
+        for(int i=0; i<last->_tasks.size(); i++){
+            char file[256];
+            snprintf(file, sizeof(file), "%s/stdout_%03d_%03d", dir.c_str(), s, i);
+
+            int fd = open( file, O_RDONLY );
+            if( fd < 0 ){
+                inform("cannot read cached result %s: %s", file, strerror(errno));
+                for(int j=0; j<fds.size(); j++) close( fds[j] );
+                ATOMIC_ADD32(cache_misses, 1);
+                return 0;
+            }
+            fds.push_back( fd );
+        }
+    }
+
+    inform("found cached result %s", _cachekey.c_str());
+
+    char *buf = (char*)malloc(REPLAYSIZE);
+    if( !buf ) FATAL("out of memory");
+
+    for(int j=0; j<fds.size(); j++){
+        while(1){
+            int r = read(fds[j], buf, REPLAYSIZE);
+            if( r < 1 ) break;
+            send_eu_msg_x("stdout", buf, r);
+            // do not overrun the console
+            usleep( 1000 );
+        }
+        close( fds[j] );
+    }
+
+    free(buf);
+
+    _lock.w_lock();
+    _cache_hit = 1;
+    _state = JOB_STATE_FINISHED;
+    _lock.w_unlock();
+
+    ATOMIC_ADD32(cache_hits, 1);
+    ATOMIC_ADD64(cache_saved, _totalmapsize);
+
+    return 1;
+}
+
+// copy a final step's stdout over here
+void
+Job::cache_xfer_x(TaskToDo *t){
+    char buf[256];
+
+    if( _cachekey.empty() ) return;
+    if( ! t->_g.has_stdoutfile() ) return;
+
+    int me = server_index( myserver_id.c_str() );
+    if( me == -1 ) return;
+
+    snprintf(buf, sizeof(buf), CACHESPEC, _cachekey.c_str(), t->_stepno, t->_taskno);
+
+    XferToDo *x = new XferToDo(this, t->_stepno, & t->_g.stdoutfile(), t->_serveridx, me);
+    x->_g.set_dstname( buf );
+
+    _pending.push_back(x);
+    _xfers.push_back(x);
+
+    add_delete_x( & t->_g.stdoutfile(), t->_serveridx, JOB_DELETE_AT_END );
+}
+
+// the job finished successfully, mark the cached result complete
+void
+Job::cache_save(void){
+    string dir;
+    struct stat st;
+
+    if( _cachekey.empty() || _cache_hit ) return;
+
+    cache_dir( &_cachekey, &dir );
+    int nfile = cache_nfile();
+
+    // is everything here?
+    for(int s=0; s<_plan.size(); s++){
+        Step *last = _plan[s];
+        if( !last->_outputs.empty() ) continue;
+
+        for(int i=0; i<last->_tasks.size(); i++){
+            char file[256];
+            snprintf(file, sizeof(file), "%s/stdout_%03d_%03d", dir.c_str(), s, i);
+            if( stat(file, &st) == -1 ){
+                DEBUG("cache incomplete, missing %s", file);
+                return;
+            }
+        }
+    }
+
+    string idx = dir;
+    idx.append( "/index" );
+    string tmp = idx;
+    tmp.append( ".tmp" );
+
+    FILE *f = fopen( tmp.c_str(), "w" );
+    if( !f ){
+        PROBLEM("cannot save cache index %s: %s", tmp.c_str(), strerror(errno));
+        return;
+    }
+    fprintf(f, "files %d\ninput %lld\n", nfile, _totalmapsize);
+    fprintf(f, "# %s\n", _g.traceinfo().c_str());
+    fclose(f);
+
+    rename( tmp.c_str(), idx.c_str() );
+    DEBUG("saved cached result %s", _cachekey.c_str());
+}
+
+void
+Job::cache_report(void){
+    ostringstream b;
+
+    if( !config->result_cache ) return;
+
+    b << "cache " << (_cache_hit ? "hit" : (_cachekey.empty() ? "off" : "miss"))
+      << "; hits "    << cache_hits
+      << ", misses "  << cache_misses
+      << ", saved "   << cache_saved / 1000000 << " MB(gz)";
+
+    report("%s", b.str().c_str());
+}
+
+/****************************************************************/
+
+static void
+cache_remove(const char *dir){
+    DIR *d = opendir(dir);
+    struct dirent *de;
+
+    if( !d ) return;
+
+    while( (de = readdir(d)) ){
+        if( de->d_name[0] == '.' ) continue;
+        string file = dir;
+        file.append( "/" );
+        file.append( de->d_name );
+        unlink( file.c_str() );
+    }
+    closedir(d);
+
+    rmdir( dir );
+}
+
+// remove old cached results
+void
+job_cache_expire(void){
+    struct stat st;
+
+    if( !config->result_cache ) return;
+
+    string base = config->basedir;
+    base.append( "/" CACHEDIR );
+
+    DIR *d = opendir( base.c_str() );
+    if( !d ) return;
+
+    hrtime_t old = lr_now() - config->result_cache;
+    list<string> expired;
+    struct dirent *de;
+
+    while( (de = readdir(d)) ){
+        if( de->d_name[0] == '.' ) continue;
+
+        string dir = base;
+        dir.append( "/" );
+        dir.append( de->d_name );
+
+        if( stat(dir.c_str(), &st) == -1 ) continue;
+        if( st.st_mtime >= old ) continue;
+
+        // keep it if the index is still fresh
+        string idx = dir;
+        idx.append( "/index" );
+        if( stat(idx.c_str(), &st) != -1 && st.st_mtime >= old ) continue;
+
+        expired.push_back( dir );
+    }
+    closedir(d);
+
+    for(list<string>::iterator it=expired.begin(); it != expired.end(); it++){
+        DEBUG("expiring cached result %s", it->c_str());
+        cache_remove( it->c_str() );
+    }
+}
@@ -30,30 +30,55 @@
 
 
 
-Delete::Delete(const string *file){
+Delete::Delete(const string *file, int release){
     _filename.assign( file->c_str() );
+    _release = release;
+    _size    = 0;
 }
 
-void
-Job::add_delete_x(const string *file, int idx){
-    Delete *d = new Delete (file);
+Delete *
+Job::add_delete_x(const string *file, int idx, int release){
+    Delete *d = new Delete (file, release);
 
     _servers[idx]->_to_delete.push_back(d);
+    return d;
+}
+
+// a file of known size now exists (or was deleted: size = 0)
+void
+Job::disk_used_x(Delete *d, long long size){
+
+    _disk_used += size - d->_size;
+    d->_size    = size;
+
+    if( _disk_used > _disk_peak ) _disk_peak = _disk_used;
 }
 
 // add this task's files to the list to be deleted
+// (the copies are added as the xfers are created)
 void
 TaskToDo::create_deles(void){
 
-    int noutf = _g.outfile_size();
-    int nserv = _job->_servers.size();
+    Step *step = _job->_plan[ _stepno ];
+
+    _outdeles.resize( _g.outfile_size() );
+
+    // final step output stays put until the end
+    if( step->_outputs.empty() ){
+        for(int i=0; i<_g.outfile_size(); i++)
+            _outdeles[i] = _job->add_delete_x(&_g.outfile(i), _serveridx, JOB_DELETE_AT_END);
+        return;
+    }
+
+    // everything else can go as soon as the consumer is done with it
+    int nout = 0;
 
-    for(int i=0; i<noutf; i++){
-        int dst = i % nserv;
-        if( _serveridx == dst ) dst = (i+1) % nserv;
+    for(int o=0; o<step->_outputs.size(); o++){
+        Step *dstep = _job->_plan[ step->_outputs[o] ];
 
-        _job->add_delete_x(&_g.outfile(i), _serveridx);		// src
-        _job->add_delete_x(&_g.outfile(i), dst);		// dst
+        for(int i=0; i<dstep->_tasks.size(); i++, nout++){
+            _outdeles[nout] = _job->add_delete_x(&_g.outfile(nout), _serveridx, dstep->_stepno);
+        }
     }
 }
 
@@ -83,7 +108,149 @@ Job::stop_tasks(void){
     return 1;
 }
 
-// delete all of the tmp files
+// warm workers (see pipeline.cc) would otherwise stay until they are idle
+// an abort with no task => the whole job
+void
+Job::stop_warm(void){
+    ACPMRMTaskAbort req;
+    bool warm = 0;
+
+    for(int s=0; s<_plan.size() && !warm; s++){
+        Step *step = _plan[s];
+
+        for(int i=0; i<step->_tasks.size(); i++){
+            if( step->_tasks[i]->_g.warm() ) warm = 1;
+        }
+    }
+    if( !warm ) return;
+
+    req.set_jobid( _id );
+    req.set_taskid( "" );
+
+    for(int i=0; i<_servers.size(); i++){
+        toss_request(udp4_fd, _servers[i], PHMT_MR_TASKABORT, &req );
+    }
+}
+
+static void *
+step_deletes(void *x){
+    Job *j = (Job*)x;
+
+    j->run_step_deletes();
+    return 0;
+}
+
+// delete files whose consumers have finished
+// NB: runs in the main job thread. the deletes happen in their own thread,
+// so a slow or dead server does not hold up the scheduling
+void
+Job::do_step_deletes(void){
+
+    _lock.w_lock();
+    if( !_dele_ready || _dele_running ){
+        _lock.w_unlock();
+        return;
+    }
+    _dele_ready   = 0;
+    _dele_running = 1;
+    _lock.w_unlock();
+
+    if( start_thread(step_deletes, (void*)this) ){
+        // try again later
+        _lock.w_lock();
+        _dele_ready   = 1;
+        _dele_running = 0;
+        _lock.w_unlock();
+    }
+}
+
+// send one batch. 0 => failed
+static int
+send_deletes(Server *srvr, list<Delete*> *batch){
+    ACPMRMFileDel req;
+
+    for(list<Delete*>::iterator it=batch->begin(); it != batch->end(); it++){
+        req.add_filename( (*it)->_filename.c_str() );
+    }
+
+    return make_request(srvr, PHMT_MR_FILEDEL, &req, TIMEOUT);
+}
+
+void
+Job::run_step_deletes(void){
+    int ndele = 0, nfail = 0;
+
+    _lock.w_lock();
+    int nserv = _servers.size();
+    vector< list<Delete*> > ready( nserv );
+
+    for(int idx=0; idx<nserv; idx++){
+        list<Delete*> *dele = & _servers[idx]->_to_delete;
+
+        for(list<Delete*>::iterator it=dele->begin(); it != dele->end(); ){
+            Delete *d = *it;
+
+            if( d->_release != JOB_DELETE_AT_END && _plan[ d->_release ]->_state == JOB_STEP_STATE_FINISHED ){
+                ready[idx].push_back(d);
+                it = dele->erase(it);
+            }else{
+                it++;
+            }
+        }
+    }
+    _lock.w_unlock();
+
+    // batch them up, one server at a time
+    for(int idx=0; idx<nserv; idx++){
+        Server *srvr = _servers[idx];
+        list<Delete*> done, failed;
+        bool down = 0;
+
+        while( !ready[idx].empty() ){
+            list<Delete*> batch;
+
+            while( !ready[idx].empty() && batch.size() < MAXFILES ){
+                batch.push_back( ready[idx].front() );
+                ready[idx].pop_front();
+            }
+
+            // server pro'ly down. keep them for the end
+            if( !down && !send_deletes(srvr, &batch) ) down = 1;
+
+            if( down )
+                failed.splice( failed.end(), batch );
+            else
+                done.splice( done.end(), batch );
+        }
+
+        ndele += done.size();
+        nfail += failed.size();
+
+        _lock.w_lock();
+        for(list<Delete*>::iterator it=done.begin(); it != done.end(); it++){
+            Delete *d = *it;
+            disk_used_x(d, 0);
+            delete d;
+        }
+        // cleanup() will try again
+        for(list<Delete*>::iterator it=failed.begin(); it != failed.end(); it++){
+            Delete *d = *it;
+            d->_release = JOB_DELETE_AT_END;
+            srvr->_to_delete.push_back(d);
+        }
+        _lock.w_unlock();
+    }
+
+    if( ndele ) DEBUG("deleted %d files", ndele);
+    if( nfail ) DEBUG("cannot delete %d files, will retry at end", nfail);
+
+    _lock.w_lock();
+    _n_deleted   += ndele;
+    _dele_running = 0;
+    _lock.w_unlock();
+}
+
+// delete all of the (remaining) tmp files
 void
 Job::do_deletes(void){
     ACPMRMFileDel req;
@@ -121,10 +288,16 @@ Job::do_deletes(void){
         if( req.filename_size() ){
             int ok = make_request(srvr, PHMT_MR_FILEDEL, &req, TIMEOUT);
         }
+
+        _lock.w_lock();
+        for(list<Delete*>::iterator it=dele.begin(); it != dele.end(); it++){
+            disk_used_x(*it, 0);
+        }
+        _lock.w_unlock();
     }
 
     _lock.w_lock();
-    _n_deleted = ndele;
+    _n_deleted += ndele;
     _lock.w_unlock();
 }
 
@@ -136,7 +309,13 @@ int
 Job::cleanup(void){
 
     stop_tasks();
-    do_deletes();
+    stop_warm();
+
+    // let the step deletes finish
+    while( _dele_running ) sleep(1);
+
+    // nothing ran, nothing to delete
+    if( !_cache_hit ) do_deletes();
 
     return 1;
 }
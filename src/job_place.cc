@@ -0,0 +1,274 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Jun-09 15:02 (EDT)
+  Function: where should things run?
+
+*/
+#define CURRENT_SUBSYSTEM	'j'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "network.h"
+#include "runmode.h"
+#include "thread.h"
+#include "lock.h"
+#include "peers.h"
+#include "queued.h"
+#include "job.h"
+
+#include "mrmagoo.pb.h"
+#include "std_reply.pb.h"
+
+
+#define MINDISKFREE		1024		// MB - don't put new work on servers with less
+#define DISKWEIGHT		1000		// penalty for the emptiest server relative to the fullest
+#define TASKWEIGHT		1000		// per task, per core
+#define XFERWEIGHT		100
+#define REDOWEIGHT		1000
+#define FAILWEIGHT		500
+#define FAILHALFLIFE		300		// older failures count for less
+#define RACKWEIGHT		500		// backup copy in the same rack
+#define XDCWEIGHT		100000		// backup copy in another datacenter
+
+
+// score each server on
+//   free disk, load, #cores, work we have given it, failures
+// lower is better
+
+
+// refresh what we know about the servers
+void
+Job::update_servers_x(void){
+
+    for(int i=0; i<_servers.size(); i++){
+        Server *s = _servers[i];
+
+        s->_load       = peerdb->current_load( s->name.c_str() );
+        s->_disk_free  = peerdb->current_disk( s->name.c_str() );
+        s->_fair_slots = peerdb->fair_slots( s->name.c_str(), &_sharegroup, _shareweight );
+        s->_task_slots = peerdb->task_slots( s->name.c_str() );
+    }
+}
+
+void
+Job::update_servers(void){
+
+    _lock.w_lock();
+    update_servers_x();
+    _lock.w_unlock();
+}
+
+// -1 => do not use
+int
+Job::server_score_x(int idx, int maxdisk, int planned, bool strict){
+    Server *s = _servers[idx];
+    int cpus  = s->cpus ? s->cpus : 1;
+
+    // nearly full? find someplace else
+    if( strict && s->_disk_free >= 0 && s->_disk_free < MINDISKFREE ) return -1;
+
+    int m = s->_load / cpus
+        + (s->_n_task_running + planned) * TASKWEIGHT / cpus
+        + s->_n_xfer_running * XFERWEIGHT
+        + s->_n_task_redo    * REDOWEIGHT;
+
+    // recent failures count more
+    if( s->_n_fails ){
+        int age = (lr_now() - s->_last_fail) / FAILHALFLIFE;
+        if( age > 16 ) age = 16;
+        m += (s->_n_fails * FAILWEIGHT) >> age;
+    }
+
+    // less free disk => less work
+    if( maxdisk > 0 && s->_disk_free >= 0 )
+        m += (int)( (long long)DISKWEIGHT * (maxdisk - s->_disk_free) / maxdisk );
+
+    return m;
+}
+
+// pick the best server (other than avoid). -1 => none
+// planned: #tasks already placed on each server, but not yet running
+// extra:   added to each server's score, -1 => do not use
+int
+Job::best_server_x(int avoid, const vector<int> *planned, const vector<int> *extra){
+    int nserv   = _servers.size();
+    int maxdisk = 0;
+
+    for(int i=0; i<nserv; i++){
+        if( _servers[i]->_disk_free > maxdisk ) maxdisk = _servers[i]->_disk_free;
+    }
+
+    // if everything is full, take what we can get
+    for(int strict=1; strict>=0; strict--){
+        int bestm=-1, besti=-1;
+
+        for(int i=0; i<nserv; i++){
+            if( i == avoid ) continue;
+            if( extra && (*extra)[i] < 0 ) continue;
+
+            int m = server_score_x(i, maxdisk, planned ? (*planned)[i] : 0, strict);
+            if( m < 0 ) continue;
+            if( extra ) m += (*extra)[i];
+
+            if( (bestm == -1) || (m < bestm) ){
+                besti = i;
+                bestm = m;
+            }
+        }
+
+        if( besti != -1 ) return besti;
+    }
+
+    return -1;
+}
+
+// pick the best of these servers (other than avoid). -1 => none
+int
+Job::best_replica_x(const vector<int> *cand, int avoid){
+    int bestm=-1, besti=-1;
+    int maxdisk = 0;
+
+    for(int i=0; i<_servers.size(); i++){
+        if( _servers[i]->_disk_free > maxdisk ) maxdisk = _servers[i]->_disk_free;
+    }
+
+    for(int i=0; i<cand->size(); i++){
+        int s = (*cand)[i];
+        if( s == avoid ) continue;
+        if( ! peerdb->is_it_up( _servers[s]->name.c_str() ) ) continue;
+
+        int m = server_score_x(s, maxdisk, 0, 0);
+
+        if( (bestm == -1) || (m < bestm) ){
+            besti = s;
+            bestm = m;
+        }
+    }
+
+    return besti;
+}
+
+// where does the second copy of a file go, if the consumer is on the same server
+// keep it in the same datacenter (cross-dc links are scarce), but not the same rack
+int
+Job::backup_dst_x(TaskToDo *prod, TaskToDo *cons){
+    int nserv = _servers.size();
+    vector<int> topo( nserv, 0 );
+
+    for(int i=0; i<nserv; i++){
+        switch( distance_x(prod->_serveridx, i) ){
+        case TOPO_RACK:	topo[i] = RACKWEIGHT;	break;
+        case TOPO_XDC:	topo[i] = XDCWEIGHT;	break;
+        }
+    }
+
+    int dst = best_server_x( prod->_serveridx, 0, &topo );
+    if( dst == -1 ) return prod->_serveridx;
+
+    // remember, so a replacement can find it
+    int idx = cons->infile_index( prod->_stepno, prod->_taskno );
+    if( idx >= 0 ){
+        if( cons->_inbackup.size() < cons->_g.infile_size() )
+            cons->_inbackup.resize( cons->_g.infile_size(), -1 );
+        cons->_inbackup[idx] = dst;
+    }
+
+    return dst;
+}
+
+// where is the backup copy of this infile?
+int
+TaskToDo::infile_backup(int idx){
+
+    if( idx < _inbackup.size() && _inbackup[idx] != -1 ) return _inbackup[idx];
+    return _job->backup_server( _serveridx );
+}
+
+// file from task taskno of step stepno is which of our infiles?
+int
+TaskToDo::infile_index(int stepno, int taskno){
+    Step *step = _job->_plan[ _stepno ];
+    int idx = 0;
+
+    for(int s=0; s<step->_inputs.size(); s++){
+        Step *in = _job->_plan[ step->_inputs[s] ];
+        if( in->_stepno == stepno ) return idx + taskno;
+        idx += in->_tasks.size();
+    }
+
+    return -1;
+}
+
+/****************************************************************/
+
+// where are the servers?
+void
+Job::topology_x(void){
+    string dc, rack;
+
+    _datacenters.clear();
+
+    for(int i=0; i<_servers.size(); i++){
+        Server *s = _servers[i];
+        peerdb->topology( s->name.c_str(), &dc, &rack );
+
+        int d;
+        for(d=0; d<_datacenters.size(); d++){
+            if( !_datacenters[d].compare(dc) ) break;
+        }
+        if( d == _datacenters.size() ) _datacenters.push_back( dc );
+
+        s->_dc   = d;
+        s->_rack = rack;
+    }
+
+    DEBUG("%d servers in %d datacenters", _servers.size(), _datacenters.size());
+}
+
+int
+Job::distance_x(int a, int b) const {
+    const Server *sa = _servers[a];
+    const Server *sb = _servers[b];
+
+    if( a == b ) return TOPO_SAME;
+    if( sa->_dc != sb->_dc ) return TOPO_XDC;
+    if( !sa->_rack.empty() && !sa->_rack.compare(sb->_rack) ) return TOPO_RACK;
+    return TOPO_DC;
+}
+
+// what fraction of a reduce step's input comes from each datacenter?
+// returns the number of datacenters with input
+int
+Job::reduce_dc_x(const Step *step, vector<double> *frac){
+    double total = 0;
+    int ndc = 0;
+
+    frac->clear();
+    frac->resize( _datacenters.size(), 0 );
+
+    for(int s=0; s<step->_inputs.size(); s++){
+        const Step *in = _plan[ step->_inputs[s] ];
+
+        for(int i=0; i<in->_tasks.size(); i++){
+            const TaskToDo *t = in->_tasks[i];
+            if( !t ) continue;
+
+            // map tasks know their input size, otherwise, count tasks
+            double w = (in->_is_map && t->_totalsize > 0) ? t->_totalsize : 1;
+            (*frac)[ _servers[t->_serveridx]->_dc ] += w;
+            total += w;
+        }
+    }
+
+    if( total <= 0 ) return 0;
+
+    for(int d=0; d<frac->size(); d++){
+        if( (*frac)[d] > 0 ) ndc ++;
+        (*frac)[d] /= total;
+    }
+
+    return ndc;
+}
@@ -38,10 +38,14 @@ using std::ostringstream;
 #define REDUCEFACTOR		1.95		// reduce width factor
 #define REDUCEDECAY		.5
 #define WRITE_TIMEOUT		15
-#define FILESPEC		"mrtmp/j_%s/out_%03d_%03d_%03d"
-//                                    jobid  stepno srctask dsttask
+#define FILESPEC		"mrtmp/j_%s/out_%03d_%03d_%03d_%03d"
+//                                    jobid  srcstep srctask dststep dsttask
 
 // NB: task #n (normally) runs on server #n (mod #servers)
+// NB: the steps form a dag. by default, each step reads the step before it.
+//     map steps read files from the planner, and can appear anywhere.
+
+extern int jobsrc_save(const string *, string *);
 
 
 int
@@ -58,15 +62,22 @@ Job::plan(void){
 
     for(int i=0; i<nstep; i++){
         Step * s = new Step;
-        s->_phase = _g.section(i).phase().c_str();
+        s->_phase     = _g.section(i).phase().c_str();
+        s->_stepno    = i;
+        s->_is_map    = (i == 0) || (s->_phase == "map");
+        s->_broadcast = (_g.section(i).partition() == "broadcast");
+        // large programs are fetched by the workers, once
+        jobsrc_save( & _g.section(i).src(), &s->_srchash );
         _plan[i] = s;
     }
     _lock.w_unlock();
 
+    if( ! plan_graph() )   return 0;
     if( ! plan_servers() ) return 0;
     if( ! plan_map() )     return 0;
     if( ! plan_reduce() )  return 0;
     if( ! plan_files() )   return 0;
+    if( ! cache_plan() )   return 0;
 
     _lock.w_lock();
     _state = JOB_STATE_RUNNING;
@@ -76,18 +87,23 @@ Job::plan(void){
     inform("done planning");
 
     _lock.r_lock();
-    int maps = _plan[0]->_tasks.size();
+    int maps = 0, nred = 0;
+
+    for(int i=0; i<_plan.size(); i++){
+        if( _plan[i]->_is_map ) maps += _plan[i]->_tasks.size();
+    }
 
     ostringstream b;
     b << "plan: input size: " << (_totalmapsize / 1000000LL)
       << " MB(gz), maps: "    << maps
       << ", reduces: ";
 
-    for(int i=1; i<_plan.size(); i++){
-        if( i > 1 ) b << "+";
+    for(int i=0; i<_plan.size(); i++){
+        if( _plan[i]->_is_map ) continue;
+        if( nred++ ) b << "+";
         b << _plan[i]->_tasks.size();
     }
-    if( _plan.size() == 1 ) b << "0";
+    if( !nred ) b << "0";
 
     const char *bc = b.str().c_str();
     report(bc);
@@ -98,6 +114,58 @@ Job::plan(void){
 }
 
 
+// connect the steps
+int
+Job::plan_graph(void){
+
+    _lock.w_lock();
+    int nstep = _plan.size();
+
+    for(int i=0; i<nstep; i++){
+        Step *step = _plan[i];
+        const ACPMRMJobPhase *jp = &_g.section(i);
+
+        if( jp->has_partition() && jp->partition() != "hash" && jp->partition() != "broadcast" ){
+            _lock.w_unlock();
+            kvetch("invalid partition %s in %s", jp->partition().c_str(), step->_phase.c_str());
+            return 0;
+        }
+
+        if( step->_is_map ){
+            // maps read the planner's files, not other steps
+            if( jp->input_size() ){
+                _lock.w_unlock();
+                kvetch("map cannot have inputs");
+                return 0;
+            }
+            continue;
+        }
+
+        if( !jp->input_size() )
+            step->_inputs.push_back( i - 1 );
+
+        for(int j=0; j<jp->input_size(); j++){
+            int in = jp->input(j);
+
+            // inputs must come earlier. this keeps the graph acyclic
+            if( in < 0 || in >= i
+                || std::find(step->_inputs.begin(), step->_inputs.end(), in) != step->_inputs.end() ){
+                _lock.w_unlock();
+                kvetch("invalid input for %s", step->_phase.c_str());
+                return 0;
+            }
+            step->_inputs.push_back( in );
+        }
+
+        for(int j=0; j<step->_inputs.size(); j++){
+            _plan[ step->_inputs[j] ]->_outputs.push_back( i );
+        }
+    }
+
+    _lock.w_unlock();
+    return 1;
+}
+
 // what servers are currently available?
 int
 Job::plan_servers(void){
@@ -114,6 +182,8 @@ Job::plan_servers(void){
     }
 
     std::random_shuffle( _servers.begin(), _servers.end() );
+    update_servers_x();
+    topology_x();
 
     _lock.w_unlock();
 
@@ -235,16 +305,34 @@ wait_for_fd(int fd){
 
 /*
   task 82
-  map mrm@gefiltefish7-r4.ccsphl 105131597 21
+  map mrm@gefiltefish7-r4.ccsphl 105131597 21 mrm@gefiltefish3-r2.ccsphl
   file dancr/2014/03/25/02/2759_prod_DF3u.p9VrdtCRcN8_.gz
 
+  (map lines may list other servers with replicas of all of the files)
+
 */
 
 int
 Job::plan_map(void){
+
+    for(int i=0; i<_plan.size(); i++){
+        if( ! _plan[i]->_is_map ) continue;
+
+        // each map can have its own planner options
+        const ACPMRMJobPhase *jp = &_g.section(i);
+        const string *opts = jp->has_options() ? &jp->options() : &_g.options();
+
+        if( ! plan_map(i, opts) ) return 0;
+    }
+
+    return 1;
+}
+
+int
+Job::plan_map(int stepno, const string *opts){
     int pid = 0;
 
-    int fd = run_planner( this, &_g.options(), &pid );
+    int fd = run_planner( this, opts, &pid );
     if( fd == -1 ) return 0;
     FILE *f = fdopen( fd, "r" );
     if( !f ){
@@ -259,7 +347,7 @@ Job::plan_map(void){
 
     _lock.w_lock();
     // read data from planner
-    Step *map = _plan[0];
+    Step *map = _plan[stepno];
     int ms = map->read_map_plan(this, f);
     _lock.w_unlock();
 
@@ -275,18 +363,27 @@ TaskToDo::TaskToDo(Job *j, int sec, int tno){
 
     _totalsize   = 0;
     _job         = j;
+    _stepno      = sec;
     _state       = 0;
     _tries       = 0;
     _run_start   = 0;
     _run_time    = 0;
+    _cpu_usec    = 0;
+    _mem_peak    = 0;
+    _io_bytes    = 0;
     _delay_until = 0;
     _replaces    = 0;
     _replacedby  = 0;
     _taskno      = tno;
+    _outserver   = -1;
+    _speculative = 0;
+    _n_infile_have = 0;
 
     _g.set_jobid(   j->_id );
     _g.set_console( j->_g.console().c_str() );
     _g.set_master(  myipandport.c_str() );
+    _g.set_sharegroup(  j->_sharegroup.c_str() );
+    _g.set_shareweight( j->_shareweight );
 
     if( j->_g.has_priority() ){
         _g.set_priority( j->_g.priority() );
@@ -298,9 +395,20 @@ TaskToDo::TaskToDo(Job *j, int sec, int tno){
     const ACPMRMJobPhase *jp = &j->_g.section(sec);
 
     _g.set_phase(   jp->phase().c_str() );
-    _g.set_jobsrc(  jp->src().c_str() );
+    const string *srchash = & j->_plan[sec]->_srchash;
+    if( srchash->empty() ){
+        _g.set_jobsrc(  jp->src() );
+    }else{
+        _g.set_jobsrc( "" );
+        _g.set_jobsrc_hash( srchash->c_str() );
+    }
     _g.set_maxrun(  jp->maxrun() );
     _g.set_timeout( jp->timeout() );
+    if( jp->warm() ) _g.set_warm( jp->warm() );
+    if( jp->framed() ) _g.set_framed( 1 );
+    // used by the framer, and by native plugins
+    if( jp->group_max() )     _g.set_group_max( jp->group_max() );
+    if( jp->group_maxsize() ) _g.set_group_maxsize( jp->group_maxsize() );
 
     unique( &_xid );
     _g.set_taskid( _xid.c_str() );
@@ -331,7 +439,7 @@ Step::read_map_plan(Job *j, FILE *f){
     _width = ntask;
 
     for(int i=0; i<ntask; i++){
-        TaskToDo *t = new TaskToDo(j, 0, i);
+        TaskToDo *t = new TaskToDo(j, _stepno, i);
         int s = t->read_map_plan(f);
         _tasks[i] = t;
         if( !s ) return 0;
@@ -351,6 +459,28 @@ Job::server_index(const char *s){
     return -1;
 }
 
+// where the second copy of a file goes (if we didn't keep track)
+// the next server in the same datacenter, preferably in another rack
+int
+Job::backup_server(int s){
+    int nserv = _servers.size();
+    int best  = (s + 1) % nserv;
+    int bestd = TOPO_XDC;
+
+    for(int i=1; i<nserv; i++){
+        int b = (s + i) % nserv;
+        int d = distance_x(s, b);
+
+        if( d == TOPO_DC ) return b;
+        if( d < bestd ){
+            best  = b;
+            bestd = d;
+        }
+    }
+
+    return best;
+}
+
 int
 TaskToDo::read_map_plan(FILE *f){
     char buf[1024];
@@ -361,7 +491,7 @@ TaskToDo::read_map_plan(FILE *f){
         return 0;
     }
 
-    //   map mrm@gefiltefish7-r4.ccsphl 105131597 21
+    //   map mrm@gefiltefish7-r4.ccsphl 105131597 21 [replicas...]
 
     // skip to server
     char *sns = buf;
@@ -396,7 +526,24 @@ TaskToDo::read_map_plan(FILE *f){
         return 0;
     }
 
-    DEBUG("sidx %d size %lld files %d", _serveridx, _totalsize, nfile);
+    // replicas (optional) - where a backup task could run
+    char *rps = nfs;
+    while( *rps && !isspace(*rps) ) rps++;
+
+    while( *rps ){
+        while( *rps && isspace(*rps) ) rps++;
+        char *rpe = rps;
+        while( *rpe && !isspace(*rpe) ) rpe++;
+        if( rpe == rps ) break;
+
+        string rs( rps, rpe - rps );
+        int ridx = _job->server_index( rs.c_str() );
+        // skip servers that are not available
+        if( ridx != -1 && ridx != _serveridx ) _replicas.push_back( ridx );
+        rps = rpe;
+    }
+
+    DEBUG("sidx %d size %lld files %d replicas %d", _serveridx, _totalsize, nfile, _replicas.size());
 
     //   file dancr/2014/03/25/02/2759_prod_DF3u.p9VrdtCRcN8_.gz
 
@@ -424,11 +571,12 @@ Job::plan_reduce(void){
     int nserv = _servers.size();
     int nstep = _g.section_size();
 
-    for(int i=1; i<nstep; i++){
+    for(int i=0; i<nstep; i++){
         Step *step = _plan[i];
-        int prevw  = _plan[i-1]->_tasks.size();
         int ntask;
 
+        if( step->_is_map ) continue;
+
         if( _g.section(i).phase() == "final" )
             ntask = 1;	// final
         else if( _g.section(i).has_width() )
@@ -441,10 +589,33 @@ Job::plan_reduce(void){
         step->_tasks.resize(ntask);
         step->_width = ntask;
 
+        // spread the tasks out, favoring servers with room + spare cpu
+        // and across datacenters, in proportion to where the input is
+        vector<int> planned( nserv, 0 );
+        vector<double> dcwant;
+        vector<int> dcgot( _datacenters.size(), 0 );
+        vector<int> only( nserv );
+        int ndc = reduce_dc_x( step, &dcwant );
+
         for(int j=0; j<ntask; j++){
             TaskToDo *t = new TaskToDo(this, i, j);
+            int s = -1;
+
             // assign a server
-            t->_serveridx = j % nserv;
+            if( ndc > 1 ){
+                // the datacenter furthest behind its share
+                int dc = 0;
+                for(int d=1; d<dcwant.size(); d++){
+                    if( dcwant[d] * ntask - dcgot[d] > dcwant[dc] * ntask - dcgot[dc] ) dc = d;
+                }
+                for(int k=0; k<nserv; k++) only[k] = (_servers[k]->_dc == dc) ? 0 : -1;
+                s = best_server_x( -1, &planned, &only );
+            }
+            if( s == -1 ) s = best_server_x( -1, &planned );
+            if( s == -1 ) s = j % nserv;
+            dcgot[ _servers[s]->_dc ] ++;
+            t->_serveridx = s;
+            planned[s] ++;
             step->_tasks[j] = t;
         }
     }
@@ -465,30 +636,14 @@ Job::plan_files(void){
     for(int i=0; i<nstep; i++){
         Step *step = _plan[i];
         int ntask  = step->_tasks.size();
-        int infile, outfile;
-
-        DEBUG("step %d", i);
-        if( i == 0 ){
-            // first (map) step
-            outfile = (nstep > 1) ? _plan[i+1]->_tasks.size() : 1;
-            infile  = 0;	// already figured
-
-        }else if( i == (nstep-1) ){
-            // last step
-            outfile = 1;
-            infile  = _plan[i-1]->_tasks.size();
-
-        }else{
-            outfile = (nstep > i+1) ? _plan[i+1]->_tasks.size() : 1;
-            infile  = _plan[i-1]->_tasks.size();
-        }
 
         for(int j=0; j<ntask; j++){
             TaskToDo *t = step->_tasks[j];
-            t->wire_files(i, infile, outfile);
+            t->wire_files();
         }
 
-        DEBUG("phase %s: tasks %d, files: %d out", step->_phase.c_str(), ntask, outfile);
+        DEBUG("phase %s: tasks %d, files: %d out", step->_phase.c_str(), ntask,
+              ntask ? step->_tasks[0]->_g.outfile_size() : 0);
     }
 
     _lock.w_unlock();
@@ -496,21 +651,42 @@ Job::plan_files(void){
 }
 
 int
-TaskToDo::wire_files(int stepno, int infiles, int outfiles){
+TaskToDo::wire_files(void){
     char buf[256];
+    Step *step = _job->_plan[ _stepno ];
+    const char *jobid = _g.jobid().c_str();
+
+    // outfiles: out_$step_$task_$dststep_$dsttask
+    // one group per consumer, one file per consumer task
+    for(int o=0; o<step->_outputs.size(); o++){
+        Step *dst  = _job->_plan[ step->_outputs[o] ];
+        int ndst   = dst->_tasks.size();
+        ACPMRMOutGroup *g = _g.add_outgroup();
+
+        g->set_nfile( ndst );
+        if( dst->_broadcast ) g->set_partition( "broadcast" );
+
+        for(int i=0; i<ndst; i++){
+            snprintf(buf, sizeof(buf), FILESPEC, jobid, _stepno, _taskno, dst->_stepno, i);
+            _g.add_outfile(buf);
+        }
+    }
 
-    // outfiles: out_$step_$task_*
-    for(int i=0; i<outfiles; i++){
-        // ...out_$step_$task_$out
-        snprintf(buf, sizeof(buf), FILESPEC, _g.jobid().c_str(), stepno, _taskno, i);
+    // nothing consumes the output of the final steps
+    if( step->_outputs.empty() ){
+        snprintf(buf, sizeof(buf), FILESPEC, jobid, _stepno, _taskno, _stepno, 0);
         _g.add_outfile(buf);
     }
 
-    // infiles (map already has infiles): out_$prevstep_*_$task
-    if( !_g.infile_size() ){
-        for(int i=0; i<infiles; i++){
-            snprintf(buf, sizeof(buf), FILESPEC, _g.jobid().c_str(), stepno-1, i, _taskno);
-            _g.add_infile(buf);
+    // infiles (map already has infiles): out_$instep_*_$step_$task
+    if( !step->_is_map ){
+        for(int s=0; s<step->_inputs.size(); s++){
+            Step *src = _job->_plan[ step->_inputs[s] ];
+
+            for(int i=0; i<src->_tasks.size(); i++){
+                snprintf(buf, sizeof(buf), FILESPEC, jobid, src->_stepno, i, _stepno, _taskno);
+                _g.add_infile(buf);
+            }
         }
     }
 
@@ -521,24 +697,18 @@ TaskToDo::wire_files(int stepno, int infiles, int outfiles){
 
 int
 TaskToDo::replace(){
+    int besti;
 
     // pick the best server
-    int nserv = _job->_servers.size();
-    int bestm=-1, besti=0;
-
-    for(int i=0; i<nserv; i++){
-        Server *s = _job->_servers[i];
-        int m = s->_n_task_running * 1000 + s->_n_fails * 500 + s->_n_xfer_running * 100
-            + peerdb->current_load(s->name.c_str())
-            + s->_n_task_redo * 1000;
-
-        if( (bestm == -1) || (m < bestm) ){
-            besti = i;
-            bestm = m;
-        }
+    if( _job->_plan[ _stepno ]->_is_map ){
+        // maps can only run where the files are
+        besti = _job->best_replica_x( &_replicas, _serveridx );
+    }else{
+        besti = _job->best_server_x( _serveridx, 0 );
     }
+    if( besti == -1 ) return 0;
 
-    replace( besti );
+    return replace( besti );
 }
 
 // replace a failed or slow task with one on another server
@@ -549,41 +719,71 @@ TaskToDo::replace(int newsrvr){
     if( _replaces   ) return 0;
 
     // mostly, it looks like the task it is replacing
-    TaskToDo *nt = new TaskToDo( _job, _job->_stepno, _taskno );
+    Step *step   = _job->_plan[ _stepno ];
+    TaskToDo *nt = new TaskToDo( _job, _stepno, _taskno );
     _replacedby    = nt;
     nt->_replaces  = this;
     nt->_serveridx = newsrvr;
     nt->_g.set_priority( _g.priority() );
 
-    nt->wire_files(_job->_stepno, _g.infile_size(), _g.outfile_size());
+    nt->wire_files();
+    if( _g.has_stdoutfile() ) nt->_g.set_stdoutfile( _g.stdoutfile() );
+
+    // a map reads the same files, the new server has its own copies
+    if( step->_is_map ){
+        for(int i=0; i<_g.infile_size(); i++) nt->_g.add_infile( _g.infile(i) );
+        nt->_totalsize = _totalsize;
+        nt->_replicas  = _replicas;
+        nt->_replicas.push_back( _serveridx );
+    }
 
     // create xfers for input files
-    int nserv = _job->_servers.size();
-    int ninf  = _g.infile_size();
+    int ninf   = 0;
 
     _job->inform2("replacing task %s -> %s, new server %s",
             _xid.c_str(), nt->_xid.c_str(), _job->_servers[newsrvr]->name.c_str());
 
     // we need to find the input files and get them to the new server
-    Step *prevstep = _job->_plan[ _job->_stepno - 1];
-    for(int i=0; i<ninf; i++){
-        // file i "out_step_$i_server" came from previous step task#i
-        // (the other copy is on the down server)
-        int src = prevstep->_tasks[i]->_serveridx;
-
-        // if the file originated on the down server, use the backup copy
-        if( _serveridx == src ) src = (src+1) % nserv;
-
-        XferToDo *x = new XferToDo(_job, &_g.infile(i), src, newsrvr);
-        DEBUG("  + xfer %d -> %d; %s %s", src, newsrvr, _g.infile(i).c_str(), _job->_servers[src]->name.c_str());
-        _job->_pending.push_back(x);
-        _job->_xfers.push_back(x);
-
-        // we cannot start the task until the files are xfered
-        nt->_prerequisite.push_back(x);
-
-        // create deletes for these extra files now
-        _job->add_delete_x(&_g.infile(i), newsrvr);
+    // (same order as wire_files)
+    for(int s=0; s<step->_inputs.size(); s++){
+        Step *prevstep = _job->_plan[ step->_inputs[s] ];
+
+        for(int i=0; i<prevstep->_tasks.size(); i++, ninf++){
+            const string *file = & _g.infile(ninf);
+
+            // file "out_$instep_$i_$step_$task" came from input step task#i
+            // (the other copy is on the down server)
+            TaskToDo *pt = prevstep->_tasks[i];
+            int src = (pt->_outserver != -1) ? pt->_outserver : pt->_serveridx;
+            int alt = (ninf < _inbackup.size()) ? _inbackup[ninf] : -1;
+
+            // if the file originated on the down server, use the backup copy
+            if( _serveridx == src ){
+                src = infile_backup(ninf);
+                alt = -1;
+            }
+
+            // if there are two copies, fetch the nearer one, fall back to the other
+            if( alt == src || alt == newsrvr ) alt = -1;
+            if( alt != -1 && _job->distance_x(alt, newsrvr) < _job->distance_x(src, newsrvr) ){
+                int tmp = src;
+                src = alt;
+                alt = tmp;
+            }
+
+            XferToDo *x = new XferToDo(_job, _stepno, file, src, newsrvr);
+            x->_consumer = nt;
+            if( alt != -1 ) x->add_source( alt );
+            DEBUG("  + xfer %d -> %d; %s %s", src, newsrvr, file->c_str(), _job->_servers[src]->name.c_str());
+            _job->_pending.push_back(x);
+            _job->_xfers.push_back(x);
+
+            // we cannot start the task until the files are xfered
+            nt->_prerequisite.push_back(x);
+
+            // create deletes for these extra files now
+            x->_dele = _job->add_delete_x(file, newsrvr, _stepno);
+        }
     }
 
     _job->_servers[newsrvr]->_n_task_redo ++;
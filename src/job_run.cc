@@ -25,15 +25,19 @@
 #include <unistd.h>
 
 #include <sstream>
+#include <algorithm>
 using std::ostringstream;
 
+#define SPECBUDGET		10		// max % of servers running speculative tasks
+#define SPECMINTIME		30		// seconds, before we consider speculating
+#define SPECSLOWFACTOR		1.5		// and taking this much longer than normal
+
 
 
 Job::Job(){
     _state           = JOB_STATE_QUEUED;
     _created         = lr_now();
     _want_abort      = 0;
-    _stepno          = 0;
     _n_xfer_running  = 0;
     _n_task_running  = 0;
     _n_deleted       = 0;
@@ -45,6 +49,12 @@ Job::Job(){
     _task_run_time   = 0;
     _totalmapsize    = 0;
     _n_fails         = 0;
+    _cache_hit       = 0;
+    _shareweight     = SHARE_DEFAULT;
+    _dele_ready      = 0;
+    _dele_running    = 0;
+    _disk_used       = 0;
+    _disk_peak       = 0;
 
 }
 
@@ -64,20 +74,24 @@ Job::run(void){
 
     do {
         if( ! plan() )       break;
+        if( cache_lookup() ) break;
         if( ! start_step() ) break;
 
         DEBUG("state %d", _state );
 
         while( _state == JOB_STATE_RUNNING && !_want_abort ){
+            update_servers();
             try_to_do_something(1);
             check_timeouts();
             maybe_specexec();
+            do_step_deletes();
             log_progress(0);
             sleep(5);
         }
     } while(0);
 
     cleanup();
+    if( _state == JOB_STATE_FINISHED && !_want_abort ) cache_save();
     _run_time = lr_now() - _run_start;
     log_progress(1);
     report_final_stats();
@@ -112,7 +126,7 @@ ToDo::update(const string *status, int progress, int amount){
 }
 
 int
-Job::update(const string *xid, const string *status, int progress, int amount){
+Job::update(const string *xid, const string *status, int progress, int amount, const ACPMRMActionStatus *g){
 
     _lock.w_lock();
 
@@ -121,6 +135,8 @@ Job::update(const string *xid, const string *status, int progress, int amount){
     int done = 0;
 
     if( t ){
+        if( g && g->outsize_size() ) t->outsize(g);
+        if( g && (g->has_cpu_usec() || g->has_mem_peak()) ) t->usage(g);
         done = t->update(status, progress, amount);
     }
     _lock.w_unlock();
@@ -131,6 +147,25 @@ Job::update(const string *xid, const string *status, int progress, int amount){
     return 1;
 }
 
+// several statuses for this job, under one lock
+void
+Job::update(const ACPMRMActionStatusBatch *b, const vector<int> *which){
+    int done = 0;
+
+    _lock.w_lock();
+
+    for(int i=0; i<which->size(); i++){
+        const ACPMRMActionStatus *g = & b->status( (*which)[i] );
+        ToDo *t = find_todo_x( & g->xid() );
+
+        if( t ) done |= t->update( & g->phase(), g->progress(), g->final_amount() );
+    }
+    _lock.w_unlock();
+
+    if( done )
+        try_to_do_something(0);
+}
+
 void
 ToDo::pend(void){
     _job->_pending.push_back( this );
@@ -138,18 +173,14 @@ ToDo::pend(void){
 }
 
 int
-Job::start_step_x(void){
+Job::start_step_x(int stepno){
 
-    Step *step = _plan[ _stepno ];
+    Step *step = _plan[ stepno ];
     int ntask  = step->_tasks.size();
 
     // stats
     step->_run_start = lr_now();
-
-    if( _stepno ){
-        Step * p = _plan[ _stepno - 1];
-        p->_run_time = lr_now() - p->_run_start;
-    }
+    step->_state     = JOB_STEP_STATE_RUNNING;
 
     // move tasks from plan -> pending
 
@@ -157,7 +188,7 @@ Job::start_step_x(void){
         step->_tasks[i]->pend();
     }
 
-    inform("starting phase %s", _plan[_stepno]->_phase.c_str());
+    inform("starting phase %s", step->_phase.c_str());
 
     return 1;
 }
@@ -166,25 +197,64 @@ int
 Job::start_step(void){
 
     _lock.w_lock();
-    int s = start_step_x();
+    int s = update_steps_x();
     _lock.w_unlock();
 
     return s;
 }
 
+// finish steps with nothing left to do, start steps whose inputs are ready
 int
-Job::next_step_x(void){
+Job::update_steps_x(void){
+    int nstep = _plan.size();
+    int ndone = 0;
+    vector<int> active( nstep, 0 );
+
+    for(list<ToDo*>::iterator it=_running.begin(); it != _running.end(); it++)
+        active[ (*it)->_stepno ] ++;
+    for(list<ToDo*>::iterator it=_pending.begin(); it != _pending.end(); it++)
+        active[ (*it)->_stepno ] ++;
+
+    for(int i=0; i<nstep; i++){
+        Step *step = _plan[i];
+
+        if( step->_state == JOB_STEP_STATE_RUNNING && !active[i] ){
+            step->_state    = JOB_STEP_STATE_FINISHED;
+            step->_run_time = lr_now() - step->_run_start;
+            _dele_ready     = 1;
+            inform("finished phase %s", step->_phase.c_str());
+        }
+    }
 
-    _stepno ++;
+    // steps are numbered in dependency order, one pass will do
+    for(int i=0; i<nstep; i++){
+        Step *step = _plan[i];
 
-    if( _stepno >= _plan.size() ){
+        if( step->_state == JOB_STEP_STATE_WAITING ){
+            bool ready = 1;
+
+            for(int j=0; j<step->_inputs.size(); j++){
+                if( _plan[ step->_inputs[j] ]->_state != JOB_STEP_STATE_FINISHED ) ready = 0;
+            }
+            if( ready ) start_step_x(i);
+        }
+
+        // an empty step finishes immediately
+        if( step->_state == JOB_STEP_STATE_RUNNING && step->_tasks.empty() ){
+            step->_state = JOB_STEP_STATE_FINISHED;
+        }
+
+        if( step->_state == JOB_STEP_STATE_FINISHED ) ndone ++;
+    }
+
+    if( ndone == nstep ){
         // finished
         DEBUG("job finished");
         _state = JOB_STATE_FINISHED;
         return 0;
     }
 
-    return start_step_x();
+    return 1;
 }
 
 int
@@ -210,12 +280,11 @@ Job::try_to_do_something(bool try_harder){
         if( _lock.w_trylock() ) return 0;
     }
 
-    // nothing running, nothing pending => next phase
-    if( _running.empty() && _pending.empty() )
-        if( ! next_step_x() ){
-            _lock.w_unlock();
-            return 0;		// finished
-        }
+    // steps with nothing running, nothing pending => next phase(s)
+    if( ! update_steps_x() ){
+        _lock.w_unlock();
+        return 0;		// finished
+    }
     _lock.w_unlock();
 
     // RSN - check load ave
@@ -234,12 +303,19 @@ Job::try_to_do_something(bool try_harder){
     return 1;
 }
 
+static bool
+more_urgent(const ToDo *a, const ToDo *b){
+    return a->urgency() < b->urgency();
+}
+
 int
 Job::maybe_start_something_x(void){
     int started = 0;
 
     // start modifies _pending, create a tmp list to iterate
+    // the xfers that will soonest let a task start go first (stable, otherwise in order)
     list<ToDo*> tlist = _pending;
+    tlist.sort( more_urgent );
 
     for(list<ToDo*>::iterator it=tlist.begin(); it != tlist.end(); it++){
         ToDo *t = *it;
@@ -264,50 +340,154 @@ Job::check_timeouts(void){
 
     for(list<ToDo*>::iterator it=tlist.begin(); it != tlist.end(); it++){
         ToDo *t = *it;
-        if( t->_last_status + TODOTIMEOUT < now ) t->timedout();
+        if( t->_last_status + TODOTIMEOUT >= now ) continue;
+
+        // a busy server may be slow to tell us anything. don't replace
+        // its tasks unless it really looks down.
+        if( t->_last_status + TODOTIMEOUT * TODOSLOWFACTOR >= now ){
+            float phi = peerdb->suspicion( _servers[t->_serveridx]->name.c_str() );
+            if( phi >= PHI_SUSPECT && phi < PHI_DOWN ) continue;
+        }
+
+        t->timedout();
     }
 
     _lock.w_unlock();
     return 1;
 }
 
+// speculatively start alternates for stragglers. maybe they will finish sooner.
+// stragglers are found by comparing their progress with tasks that have finished.
+// the number of alternates running (all jobs, all masters) is limited
+
+static int spec_running = 0;
+
+// for status gossip, so other masters count ours
+int
+job_spec_running(void){
+    return spec_running;
+}
+
+void
+TaskToDo::spec_done(void){
+
+    if( !_speculative ) return;
+    _speculative = 0;
+    ATOMIC_ADD32(spec_running, -1);
+}
+
 int
 Job::maybe_specexec(void){
+    int n = 0;
 
     if( !_plan.size() ) return 0; // empty job
-    if( !_stepno )      return 0; // we don't replace map tasks
 
-    _lock.r_lock();
+    _lock.w_lock();
+
+    int budget = _servers.size() * SPECBUDGET / 100;
+    if( budget < 1 ) budget = 1;
+    budget -= spec_running + peerdb->spec_running();
+
+    for(int i=0; i<_plan.size() && budget > 0; i++){
+        n += maybe_specexec_x( _plan[i], &budget );
+    }
+
+    _lock.w_unlock();
+
+    return n;
+}
+
+// how long should a task take? maps are scaled by their input size (MB)
+double
+TaskToDo::spec_size(void) const {
+
+    if( _job->_plan[ _stepno ]->_is_map && _totalsize > 0 ) return _totalsize / 1000000.0;
+    return 1;
+}
 
-    int ntask = _plan[ _stepno ]->_width;
+int
+Job::maybe_specexec_x(Step *step, int *budget){
+    hrtime_t now = lr_now();
+    int ntask = step->_tasks.size();
     int nserv = _servers.size();
 
-    int l = 1;
+    if( step->_state != JOB_STEP_STATE_RUNNING ) return 0;
 
     // not worthwhile
-    if( ntask < 5 ) l = 0;
-    if( nserv < 5 ) l = 0;
+    if( ntask < 2 ) return 0;
+    if( nserv < 2 ) return 0;
 
     // too soon
-    if( _plan[_stepno]->_run_start > lr_now() - 30 ) l = 0;
+    if( step->_run_start > now - SPECMINTIME ) return 0;
 
-    // wait until most finish
-    if( _n_task_running >= ntask / 20 ) l = 0;
+    // what do the finished tasks look like?
+    vector<double> secs, outs;
 
-    _lock.r_unlock();
+    for(int i=0; i<ntask; i++){
+        TaskToDo *t = step->_tasks[i];
+        if( t->_replacedby && t->_replacedby->_state == JOB_TODO_STATE_FINISHED ) t = t->_replacedby;
+        if( t->_state != JOB_TODO_STATE_FINISHED || !t->_run_time ) continue;
+        if( t->_status != "FINISHED" ) continue;
+
+        double sz = t->spec_size();
+        secs.push_back( t->_run_time / sz );
+        outs.push_back( t->_progress / sz );
+    }
 
-    if( !l ) return 0;
+    // wait until enough finish to know what normal is
+    if( secs.size() < ntask / 4 || secs.empty() ) return 0;
 
-    _lock.w_lock();
+    std::sort( secs.begin(), secs.end() );
+    std::sort( outs.begin(), outs.end() );
+    double medsecs = secs[ secs.size() / 2 ];	// per MB (map) or per task
+    double medouts = outs[ outs.size() / 2 ];	// KB output per MB, or per task
 
-    for(list<ToDo*>::iterator it = _running.begin(); it != _running.end(); it++){
-        ToDo *t = *it;
-        // speculatively start some alternate tasks. maybe they will finish sooner.
-        t->maybe_replace(0);
+    // find stragglers
+    list< std::pair<int,TaskToDo*> > slow;
+
+    for(int i=0; i<ntask; i++){
+        TaskToDo *t = step->_tasks[i];
+
+        if( t->_state != JOB_TODO_STATE_RUNNING ) continue;
+        if( t->_replacedby || t->_replaces ) continue;
+
+        double sz   = t->spec_size();
+        double exp  = medsecs * sz;		// expected run time
+        int elapsed = now - t->_run_start;
+
+        if( elapsed < exp * SPECSLOWFACTOR || elapsed < SPECMINTIME ) continue;
+
+        // estimate time remaining from progress (if any)
+        double remain = elapsed;
+        if( medouts > 0 && t->_progress > 0 ){
+            double frac = t->_progress / (medouts * sz);
+            if( frac > .99 ) frac = .99;
+            remain = elapsed * (1 - frac) / frac;
+        }
+
+        // would an alternate finish sooner?
+        if( remain < exp ) continue;
+
+        slow.push_back( std::make_pair( -(int)remain, t ) );
     }
 
-    _lock.w_unlock();
+    if( slow.empty() ) return 0;
 
-    return 1;
-}
+    // slowest first
+    slow.sort();
+    int n = 0;
+
+    for(list< std::pair<int,TaskToDo*> >::iterator it=slow.begin(); it != slow.end() && *budget > 0; it++){
+        TaskToDo *t = it->second;
 
+        inform2("task %s is slow, speculating", t->_xid.c_str());
+        if( ! t->replace() ) continue;
+
+        t->_replacedby->_speculative = 1;
+        ATOMIC_ADD32(spec_running, 1);
+        (*budget) --;
+        n ++;
+    }
+
+    return n;
+}
@@ -0,0 +1,305 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Aug-11 10:48 (EDT)
+  Function: send job programs once, not with every task
+
+*/
+
+#define CURRENT_SUBSYSTEM	't'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "network.h"
+#include "lock.h"
+#include "hrtime.h"
+#include "crypto.h"
+
+#include "mrmagoo.pb.h"
+#include "scrible.pb.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <utime.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <set>
+using std::set;
+
+
+#define SRCDIR		"mrtmp/src"
+#define SRCINLINEMAX	16384			// smaller programs still go with each task
+#define SRCMAXSIZE	(256 * 1024 * 1024)
+#define SRCKEEP		(3 * 24 * 3600)		// remove programs unused this long
+#define TIMEOUT		15
+
+
+// a job's program (plus its init data) can be large, and it went with
+// every task, every retry, every replacement. instead, the master saves
+// it, by content:
+//   mrtmp/src/$sha1
+// and the task request carries only the hash. the worker gets it from
+// the master (a plain scriblr get), once, and keeps it for the job's
+// other tasks (and the next job running the same program)
+// older servers do not understand this, it is off unless configured (srcbyhash)
+
+static Mutex   src_lock;
+static CondVar src_done;
+static set<string> src_fetching;		// programs being fetched now
+
+
+static void
+src_hash(const string *src, string *hash){
+    HashSHA1 h;
+    char buf[20];
+    char hex[48];
+
+    h.update( src->data(), src->size() );
+    h.digest( buf, sizeof(buf) );
+
+    for(int i=0; i<sizeof(buf); i++){
+        snprintf(hex + 2*i, 3, "%02x", (unsigned char)buf[i]);
+    }
+    hash->assign( hex );
+}
+
+static void
+src_file(const string *hash, string *file){
+
+    file->assign( config->basedir );
+    file->append( "/" SRCDIR "/" );
+    file->append( *hash );
+}
+
+// read + verify a saved program. it is in use, keep it
+static int
+src_load(const string *hash, string *src){
+    struct stat st;
+    string file, h;
+
+    src_file(hash, &file);
+    int fd = open( file.c_str(), O_RDONLY );
+    if( fd < 0 ) return 0;
+
+    if( fstat(fd, &st) || st.st_size > SRCMAXSIZE ){
+        close(fd);
+        return 0;
+    }
+
+    src->resize( st.st_size );
+    int r = st.st_size ? read_to(fd, &(*src)[0], st.st_size, TIMEOUT) : 0;
+    close(fd);
+    if( r != st.st_size ) return 0;
+
+    src_hash(src, &h);
+    if( h.compare(*hash) ){
+        VERBOSE("corrupt program %s", file.c_str());
+        unlink( file.c_str() );
+        return 0;
+    }
+
+    utime( file.c_str(), 0 );
+    return 1;
+}
+
+static int
+src_store(const string *hash, const string *src){
+    string file, tmp;
+
+    src_file(hash, &file);
+    // others may be saving the same program
+    unique( &tmp );
+    tmp.insert( 0, "." );
+    tmp.insert( 0, file );
+    tmp.append( ".tmp" );
+
+    string dir = config->basedir;
+    dir.append( "/" SRCDIR );
+    mkdirp( dir.c_str(), 0777 );
+
+    int fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    if( fd < 0 ){
+        PROBLEM("cannot save program %s: %s", tmp.c_str(), strerror(errno));
+        return 0;
+    }
+
+    int w = write_to(fd, src->data(), src->size(), TIMEOUT);
+    close(fd);
+
+    if( w != src->size() ){
+        unlink( tmp.c_str() );
+        return 0;
+    }
+
+    rename( tmp.c_str(), file.c_str() );
+    return 1;
+}
+
+// master: send the hash instead? 0 => send the program
+int
+jobsrc_save(const string *src, string *hash){
+
+    if( !config->src_by_hash || src->size() <= SRCINLINEMAX ) return 0;
+
+    src_hash(src, hash);
+
+    src_lock.lock();
+    string file;
+    struct stat st;
+    src_file(hash, &file);
+
+    int ok = 1;
+    if( stat(file.c_str(), &st) || st.st_size != src->size() )
+        ok = src_store(hash, src);
+    else
+        utime( file.c_str(), 0 );
+    src_lock.unlock();
+
+    if( !ok ) hash->clear();
+    return ok;
+}
+
+// master: a worker fetched this program. it is in use, keep it
+void
+jobsrc_served(const string *filename){
+
+    if( filename->compare(0, sizeof(SRCDIR), SRCDIR "/") ) return;
+
+    string file = config->basedir;
+    file.append( "/" );
+    file.append( *filename );
+    utime( file.c_str(), 0 );
+}
+
+// from the master
+static int
+src_fetch(const string *master, const string *hash, string *src){
+    NTD ntd;
+    protocol_header *phi = (protocol_header*) ntd.gpbuf_in;
+    ACPScriblRequest req;
+    ACPScriblReply   res;
+    NetAddr na;
+    string h;
+
+    if( !parse_addr( master->c_str(), &na ) ) return 0;
+
+    string name = SRCDIR "/";
+    name.append( *hash );
+    req.set_filename( name.c_str() );
+
+    int fd = tcp_connect( &na, TIMEOUT );
+    if( fd < 0 ){
+        VERBOSE("cannot fetch program from %s", master->c_str());
+        return 0;
+    }
+    ntd.fd = fd;
+
+    int s = write_request(&ntd, PHMT_SCRIB_GET, &req, 0, TIMEOUT);
+    if( s > 0 ) s = read_proto(&ntd, 0, TIMEOUT);
+    if( s < 1 ){
+        VERBOSE("cannot fetch program from %s", master->c_str());
+        close(fd);
+        return 0;
+    }
+
+    res.ParsePartialFromArray( ntd.in_data(), phi->data_length );
+    DEBUG("l=%d, %s", phi->data_length, res.ShortDebugString().c_str());
+
+    int size = phi->content_length;
+    if( res.status_code() != 200 || size > SRCMAXSIZE ){
+        VERBOSE("cannot fetch program %s: %s", hash->c_str(), res.status_message().c_str());
+        close(fd);
+        return 0;
+    }
+
+    src->resize( size );
+    int r = size ? read_to(fd, &(*src)[0], size, TIMEOUT) : 0;
+    close(fd);
+
+    src_hash(src, &h);
+    if( r != size || h.compare(*hash) ){
+        VERBOSE("fetch program %s failed", hash->c_str());
+        return 0;
+    }
+
+    return 1;
+}
+
+// worker: fill in the task's program. 0 => failed
+int
+jobsrc_fetch(ACPMRMTaskCreate *g){
+    string src;
+
+    if( ! g->has_jobsrc_hash() || g->jobsrc().size() ) return 1;
+
+    const string *hash = & g->jobsrc_hash();
+
+    // usually, it is here already
+    if( src_load(hash, &src) ){
+        g->set_jobsrc( src );
+        return 1;
+    }
+
+    // fetch each program once, the job's other tasks wait, and find it here
+    // (the fetch can be slow, other programs should not wait for it)
+    src_lock.lock();
+    while( src_fetching.find(*hash) != src_fetching.end() )
+        src_done.wait( &src_lock );
+    src_fetching.insert( *hash );
+    src_lock.unlock();
+
+    int ok = src_load(hash, &src);
+
+    if( !ok ){
+        ok = src_fetch( & g->master(), hash, &src );
+        if( ok ) src_store(hash, &src);
+    }
+
+    src_lock.lock();
+    src_fetching.erase( *hash );
+    src_done.broadcast();
+    src_lock.unlock();
+
+    if( ok ) g->set_jobsrc( src );
+    return ok;
+}
+
+// remove programs no one has used lately
+void
+jobsrc_expire(void){
+    struct stat st;
+
+    string base = config->basedir;
+    base.append( "/" SRCDIR );
+
+    DIR *d = opendir( base.c_str() );
+    if( !d ) return;
+
+    hrtime_t old = lr_now() - SRCKEEP;
+    struct dirent *de;
+
+    src_lock.lock();
+    while( (de = readdir(d)) ){
+        if( de->d_name[0] == '.' ) continue;
+
+        string file = base;
+        file.append( "/" );
+        file.append( de->d_name );
+
+        if( stat(file.c_str(), &st) == -1 ) continue;
+        if( st.st_mtime >= old ) continue;
+
+        DEBUG("expiring program %s", file.c_str());
+        unlink( file.c_str() );
+    }
+    src_lock.unlock();
+    closedir(d);
+}
@@ -94,8 +94,8 @@ kibitz_with_random_peer(void *notused){
 
     // connect
     // build request
-    // send request (with info about myself)
-    // recv reply (info on all all peers)
+    // send request (with info about myself, + what we already know)
+    // recv reply (info on peers we don't know, or know less about)
     // process (ignore info about self)
 
     int fd = tcp_connect(peer, TIMEOUT);
@@ -108,6 +108,7 @@ kibitz_with_random_peer(void *notused){
     DEBUG("connected");
 
     about_myself( req.mutable_myself() );
+    peerdb->digest( &req );
 
     ntd.fd = fd;
 
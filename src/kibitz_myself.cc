@@ -23,6 +23,7 @@
 #include <arpa/inet.h>
 #include <sys/resource.h>
 #include <sys/statvfs.h>
+#include <sys/stat.h>
 #include <sys/loadavg.h>
 
 #include "std_ipport.pb.h"
@@ -32,6 +33,9 @@
 
 #define BOOTTIME	60
 
+extern void task_share_status(ACPMRMStatus *);
+extern int  job_spec_running(void);
+extern void capacity_status(ACPMRMStatus *);
 
 static hrtime_t starttime = 0;
 static char pinhost[256];
@@ -71,10 +75,12 @@ about_myself(ACPMRMStatus *g){
     hrtime_t now = lr_now();
     ACPIPPort *ip;
     struct statvfs vfs;
+    struct stat st;
 
     g->set_hostname( myhostname );
     g->set_server_id( myserver_id.c_str() );
     g->set_datacenter( mydatacenter.c_str() );
+    if( !myrack.empty() ) g->set_rack( myrack.c_str() );
     g->set_environment( config->environment.c_str() );
     g->set_subsystem( MYNAME );
     g->set_via( myserver_id.c_str() );
@@ -90,12 +96,23 @@ about_myself(ACPMRMStatus *g){
 
     g->set_sort_metric( current_load() );
     g->set_cpu_metric( config->hw_cpus );
+    task_share_status( g );
+    capacity_status( g );
+    if( job_spec_running() ) g->set_spec_running( job_spec_running() );
 
     // determine disk space
     if( ! statvfs( config->basedir.c_str(), &vfs ) ){
         g->set_capacity_metric( vfs.f_bavail / 2048 );	// MB avail
     }
 
+    // where the files are, so another server on this host can find them
+    if( ! stat( config->basedir.c_str(), &st ) ){
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%lld %lld", (long long)st.st_dev, (long long)st.st_ino);
+        g->set_basedir( config->basedir.c_str() );
+        g->set_basedir_id( buf );
+    }
+
     // ip info
     ip = g->add_ip();
     ip->set_ipv4( ntohl(myipv4) );
@@ -23,14 +23,15 @@
 
 #define TIMEOUT 30
 
-// request => client's own status
-// reply   => list of all known peers
+// request => client's own status + digest of what it knows
+// reply   => known peers, that it doesn't know about
 
 int
 mr_status(struct NTD *ntd){
     protocol_header *phi = (protocol_header*) ntd->gpbuf_in;
     ACPMRMStatusRequest req;
-    ACPMRMStatusReply   res;
+    ACPMRMStatus        me;
+    string              res;
 
 
     // parse request
@@ -51,18 +52,18 @@ mr_status(struct NTD *ntd){
 
     if( !(phi->flags & PHFLAG_WANTREPLY) ) return 0;
 
-    // build reply - add everyone's statuses
-    peerdb->reply_peers( &res );
-    ACPMRMStatus *s = res.add_status();
-    about_myself(s);
+    // build reply - add peers' statuses (already serialized), and mine
+    about_myself( &me );
 
-    if( !res.IsInitialized() ){
-        BUG("incomplete status message: %s", res.InitializationErrorString().c_str() );
+    if( !me.IsInitialized() ){
+        BUG("incomplete status message: %s", me.InitializationErrorString().c_str() );
         return 0;
     }
 
-    // serialize + reply
-    write_reply(ntd, &res, 0, TIMEOUT);
+    peerdb->reply_peers( &req, &res );
+    wire_status( &res, &me );
+
+    write_reply_data(ntd, &res, 0, TIMEOUT);
 
     // nothing else to send
     return 0;
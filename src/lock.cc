@@ -12,6 +12,8 @@
 #include "thread.h"
 #include "lock.h"
 
+#include <time.h>
+
 
 class Mutex_Attr {
 public:
@@ -144,3 +146,37 @@ RWLock::w_trylock(void){
     return pthread_rwlock_trywrlock( &_rwlock );
 }
 
+//################################################################
+
+CondVar::CondVar(){
+    pthread_cond_init( &_cond, 0 );
+}
+
+CondVar::~CondVar(){
+    pthread_cond_destroy( &_cond );
+}
+
+void
+CondVar::wait(Mutex *m){
+    pthread_cond_wait( &_cond, &m->_mutex );
+}
+
+// wait at most sec seconds
+int
+CondVar::timedwait(Mutex *m, int sec){
+    struct timespec ts;
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    ts.tv_sec += sec;
+    return pthread_cond_timedwait( &_cond, &m->_mutex, &ts );
+}
+
+void
+CondVar::signal(void){
+    pthread_cond_signal( &_cond );
+}
+
+void
+CondVar::broadcast(void){
+    pthread_cond_broadcast( &_cond );
+}
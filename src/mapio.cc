@@ -14,6 +14,7 @@
 #include "misc.h"
 #include "network.h"
 #include "mapio.h"
+#include "push.h"
 
 #include "mrmagoo.pb.h"
 
@@ -31,12 +32,14 @@
 #define INITIALSIZE		(2*READSIZE)	// initially allocate a buffer this big
 #define OUTBUFSIZE		16384		// output buffer size
 #define OUTBLKSIZE		8192		// try to write in multiples of this size
+#define PUSHBLKSIZE		(256 * 1024)	// compress + push this much at a time
 
 
 BufferedInput::BufferedInput(int fd){
 
     _fd     = fd;
     _curpos = 0;
+    _nread  = 0;
     _buf    = (char*)malloc(INITIALSIZE);
     _bufsiz = INITIALSIZE;
 
@@ -48,7 +51,7 @@ BufferedInput::~BufferedInput(){
 }
 
 void
-BufferedInput::read(MapOutSet *out){
+BufferedInput::read(RecordSink *out){
 
     // do we have enough space?
     if( _curpos + READSIZE > _bufsiz ){
@@ -62,6 +65,7 @@ BufferedInput::read(MapOutSet *out){
     int r = ::read(_fd, _buf + _curpos, READSIZE);
     //DEBUG("read -> %d", r);
     if( r < 1 ) return;
+    _nread += r;
 
     // process all records (\n terminated)
     int recstart  = 0;
@@ -108,8 +112,9 @@ BufferedInput::read(MapOutSet *out){
 
 MapOutSet::MapOutSet(const ACPMRMTaskCreate *g){
 
-    _nfile = g->outfile_size();
-    _file.reserve( _nfile );
+    _nfile  = g->outfile_size();
+    _file.resize( _nfile );
+    _pusher = g->pushto_size() ? new MapPusher(g) : 0;
 
     // set up outputs
     for(int i=0; i<_nfile; i++){
@@ -120,7 +125,33 @@ MapOutSet::MapOutSet(const ACPMRMTaskCreate *g){
         // perhaps not configurable.
 
         // _file[i] = new BufferedMapOutput( file->c_str() );
-        _file[i] = new CompressedMapOutput( file->c_str() );
+        if( _pusher && _pusher->wants(i) )
+            _file[i] = new PushMapOutput( file->c_str(), _pusher, i );
+        else
+            _file[i] = new CompressedMapOutput( file->c_str() );
+    }
+
+    // groups. if none are specified, there is just one
+    int start = 0;
+    for(int i=0; i<g->outgroup_size(); i++){
+        const ACPMRMOutGroup *og = & g->outgroup(i);
+        MapOutGroup grp;
+
+        grp._start     = start;
+        grp._nfile     = og->nfile();
+        grp._broadcast = ! og->partition().compare("broadcast");
+
+        if( grp._start + grp._nfile > _nfile ) FATAL("invalid output groups");
+        _group.push_back( grp );
+        start += grp._nfile;
+    }
+
+    if( _group.empty() ){
+        MapOutGroup grp;
+        grp._start     = 0;
+        grp._nfile     = _nfile;
+        grp._broadcast = 0;
+        _group.push_back( grp );
     }
 }
 
@@ -130,12 +161,62 @@ MapOutSet::close(void){
     for(int i=0; i<_nfile; i++){
         _file[i]->close();
     }
+
+    if( _pusher ) _pusher->finish();
+}
+
+// did outfile i reach its consumer?
+bool
+MapOutSet::pushed(int i) const {
+    return _pusher && _pusher->pushed(i);
+}
+
+// skip over one json value: string, number, array, object. 0 => invalid
+static const char *
+_json_skip(const char *p, const char *end){
+    int depth = 0;
+
+    do {
+        if( p >= end ) return 0;
+
+        switch( *p ){
+        case '"':
+            for(p++; p < end && *p != '"'; p++){
+                if( *p == '\\' ) p++;
+            }
+            if( p >= end ) return 0;
+            p++;
+            break;
+        case '[':
+        case '{':
+            depth ++;
+            p++;
+            break;
+        case ']':
+        case '}':
+            if( !depth ) return 0;
+            depth --;
+            p++;
+            break;
+        default:
+            if( depth ){
+                p++;
+                break;
+            }
+            // number, true, ... read until , or space
+            while( p < end && *p != ',' && *p != ']' && *p != '}' && !isspace(*p) ) p++;
+            return p;
+        }
+    } while( depth );
+
+    return p;
 }
 
 // input: [ key, data ]
-// key: "string", number, RSN: [array of string, number]
+// key: "string", number, [array], {object}
 static int
 _findkey(const char *buf, int len){
+    const char *start = buf;
     int pos;
 
     if( *buf != '[' ){
@@ -165,10 +246,10 @@ _findkey(const char *buf, int len){
         return pos;
 
     case '[':
-    case '{':
-        // RSN ...
-        DEBUG("unsupported key type");
-        return 0;
+    case '{': {
+        const char *e = _json_skip(buf, buf + len);
+        return e ? e - start : 0;
+    }
     default:
         // number. read until , or space
         for(pos=1; pos<len && !isspace(*buf) && *buf != ','; pos++) buf++;
@@ -198,17 +279,65 @@ MapOutSet::output(const char *buf, int len){
     if( len == 1 )    return;	// drop empty record
 
     // only one output? short inpu? short circuit
-    if( _nfile == 1 || len < 4 ){
+    if( _nfile == 1 ){
         _file[0]->output(buf, len);
         return;
     }
 
-    // find the key + hash it
-    int keylen  = _findkey( buf, len );
-    int hashval = keylen > 0 ? _hashval( buf, keylen ) : 0;
+    // find the key + hash it (only once, even if several groups need it)
+    int hashval = -1;
+
+    for(int g=0; g<_group.size(); g++){
+        const MapOutGroup *grp = & _group[g];
+
+        if( grp->_broadcast ){
+            for(int i=0; i<grp->_nfile; i++){
+                _file[ grp->_start + i ]->output(buf, len);
+            }
+            continue;
+        }
+
+        if( grp->_nfile == 1 || len < 4 ){
+            _file[ grp->_start ]->output(buf, len);
+            continue;
+        }
 
-    hashval %= _nfile;
-    _file[ hashval ]->output(buf, len);
+        if( hashval == -1 ){
+            int keylen = _findkey( buf, len );
+            hashval = keylen > 0 ? _hashval( buf, keylen ) : 0;
+        }
+
+        _file[ grp->_start + hashval % grp->_nfile ]->output(buf, len);
+    }
+}
+
+// reduce input: [key,value]\n => key, value (json text)
+int
+split_record(const char *buf, int len, const char **key, int *keylen, const char **val, int *vallen){
+    const char *end = buf + len;
+
+    while( end > buf && isspace(end[-1]) ) end --;
+    if( end - buf < 2 || *buf != '[' || end[-1] != ']' ) return 0;
+    end --;
+
+    const char *p = buf + 1;
+    while( p < end && isspace(*p) ) p++;
+    const char *k = p;
+
+    p = _json_skip(p, end);
+    if( !p || p == k ) return 0;
+
+    *key    = k;
+    *keylen = p - k;
+
+    while( p < end && isspace(*p) ) p++;
+    if( p < end && *p == ',' ) p++;
+    while( p < end && isspace(*p) ) p++;
+    while( end > p && isspace(end[-1]) ) end --;
+
+    *val    = p;
+    *vallen = end - p;
+    return 1;
 }
 
 /****************************************************************/
@@ -236,6 +365,8 @@ void
 MapOutput::init(const char *file){
     if( !_validate(file) ) FATAL("invalid filename %s", file);
     _mkdirs(file);
+    // a new file, not truncating the old one - it may be linked elsewhere (see xfer.cc)
+    unlink(file);
 }
 
 // NB: stdio runs into trouble with > 255 FILE*s
@@ -312,3 +443,56 @@ CompressedMapOutput::output(const char *buf, int len){
     gzwrite( _gfd, buf, len );
 }
 
+/****************************************************************/
+
+PushMapOutput::PushMapOutput(const char *file, MapPusher *p, int idx){
+
+    init(file);
+    _pusher = p;
+    _idx    = idx;
+    _fd     = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    _buf.reserve( PUSHBLKSIZE );
+
+    if( _fd < 0 ) FATAL("cannot open file %s: %s", file, strerror(errno));
+}
+
+// compress the buffer as a complete gzip member, write it, push it
+void
+PushMapOutput::_flush(bool last){
+    z_stream z;
+    string out;
+
+    memset(&z, 0, sizeof(z));
+    // same as gzopen "wb"
+    if( deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+        FATAL("cannot compress");
+
+    out.resize( deflateBound(&z, _buf.size()) + 64 );
+    z.next_in   = (Bytef*)_buf.data();
+    z.avail_in  = _buf.size();
+    z.next_out  = (Bytef*)&out[0];
+    z.avail_out = out.size();
+
+    deflate(&z, Z_FINISH);
+    int len = out.size() - z.avail_out;
+    deflateEnd(&z);
+
+    write( _fd, out.data(), len );
+    _pusher->send( _idx, out.data(), len, last );
+    _buf.clear();
+}
+
+void
+PushMapOutput::output(const char *buf, int len){
+
+    _buf.append(buf, len);
+    if( _buf.size() >= PUSHBLKSIZE ) _flush(0);
+}
+
+void
+PushMapOutput::close(void){
+
+    // always at least one block, even if empty, so the file gets committed
+    _flush(1);
+    ::close(_fd);
+}
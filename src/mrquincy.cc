@@ -24,7 +24,10 @@
 
 int flag_foreground   = 0;
 int flag_debugall     = 0;
+int flag_task         = 0;
 char *filename_config = 0;
+char *filename_self   = 0;
+const char *task_cgroup = 0;
 RunMode runmode;
 
 void* runmode_manage(void*);
@@ -37,13 +40,15 @@ extern void xfer_init(void);
 extern void task_init(void);
 extern void job_init(void);
 extern void pipeline_init(void);
+extern void task_main(const char *);
 
 void
 usage(void){
     fprintf(stderr, "mrquincyd [options]\n"
 	    "  -f    foreground\n"
 	    "  -d    enable debugging\n"
-	    "  -c config file\n");
+	    "  -c config file\n"
+	    "  -T    run one task (internal)\n");
     exit(0);
 }
 
@@ -59,7 +64,7 @@ main(int argc, char **argv){
      srandom( time(0) );
 
      // parse command line
-     while( (c = getopt(argc, argv, "c:dfh")) != -1 ){
+     while( (c = getopt(argc, argv, "c:dfhTG:S:")) != -1 ){
 	 switch(c){
 	 case 'f':
 	     flag_foreground = 1;
@@ -74,6 +79,15 @@ main(int argc, char **argv){
 	 case 'h':
 	     usage();
 	     break;
+         case 'T':
+             flag_task = 1;
+             break;
+         case 'G':
+             task_cgroup = optarg;
+             break;
+         case 'S':
+             myserver_id = optarg;
+             break;
 	 }
      }
      argc -= optind;
@@ -84,9 +98,19 @@ main(int argc, char **argv){
          exit(-1);
      }
 
+     // tasks are started by running ourself
+     if( strchr(save_argv[0], '/') ) filename_self = realpath( save_argv[0], 0 );
+     if( !filename_self ) filename_self = save_argv[0];
+
      //	init logging
      diag_init();
 
+     // started by the daemon to run a task (see task.cc)
+     // the daemon's config comes with the request
+     if( flag_task ){
+         task_main( task_cgroup );
+     }
+
      // daemonize
      if( flag_foreground){
 	 daemon_siginit();
@@ -0,0 +1,257 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Jul-21 14:30 (EDT)
+  Function: run native plugins in the task process
+
+*/
+
+#define CURRENT_SUBSYSTEM	't'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "euconsole.h"
+#include "native.h"
+
+#include "mrmagoo.pb.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+
+#define COMBINEMAX	(16 * 1024 * 1024)	// combine map output when this much is waiting
+#define ELFMAGIC	"\177ELF"
+
+
+// instead of
+//   gzcat files | sort | prog
+// with prog reading + writing json on pipes, the task process runs
+//   gzcat files | sort
+// and hands each record to the plugin, and its output to the outfiles.
+// (see inc/plugin.h)
+
+// is this jobsrc a shared object?
+bool
+native_prog(const string *src){
+    return src->size() > 4 && !src->compare(0, 4, ELFMAGIC);
+}
+
+static void
+native_emit(struct mrq_emit *e, const char *key, int keylen, const char *val, int vallen){
+    ((NativeProg*)e->ctx)->emit(key, keylen, val, vallen);
+}
+
+static void
+native_print(struct mrq_emit *e, const char *buf, int len){
+    ((NativeProg*)e->ctx)->print(buf, len);
+}
+
+// iterate over buffered values
+struct VecIter {
+    struct mrq_iter	it;
+    const vector<string> *vals;
+    int			pos;
+};
+
+static int
+vec_next(struct mrq_iter *it, const char **val, int *vallen){
+    VecIter *vi = (VecIter*)it->ctx;
+
+    if( vi->pos >= vi->vals->size() ) return 0;
+
+    const string *v = & (*vi->vals)[ vi->pos ++ ];
+    *val    = v->data();
+    *vallen = v->size();
+    return 1;
+}
+
+static void
+vec_iter(VecIter *vi, const vector<string> *vals){
+    vi->it.ctx  = vi;
+    vi->it.next = vec_next;
+    vi->vals    = vals;
+    vi->pos     = 0;
+}
+
+/****************************************************************/
+
+NativeProg::NativeProg(const char *file, const ACPMRMTaskCreate *g, MapOutSet *out, EUConsole *eu, int savefd){
+
+    _out       = out;
+    _eu        = eu;
+    _savefd    = savefd;
+    _err       = 0;
+    _havekey   = 0;
+    _combining = 0;
+    _combsize  = 0;
+    _valsize   = 0;
+    _truncated = 0;
+    _is_map    = ! g->phase().compare("map");
+    _group_max     = g->group_max();
+    _group_maxsize = g->group_maxsize();
+
+    _emit.ctx   = this;
+    _emit.emit  = native_emit;
+    _emit.print = native_print;
+
+    // the user's code runs as nobody, just like the scripts (see pipeline.cc)
+    setregid(65535, 65535);
+    setreuid(65535, 65535);
+
+    _dl = dlopen( file, RTLD_NOW | RTLD_LOCAL );
+    if( !_dl ){
+        VERBOSE("cannot load plugin: %s", dlerror());
+        _exit(-1);
+    }
+
+    mrq_plugin_f pf = (mrq_plugin_f) dlsym( _dl, MRQ_PLUGIN_SYMBOL );
+    _plugin = pf ? pf() : 0;
+
+    if( !_plugin ){
+        VERBOSE("invalid plugin: no %s", MRQ_PLUGIN_SYMBOL);
+        _exit(-1);
+    }
+    if( _plugin->version < 1 || _plugin->version > MRQ_PLUGIN_VERSION ){
+        VERBOSE("unsupported plugin version %d", _plugin->version);
+        _exit(-1);
+    }
+    if( _is_map ? !_plugin->map : !_plugin->reduce ){
+        VERBOSE("plugin cannot %s", g->phase().c_str());
+        _exit(-1);
+    }
+
+    if( _plugin->init && _plugin->init( g->phase().c_str() ) ){
+        VERBOSE("plugin init failed");
+        _exit(-1);
+    }
+
+    DEBUG("loaded plugin for %s", g->phase().c_str());
+}
+
+NativeProg::~NativeProg(){
+    // NB - do not dlclose, the plugin may have left things behind (atexit, threads, ...)
+}
+
+// a record from the input
+void
+NativeProg::output(const char *buf, int len){
+
+    if( _err ) return;
+    if( len && buf[len-1] == '\n' ) len --;
+
+    if( _is_map ){
+        _err = _plugin->map(buf, len, &_emit);
+        if( _combsize > COMBINEMAX ) _combine();
+        return;
+    }
+
+    // reduce: collect values for a key, the input is sorted
+    const char *key, *val;
+    int keylen, vallen;
+
+    if( !split_record(buf, len, &key, &keylen, &val, &vallen) ){
+        // never drop data quietly, fail the task
+        VERBOSE("invalid record: %.*s", (len > 100 ? 100 : len), buf);
+        _err = -1;
+        return;
+    }
+
+    if( _havekey && (keylen != _key.size() || memcmp(key, _key.data(), keylen)) ){
+        _reduce();
+    }
+
+    if( !_havekey ){
+        _key.assign(key, keylen);
+        _havekey = 1;
+    }
+
+    // the values are buffered for the plugin, same limits as the framer (see pipeline.cc)
+    if( (_group_max && _vals.size() >= _group_max) || (_group_maxsize && _valsize + vallen > _group_maxsize) ){
+        if( !_truncated ) VERBOSE("too many values for key %.*s, truncated", (keylen > 100 ? 100 : keylen), key);
+        _truncated = 1;
+        return;
+    }
+
+    _vals.push_back( string(val, vallen) );
+    _valsize += vallen;
+}
+
+void
+NativeProg::_reduce(void){
+    VecIter vi;
+
+    vec_iter( &vi, &_vals );
+    if( !_err ) _err = _plugin->reduce(_key.data(), _key.size(), &vi.it, &_emit);
+
+    _vals.clear();
+    _valsize   = 0;
+    _truncated = 0;
+    _havekey   = 0;
+}
+
+void
+NativeProg::_combine(void){
+    VecIter vi;
+
+    _combining = 1;
+
+    for(map<string, vector<string> >::iterator it=_comb.begin(); it != _comb.end(); it++){
+        vec_iter( &vi, &it->second );
+        if( !_err ) _err = _plugin->combine(it->first.data(), it->first.size(), &vi.it, &_emit);
+    }
+
+    _comb.clear();
+    _combsize  = 0;
+    _combining = 0;
+}
+
+// all input has been read. 0 => success
+int
+NativeProg::finish(void){
+
+    if( _havekey )   _reduce();
+    if( _combsize )  _combine();
+
+    if( !_err && _plugin->finish ) _err = _plugin->finish( &_emit );
+    if( _err ) VERBOSE("plugin failed: %d", _err);
+
+    return _err;
+}
+
+// output from the plugin
+void
+NativeProg::emit(const char *key, int keylen, const char *val, int vallen){
+
+    // map output is combined first, if the plugin can
+    if( _is_map && _plugin->combine && !_combining ){
+        _comb[ string(key, keylen) ].push_back( string(val, vallen) );
+        _combsize += keylen + vallen;
+        return;
+    }
+
+    _write(key, keylen, val, vallen);
+}
+
+// in the same format the scripts produce: [key,value]
+void
+NativeProg::_write(const char *key, int keylen, const char *val, int vallen){
+
+    _line.assign("[");
+    _line.append(key, keylen);
+    _line.append(",");
+    _line.append(val, vallen);
+    _line.append("]\n");
+
+    _out->output(_line.data(), _line.size());
+}
+
+void
+NativeProg::print(const char *buf, int len){
+
+    _eu->send(buf, len);
+    if( _savefd != -1 ) write(_savefd, buf, len);
+}
@@ -17,6 +17,7 @@
 #include "network.h"
 #include "runmode.h"
 #include "peers.h"
+#include "ratelimit.h"
 
 #include "std_reply.pb.h"
 #include "heartbeat.pb.h"
@@ -39,11 +40,13 @@
 #include <sys/statvfs.h>
 #include <sys/loadavg.h>
 #include <sys/sendfile.h>
+#include "zlib.h"
 
 
 #define READ_TIMEOUT	30
 #define WRITE_TIMEOUT	30
 #define LISTEN		128
+#define INFLATEMAX	(256 * 1024 * 1024)	// largest compressed request we accept
 
 
 static int handle_unknown(NTD*);
@@ -59,6 +62,7 @@ extern int scriblr_put(NTD*);
 extern int scriblr_get(NTD*);
 extern int scriblr_del(NTD*);
 extern int scriblr_chk(NTD*);
+extern int scriblr_push(NTD*);
 extern int mr_status(NTD*);
 extern int handle_xfer(NTD*);
 extern int handle_task(NTD*);
@@ -66,10 +70,12 @@ extern int handle_taskabort(NTD*);
 extern int handle_job(NTD*);
 extern int handle_jobabort(NTD*);
 extern int handle_jobstatus(NTD*);
+extern int handle_statusbatch(NTD*);
 extern int handle_mrdelete(NTD*);
 
 extern void json_task(string *);
 extern void json_xfer(string *);
+extern void json_xfer_stats(string *);
 extern void json_job(string *);
 extern int  job_nrunning(void), task_nrunning(void);
 extern void job_shutdown(void), task_shutdown(void);
@@ -108,6 +114,8 @@ static struct {
     { 0 }, //mr_diagmsg },
     { handle_jobstatus },
     { mr_status },		// kibitz
+    { handle_statusbatch },
+    { scriblr_push },		// map output, as it is written
 
     // ...
 };
@@ -130,6 +138,7 @@ uint32_t myipv4 = 0;
 char     myhostname[256];
 string   myserver_id;
 string   mydatacenter;
+string   myrack;
 string   myipandport;
 NetAddr  mynetaddr;
 
@@ -250,10 +259,18 @@ write_to(int fd, const char *buf, int len, int to){
 
 int
 sendfile_to(int dst, int src, int len, int to){
+    return sendfile_range(dst, src, 0, len, to);
+}
+
+// send len bytes of the file, starting at start
+// if rate limited, send a bit at a time, and pay for it
+int
+sendfile_range(int dst, int src, long long start, int len, int to, TokenBucket *tb){
     struct pollfd pf[1];
-    off_t off = 0;
+    off_t off = start;
+    off_t end = start + len;
 
-    while( off != len ){
+    while( off != end ){
         pf[0].fd = dst;
         pf[0].events = POLLOUT;
         pf[0].revents = 0;
@@ -267,14 +284,17 @@ sendfile_to(int dst, int src, int len, int to){
         }
 
         if( pf[0].revents & POLLOUT ){
-            int s = sendfile(dst, src, &off, len - off);
+            int n = end - off;
+            if( tb && n > RATECHUNK ) n = RATECHUNK;
+            int s = sendfile(dst, src, &off, n);
             DEBUG("sendfile %d -> %d %d, %d", len, s, errno, off);
             if( s == -1 && errno == EAGAIN ) continue;
             if( s < 1 ) return -1;
+            if( tb ) tb->take(s);
         }
     }
 
-    return off;
+    return off - start;
 }
 
 void
@@ -416,6 +436,43 @@ network_process(NTD *ntd){
     return fnc(ntd);
 }
 
+// see compress_data in protocol.cc
+static int
+inflate_data(NTD *ntd){
+    protocol_header *ph = (protocol_header*) ntd->gpbuf_in;
+    uint32_t len;
+
+    if( ph->data_length < 4 ){
+        VERBOSE("invalid compressed request");
+        return 0;
+    }
+
+    memcpy( &len, ntd->in_data(), 4 );
+    len = ntohl( len );
+    if( len > INFLATEMAX ){
+        VERBOSE("invalid compressed request: too large (%u)", len);
+        return 0;
+    }
+
+    string data;
+    data.resize( len );
+    uLongf dlen = len;
+
+    int r = uncompress( (Bytef*) &data[0], &dlen, (const Bytef*) ntd->in_data() + 4, ph->data_length - 4 );
+    if( r != Z_OK || dlen != len ){
+        VERBOSE("invalid compressed request: corrupt");
+        return 0;
+    }
+
+    ntd->in_resize( len + sizeof(protocol_header) );
+    ph = (protocol_header*) ntd->gpbuf_in;
+    memcpy( ntd->in_data(), data.data(), len );
+
+    ph->data_length = len;
+    ph->flags &= ~PHFLAGS_DATA_GZIP;
+    return 1;
+}
+
 int
 read_proto(NTD *ntd, int reqp, int to){
     protocol_header *ph = (protocol_header*) ntd->gpbuf_in;
@@ -493,6 +550,10 @@ read_proto(NTD *ntd, int reqp, int to){
         ntd->have_data = 1;
     }
 
+    if( ph->flags & PHFLAGS_DATA_GZIP ){
+        if( !inflate_data(ntd) ) return 0;
+    }
+
     return 1;
 
 }
@@ -560,7 +621,7 @@ network_tcp4(void *notused){
 
 static void *
 network_udp4(void *notused){
-    NTD ntd;
+    NTD ntd(UDPMAXSIZE, 2048);
     socklen_t l = sizeof(struct sockaddr_in);
     protocol_header *ph = (protocol_header*) ntd.gpbuf_in;
 
@@ -663,6 +724,18 @@ network_init(void){
     }
     DEBUG("datacenter: %s", mydatacenter.c_str());
 
+    // rack: the end of the hostname, gefiltefish7-r4.ccsphl... => r4
+    // you may need to adjust this for your network
+    const char *hdot = strchr(myhostname, '.');
+    int hn = hdot ? hdot - myhostname : hlen;
+    for(int i=hn-1; i>0; i--){
+        if( myhostname[i] == '-' ){
+            myrack.append(myhostname + i + 1, hn - i - 1);
+            break;
+        }
+    }
+    DEBUG("rack: %s", myrack.c_str());
+
     mynetaddr.ipv4 = myipv4;
     mynetaddr.port = myport;
     mynetaddr.name = myserver_id;
@@ -802,6 +875,8 @@ report_json(NTD *ntd){
 
     buf.append( "{\"xfer\": " );
     json_xfer( &buf );
+    buf.append( ",\n \"xferstats\": " );
+    json_xfer_stats( &buf );
     buf.append( ",\n \"task\": " );
     json_task( &buf );
     buf.append( ",\n \"job\": " );
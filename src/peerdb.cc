@@ -20,6 +20,11 @@
 
 #include <strings.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include <sys/stat.h>
+
+extern void task_share_status(ACPMRMStatus *);
 
 #include <sstream>
 #include <iomanip>
@@ -31,6 +36,7 @@ using std::ostringstream;
 #define KEEPLOST	600	// keep data about servers we have not heard about for how long?
 #define KEEPDEAD	300	// keep data in the graveyard
 #define HYSTERESIS	 30
+#define CLEANUPTIME	 15
 
 PeerDB *peerdb = 0;
 
@@ -47,11 +53,16 @@ peerdb_init(void){
 
 static void *
 peerdb_periodic(void *notused){
+    hrtime_t nextclean = 0;
 
     while(1){
         if( runmode.mode() == RUN_MODE_EXITING ) return 0;
-        peerdb->cleanup();
-        sleep(15);
+        if( lr_now() >= nextclean ){
+            peerdb->cleanup();
+            nextclean = lr_now() + CLEANUPTIME;
+        }
+        peerdb->refresh();
+        sleep(1);
     }
 }
 
@@ -237,44 +248,81 @@ PeerDB::random(void){
     return pall;
 }
 
-// add all peers to reply
+// add peers to a serialized ACPMRMStatusReply
+// only the ones the requester doesn't have, or has older versions of
+// (older peers send no digest, and get everything)
 void
-PeerDB::reply_peers(ACPMRMStatusReply *res){
+PeerDB::reply_peers(const ACPMRMStatusRequest *req, string *res){
+    unordered_map<string,hrtime_t> known;
+    int  nsent = 0;
+
+    for(int i=0; i<req->digest_size(); i++){
+        const ACPMRMStatusDigest *d = & req->digest(i);
+        known[ d->server_id() ] = d->timestamp();
+    }
+    // they already know about themself
+    if( req->has_myself() )
+        known[ req->myself().server_id() ] = req->myself().timestamp();
 
     _lock.r_lock();
 
     for(list<Peer*>::const_iterator it=_allpeers.begin(); it != _allpeers.end(); it++){
         const Peer *p = *it;
-        ACPMRMStatus *g = res->add_status();
-        p->status_reply( g );
+
+        unordered_map<string,hrtime_t>::iterator k = known.find(p->_id);
+        if( k != known.end() && k->second >= p->_gstatus->timestamp() ) continue;
+
+        res->append( p->_wire );
+        nsent ++;
     }
 
     _lock.r_unlock();
+
+    DEBUG("sending %d peers, %d known", nsent, (int)known.size());
 }
 
-Peer *
-PeerDB::_find(const char *id){
-    Peer *peer = 0;
+// speculative tasks the other masters are running
+int
+PeerDB::spec_running(void){
+    int n = 0;
 
-    for(list<Peer*>::iterator it=_allpeers.begin(); it != _allpeers.end(); it++){
-        Peer *p = *it;
-        if( !strcmp(p->_id, id) ){
-            peer = p;
-            break;
-        }
+    _lock.r_lock();
+
+    for(list<Peer*>::const_iterator it=_allpeers.begin(); it != _allpeers.end(); it++){
+        const Peer *p = *it;
+
+        if( p->_status == PEER_STATUS_DN ) continue;
+        n += p->_gstatus->spec_running();
     }
 
-    if( !peer ){
-        for(list<Peer*>::iterator it=_sceptical.begin(); it != _sceptical.end(); it++){
-            Peer *p = *it;
-            if( !strcmp(p->_id, id) ){
-                peer = p;
-                break;
-            }
-        }
+    _lock.r_unlock();
+
+    return n;
+}
+
+// what we know, so the peer can send only what we don't
+void
+PeerDB::digest(ACPMRMStatusRequest *req){
+
+    _lock.r_lock();
+
+    for(list<Peer*>::const_iterator it=_allpeers.begin(); it != _allpeers.end(); it++){
+        const Peer *p = *it;
+        ACPMRMStatusDigest *d = req->add_digest();
+
+        d->set_server_id( p->_id );
+        d->set_timestamp( p->_gstatus->timestamp() );
     }
 
-    return peer;
+    _lock.r_unlock();
+}
+
+Peer *
+PeerDB::_find(const char *id){
+
+    unordered_map<string,Peer*>::iterator it = _index.find(id);
+    if( it == _index.end() ) return 0;
+    return it->second;
 }
 
 Peer *
@@ -286,11 +334,214 @@ PeerDB::find(const char *id){
     return peer;
 }
 
+/****************************************************************/
+
+// the scheduler asks about servers constantly (per task, per xfer, per server),
+// so readers get an immutable snapshot, and never wait for gossip updates.
+// writers build a new one (at most once a second), swap it in, and
+// keep the old one around until nobody can still be using it.
+
+// an old snapshot is freed once every reader that might hold it is done:
+// each reader thread has a slot. while it holds a snapshot, the slot has
+// the epoch current when it started. each publish starts a new epoch.
+// a snapshot replaced during epoch N is freed when no reader is still in N or earlier
+
+struct SnapReader {
+    volatile uint64_t	epoch;		// 0 => not reading
+    int			depth;		// nested holds
+    bool		used;		// by a live thread
+    SnapReader		*next;
+};
+
+static SnapReader	*snap_readers = 0;
+static Mutex		snap_readers_lock;
+static pthread_key_t	snap_reader_key;
+static pthread_once_t	snap_reader_once = PTHREAD_ONCE_INIT;
+static __thread SnapReader *snap_mine = 0;
+
+// the thread exited, someone else can have its slot
+static void
+snap_reader_free(void *x){
+    SnapReader *r = (SnapReader*)x;
+
+    snap_readers_lock.lock();
+    r->epoch = 0;
+    r->depth = 0;
+    r->used  = 0;
+    snap_readers_lock.unlock();
+}
+
+static void
+snap_reader_init(void){
+    pthread_key_create( &snap_reader_key, snap_reader_free );
+}
+
+static SnapReader *
+snap_reader(void){
+
+    if( snap_mine ) return snap_mine;
+
+    pthread_once( &snap_reader_once, snap_reader_init );
+
+    snap_readers_lock.lock();
+    SnapReader *r;
+    for(r=snap_readers; r; r=r->next){
+        if( !r->used ) break;
+    }
+    if( !r ){
+        r = new SnapReader;
+        r->next = snap_readers;
+        snap_readers = r;
+    }
+    r->epoch = 0;
+    r->depth = 0;
+    r->used  = 1;
+    snap_readers_lock.unlock();
+
+    pthread_setspecific( snap_reader_key, r );
+    snap_mine = r;
+    return r;
+}
+
+// the oldest epoch a reader is still in
+static uint64_t
+snap_oldest_reader(void){
+    uint64_t oldest = ~(uint64_t)0;
+
+    snap_readers_lock.lock();
+    for(SnapReader *r=snap_readers; r; r=r->next){
+        uint64_t e = r->epoch;
+        if( e && e < oldest ) oldest = e;
+    }
+    snap_readers_lock.unlock();
+
+    return oldest;
+}
+
+PeerSnapRef::PeerSnapRef(PeerDB *db){
+    SnapReader *r = snap_reader();
+
+    if( !r->depth++ ){
+        r->epoch = db->_epoch;
+        // our epoch is visible before we look at the snapshot
+        MEMBAR_FULL();
+    }
+
+    _s = ATOMIC_LOADPTR( db->_snap );
+}
+
+PeerSnapRef::~PeerSnapRef(){
+    SnapReader *r = snap_mine;
+
+    if( !--r->depth ){
+        // done reading, before we say so
+        MEMBAR_FULL();
+        r->epoch = 0;
+    }
+}
+
+PeerSnap::~PeerSnap(){
+
+    for(unordered_map<string,PeerSnapEnt>::iterator it=_peers.begin(); it != _peers.end(); it++){
+        delete it->second.g;
+    }
+}
+
+const PeerSnapEnt *
+PeerSnap::find(const char *id) const {
+
+    unordered_map<string,PeerSnapEnt>::const_iterator it = _peers.find(id);
+    if( it == _peers.end() ) return 0;
+    return & it->second;
+}
+
+static void
+snap_add(unordered_map<string,PeerSnapEnt> *m, Peer *p, const ACPMRMStatus *src, int status, const PhiAccrual *hb){
+    PeerSnapEnt *e = & (*m)[ src->server_id() ];
+
+    e->status = status;
+    e->addr   = & p->bestaddr;
+    e->g      = new ACPMRMStatus;
+    hb->estimate( &e->hb_last, &e->hb_mean, &e->hb_std );
+
+    // only what the readers need
+    e->g->set_status( src->status() );
+    e->g->set_datacenter( src->datacenter() );
+    if( src->has_rack() ) e->g->set_rack( src->rack() );
+    e->g->set_sort_metric( src->sort_metric() );
+    if( src->has_capacity_metric() ) e->g->set_capacity_metric( src->capacity_metric() );
+    if( src->has_task_slots() )      e->g->set_task_slots( src->task_slots() );
+    if( src->has_basedir_id() ){
+        e->g->set_basedir( src->basedir() );
+        e->g->set_basedir_id( src->basedir_id() );
+    }
+    e->g->mutable_share()->CopyFrom( src->share() );
+}
+
+// lock held
+void
+PeerDB::_publish(void){
+    PeerSnap *s = new PeerSnap;
+
+    for(list<Peer*>::iterator it=_allpeers.begin(); it != _allpeers.end(); it++){
+        Peer *p = *it;
+        snap_add( &s->_peers, p, p->_gstatus, p->_status, &p->_hb );
+    }
+    for(list<Peer*>::iterator it=_sceptical.begin(); it != _sceptical.end(); it++){
+        Peer *p = *it;
+        snap_add( &s->_peers, p, p->_gstatus, p->_status, &p->_hb );
+    }
+
+    PeerSnap *old = _snap;
+    // the new one is complete before anyone can see it
+    membar_producer();
+    ATOMIC_SETPTR( _snap, s );
+    MEMBAR_FULL();
+
+    // readers starting from now on cannot see the old one
+    old->_epoch = _epoch;
+    ATOMIC_ADD64( _epoch, 1 );
+    _retired.push_back( old );
+
+    _dirty    = 0;
+    _snaptime = lr_now();
+}
+
+// lock held
+void
+PeerDB::_changed(void){
+
+    _dirty = 1;
+    // otherwise, refresh will get it
+    if( _snaptime != lr_now() ) _publish();
+}
+
+void
+PeerDB::refresh(void){
+
+    _lock.w_lock();
+
+    if( _dirty ) _publish();
+
+    MEMBAR_FULL();
+    uint64_t oldest = snap_oldest_reader();
+
+    while( !_retired.empty() && _retired.front()->_epoch < oldest ){
+        delete _retired.front();
+        _retired.pop_front();
+    }
+
+    _lock.w_unlock();
+}
+
+/****************************************************************/
+
 NetAddr *
 PeerDB::find_addr(const char *id){
 
-    Peer *peer = find(id);
-    if(peer) return & peer->bestaddr;
+    PeerSnapRef snap(this);
+    const PeerSnapEnt *e = snap.find(id);
+    if( e ) return e->addr;
 
     // is it me?
     if( !myserver_id.compare(id) ) return &mynetaddr;
@@ -303,12 +554,52 @@ PeerDB::is_it_up(const char *id){
     // is it me? I am up.
     if( !myserver_id.compare(id) ) return 1;
 
-    Peer *peer = find(id);
-    if( !peer ) return 0;
-    if( peer->_status != PEER_STATUS_UP ) return 0;
-    if( peer->_gstatus->status() != 200 ) return 0;
+    PeerSnapRef snap(this);
+    const PeerSnapEnt *e = snap.find(id);
+    if( !e ) return 0;
+    if( e->g->status() != 200 ) return 0;
+    if( e->status == PEER_STATUS_UP ) return 1;
 
-    return 1;
+    // we couldn't reach it, but others are still hearing from it
+    if( e->status == PEER_STATUS_MAYBEDN && e->hb_mean > 0
+        && phi_accrual( lr_now() - e->hb_last, e->hb_mean, e->hb_std ) < PHI_DOWN ) return 1;
+
+    return 0;
+}
+
+// where is it? (for topology aware placement)
+void
+PeerDB::topology(const char *id, string *dc, string *rack){
+
+    if( !myserver_id.compare(id) ){
+        *dc   = mydatacenter;
+        *rack = myrack;
+        return;
+    }
+
+    dc->clear();
+    rack->clear();
+
+    PeerSnapRef snap(this);
+    const PeerSnapEnt *e = snap.find(id);
+    if( !e ) return;
+
+    *dc   = e->g->datacenter();
+    *rack = e->g->rack();
+}
+
+// how late is it? 0 => on time, PHI_SUSPECT => probably slow, PHI_DOWN => down
+float
+PeerDB::suspicion(const char *id){
+
+    if( !myserver_id.compare(id) ) return 0;
+
+    PeerSnapRef snap(this);
+    const PeerSnapEnt *e = snap.find(id);
+    if( !e ) return PHI_DOWN;
+    if( e->status == PEER_STATUS_DN ) return PHI_DOWN;
+
+    return phi_accrual( lr_now() - e->hb_last, e->hb_mean, e->hb_std );
 }
 
 int
@@ -316,15 +607,115 @@ PeerDB::current_load(const char *id){
 #define MAXLOAD 999999
 
     if( !myserver_id.compare(id) ) return ::current_load();
-    Peer *peer = find(id);
-    if( !peer ) return MAXLOAD;
-    if( peer->_status != PEER_STATUS_UP ) return MAXLOAD;
-    if( peer->_gstatus->status() != 200 ) return MAXLOAD;
+    PeerSnapRef snap(this);
+    const PeerSnapEnt *e = snap.find(id);
+    if( !e ) return MAXLOAD;
+    if( e->status != PEER_STATUS_UP ) return MAXLOAD;
+    if( e->g->status() != 200 ) return MAXLOAD;
 
-    return peer->_gstatus->sort_metric();
+    return e->g->sort_metric();
 #undef MAXLOAD
 }
 
+// our fair share of a server's task slots, -1 if unknown
+static int
+share_slots(const ACPMRMStatus *g, const string *group, int weight){
+
+    if( !g->has_task_slots() ) return -1;
+
+    // divide the slots among everyone who wants some
+    int tw = weight;
+    for(int i=0; i<g->share_size(); i++){
+        const ACPMRMShareUse *u = & g->share(i);
+
+        if( ! group->compare(u->group()) ) continue;
+        if( !u->running() && !u->queued() ) continue;
+        tw += u->weight();
+    }
+
+    int n = (g->task_slots() * weight + tw - 1) / tw;
+    return n < 1 ? 1 : n;
+}
+
+int
+PeerDB::fair_slots(const char *id, const string *group, int weight){
+
+    if( !myserver_id.compare(id) ){
+        ACPMRMStatus g;
+        task_share_status( &g );
+        return share_slots( &g, group, weight );
+    }
+
+    PeerSnapRef snap(this);
+    const PeerSnapEnt *e = snap.find(id);
+    if( !e ) return -1;
+
+    return share_slots( e->g, group, weight );
+}
+
+// how many tasks can it run right now, -1 if unknown
+// (the server decides, based on its memory + disks)
+int
+PeerDB::task_slots(const char *id){
+
+    if( !myserver_id.compare(id) ){
+        ACPMRMStatus g;
+        task_share_status( &g );
+        return g.task_slots();
+    }
+
+    PeerSnapRef snap(this);
+    const PeerSnapEnt *e = snap.find(id);
+    if( !e ) return -1;
+    if( ! e->g->has_task_slots() ) return -1;
+
+    return e->g->task_slots();
+}
+
+// MB free, -1 if unknown
+int
+PeerDB::current_disk(const char *id){
+    struct statvfs vfs;
+
+    if( !myserver_id.compare(id) ){
+        if( statvfs( config->basedir.c_str(), &vfs ) ) return -1;
+        return vfs.f_bavail / 2048;
+    }
+
+    PeerSnapRef snap(this);
+    const PeerSnapEnt *e = snap.find(id);
+    if( !e ) return -1;
+    if( ! e->g->has_capacity_metric() ) return -1;
+
+    return e->g->capacity_metric();
+}
+
+// where its files are, and the "dev ino" of that. 0 if unknown
+int
+PeerDB::basedir(const char *id, string *dir, string *dirid){
+
+    if( !myserver_id.compare(id) ){
+        struct stat st;
+        char buf[64];
+
+        if( stat( config->basedir.c_str(), &st ) ) return 0;
+        // same as about_myself
+        snprintf(buf, sizeof(buf), "%lld %lld", (long long)st.st_dev, (long long)st.st_ino);
+        dir->assign( config->basedir );
+        dirid->assign( buf );
+        return 1;
+    }
+
+    PeerSnapRef snap(this);
+    const PeerSnapEnt *e = snap.find(id);
+    if( !e ) return 0;
+    if( ! e->g->has_basedir_id() ) return 0;
+
+    dir->assign( e->g->basedir() );
+    dirid->assign( e->g->basedir_id() );
+    return 1;
+}
+
 void
 PeerDB::_upgrade(Peer *p){
 
@@ -332,13 +723,11 @@ PeerDB::_upgrade(Peer *p){
     // add to _allpeers
     DEBUG("upgrade %s", p->_id );
 
-    _lock.w_lock();
-
     _sceptical.remove(p);
     _allpeers.push_back(p);
     if( p->_status == PEER_STATUS_SCEPTICAL ) p->_status = PEER_STATUS_UP;
 
-    _lock.w_unlock();
+    _changed();
 }
 
 void
@@ -347,8 +736,7 @@ PeerDB::_kill(Peer *p){
     // move to graveyard
     VERBOSE("removing old peer %s", p->_id );
 
-    _lock.w_lock();
-
+    _index.erase(p->_id);
     _allpeers.remove(p);
     _sceptical.remove(p);
     _graveyard.push_back(p);
@@ -356,8 +744,7 @@ PeerDB::_kill(Peer *p){
     p->_status   = PEER_STATUS_DEAD;
     p->_last_try = lr_now();
 
-    _lock.w_unlock();
-
+    _changed();
 }
 
 
@@ -380,10 +767,12 @@ PeerDB::add_peer(ACPMRMStatus *g){
     if( !_update_ok(g) ) return;
 
     const string *id = & g->server_id();
-    Peer *p = find( id->c_str() );
 
     DEBUG("add peer %s", id->c_str());
 
+    _lock.w_lock();
+    Peer *p = _find( id->c_str() );
+
     if( p ){
         if( p->status() == PEER_STATUS_SCEPTICAL ){
             _upgrade(p);
@@ -392,26 +781,18 @@ PeerDB::add_peer(ACPMRMStatus *g){
 
         DEBUG("update existing %s", id->c_str());
         // update existing entry
-        _lock.w_lock();
         p->update( g );
+        _changed();
         _lock.w_unlock();
         return;
     }
 
+    // add new entry
     VERBOSE("discovered new peer %s", id->c_str());
-
-    _lock.w_lock();
-
-    // check again while locked
-    p = _find( id->c_str() );
-
-    if( !p ){
-        // add new entry
-
-        DEBUG("add new peer %s", id->c_str());
-        p = new Peer(g);
-        _allpeers.push_back( p );
-    }
+    p = new Peer(g);
+    _allpeers.push_back( p );
+    _index[ p->_id ] = p;
+    _changed();
 
     _lock.w_unlock();
 }
@@ -441,6 +822,8 @@ PeerDB::add_sceptical(ACPMRMStatus *g){
         p = new Peer(g);
         p->_status = PEER_STATUS_SCEPTICAL;
         _sceptical.push_back( p );
+        _index[ p->_id ] = p;
+        _changed();
     }
 
     _lock.w_unlock();
@@ -457,6 +840,7 @@ PeerDB::peer_up(const char *id){
         p->is_up();
         if( os == PEER_STATUS_SCEPTICAL ) _upgrade(p);
         if( os != PEER_STATUS_UP ) VERBOSE("peer %s is now up", id);
+        if( os != PEER_STATUS_UP ) _changed();
     }
     _lock.w_unlock();
 }
@@ -472,6 +856,7 @@ PeerDB::peer_dn(const char *id){
         p->maybe_down();
         if( os == PEER_STATUS_SCEPTICAL ) _kill(p);
         if( p->status() == PEER_STATUS_DN && os != PEER_STATUS_DN ) VERBOSE("peer %s is now down", id);
+        if( p->status() != os ) _changed();
     }
     _lock.w_unlock();
 }
@@ -492,6 +877,10 @@ PeerDB::~PeerDB(){
         Peer *p = *it;
         delete p;
     }
+    for(list<PeerSnap*>::iterator it=_retired.begin(); it != _retired.end(); it++){
+        delete *it;
+    }
+    delete _snap;
 
     _lock.w_unlock();
 }
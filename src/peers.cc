@@ -21,8 +21,13 @@
 
 #include <netinet/in.h>
 #include <strings.h>
+#include <math.h>
 
 #define MAXFAIL		2
+#define PHIMINSAMPLE	4	// heartbeats, before we trust the estimate
+#define PHIMINSTD	1.0	// seconds. times only have second resolution
+#define PHIPAUSE	5	// seconds. kibitz is random, allow some slack
+#define PHIMAX		30
 
 
 void copy_status(const ACPMRMStatus *src, ACPMRMStatus *dst){
@@ -30,6 +35,26 @@ void copy_status(const ACPMRMStatus *src, ACPMRMStatus *dst){
     dst->CopyFrom( *src );
 }
 
+// append a status, serialized as an element of ACPMRMStatusReply.status
+void
+wire_status(string *dst, const ACPMRMStatus *g){
+    string buf;
+
+    g->SerializeToString( &buf );
+
+    // field 1, length delimited
+    dst->push_back( (1 << 3) | 2 );
+
+    unsigned int l = buf.size();
+    while( l >= 0x80 ){
+        dst->push_back( (l & 0x7F) | 0x80 );
+        l >>= 7;
+    }
+    dst->push_back( l );
+
+    dst->append( buf );
+}
+
 
 Peer::Peer(const ACPMRMStatus *g){
 
@@ -39,6 +64,7 @@ Peer::Peer(const ACPMRMStatus *g){
     _last_try = 0;
     _last_up  = 0;
     _id       = _gstatus->server_id().c_str();
+    _hb.heartbeat( lr_now() );
 
     switch( g->status() ){
     case 200:
@@ -65,6 +91,8 @@ Peer::Peer(const ACPMRMStatus *g){
         bestaddr.name = g->server_id().c_str();
         bestaddr.cpus = g->cpu_metric();
     }
+
+    _serialize();
 }
 
 Peer::~Peer(){
@@ -76,6 +104,7 @@ void
 Peer::update(const ACPMRMStatus *g){
 
     if( g->timestamp() < _gstatus->timestamp() ) return;
+    if( g->timestamp() > _gstatus->timestamp() ) _hb.heartbeat( lr_now() );
 
     copy_status( g, _gstatus );
     _id = _gstatus->server_id().c_str();
@@ -83,19 +112,20 @@ Peer::update(const ACPMRMStatus *g){
     if( g->has_cpu_metric() )
         bestaddr.cpus = g->cpu_metric();
 
+    _serialize();
 }
 
+// every kibitz reply includes most of the peers, so serialize each
+// one once, when it changes, not once per reply
 void
-Peer::status_reply(ACPMRMStatus *g) const{
-
-    copy_status( _gstatus, g);
+Peer::_serialize(void){
+    ACPMRMStatus g;
 
-    g->set_via( myserver_id.c_str() );
+    copy_status( _gstatus, &g );
+    g.set_via( myserver_id.c_str() );
 
-    string path = g->path().c_str();
-    path.append(" ");
-    path.append( myserver_id.c_str() );
-    g->set_path( path.c_str() );
+    _wire.clear();
+    wire_status( &_wire, &g );
 }
 
 void
@@ -112,6 +142,7 @@ Peer::is_down(void){
     _status = PEER_STATUS_DN;
     _gstatus->set_status( 0 );
     _gstatus->set_timestamp( _last_try );
+    _serialize();
 }
 
 void
@@ -121,7 +152,86 @@ Peer::maybe_down(void){
     _status   = PEER_STATUS_MAYBEDN;
     _last_try = lr_now();
 
-    if( _num_fail > MAXFAIL ) is_down();
+    if( _num_fail <= MAXFAIL ) return;
+
+    // we can't reach it. but if we are still hearing about it
+    // (from other peers), it is busy, not down
+    if( _hb.usable() ){
+        hrtime_t last;
+        float mean, std;
+        _hb.estimate( &last, &mean, &std );
+        if( phi_accrual( lr_now() - last, mean, std ) < PHI_DOWN ) return;
+    }
+
+    is_down();
+
+}
+
+/****************************************************************/
+
+// we heard something new
+void
+PhiAccrual::heartbeat(hrtime_t now){
+
+    if( _last && now > _last ){
+        int dt = now - _last;
+
+        if( _n == PHIWINDOW ){
+            // forget the oldest
+            int old = _hist[_pos];
+            _sum   -= old;
+            _sumsq -= (double)old * old;
+        }else{
+            _n ++;
+        }
+
+        _hist[_pos] = dt;
+        _pos = (_pos + 1) % PHIWINDOW;
+        _sum   += dt;
+        _sumsq += (double)dt * dt;
+    }
+
+    if( now > _last ) _last = now;
+}
+
+bool
+PhiAccrual::usable(void) const {
+    return _n >= PHIMINSAMPLE;
+}
+
+void
+PhiAccrual::estimate(hrtime_t *last, float *mean, float *std) const {
 
+    *last = _last;
+
+    if( !usable() ){
+        *mean = *std = 0;
+        return;
+    }
+
+    double m = _sum / _n;
+    double v = _sumsq / _n - m * m;
+
+    *mean = m;
+    *std  = (v > PHIMINSTD * PHIMINSTD) ? sqrt(v) : PHIMINSTD;
 }
 
+// phi = -log10( P(heartbeat arrives later than this) ), normal distribution
+// 0 => no estimate yet
+float
+phi_accrual(hrtime_t since, float mean, float std){
+
+    if( mean <= 0 ) return 0;
+
+    mean += PHIPAUSE;
+
+    // logistic approximation of the normal cdf
+    double y = (since - mean) / std;
+    double e = exp( -y * (1.5976 + 0.070566 * y * y) );
+    double p = (since > mean) ? e / (1 + e) : 1 - 1 / (1 + e);
+
+    if( p <= 0 ) return PHIMAX;
+    double phi = - log10(p);
+
+    return phi > PHIMAX ? PHIMAX : phi;
+}
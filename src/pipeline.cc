@@ -13,7 +13,11 @@
 #include "config.h"
 #include "misc.h"
 #include "network.h"
+#include "hrtime.h"
+#include "cgroup.h"
+#include "mapio.h"
 #include "pipeline.h"
+#include "native.h"
 
 
 #include "mrmagoo.pb.h"
@@ -27,7 +31,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <libgen.h>
+#include <dirent.h>
 
 
 // RSN - config
@@ -35,8 +41,21 @@
 #define GZCATPROG	"/usr/bin/gzcat"
 #define SORTPROG	"/usr/bin/sort"
 
+#define WARMDIR		"mrtmp/warm"
+#define WARMSTART	10		// seconds to wait for a warm worker
+#define WARMUID		65535		// the worker runs as nobody, just like the scripts
+#define FRAMEBADREC	3		// framer exit value: unparseable input
+
 
 static int spawn(const char *, const ACPMRMTaskCreate *, int, int, int, int, bool);
+static int spawn_warm(const char *, const char *, int);
+
+// the warm worker's child running our task, for the abort signal handler
+static volatile int warm_child = 0;
+static int spawn_framer(const ACPMRMTaskCreate *, int, int, int);
+
+// a warm worker's task talks to us through these
+static const char *warm_fifo[] = { "in", "out", "err", "dat", "status", 0 };
 
 static char sort_tmp[256];
 
@@ -48,6 +67,11 @@ pipeline_init(void){
     int e = mkdir( sort_tmp, 0777 );
     chmod( sort_tmp, 0777 );
 
+    // native plugins are loaded (and later removed) as nobody
+    snprintf(sort_tmp, sizeof(sort_tmp), "%s/mrtmp/bin", config->basedir.c_str());
+    mkdir( sort_tmp, 0777 );
+    chmod( sort_tmp, 0777 );
+
     snprintf(sort_tmp, sizeof(sort_tmp), "%s/mrtmp/sort", config->basedir.c_str());
     e = mkdir( sort_tmp, 0777 );
     chmod( sort_tmp, 0777 );
@@ -67,12 +91,46 @@ void
 Pipeline::_cleanup(void){
     // remove tmpfile
     if( ! _tmpfile.empty() ) unlink( _tmpfile.c_str() );
+    _warm_remove();
+}
+
+void
+Pipeline::_warm_remove(void){
+
+    // remove fifos
+    if( ! _warmdir.empty() ){
+        for(int i=0; warm_fifo[i]; i++){
+            string file = _warmdir;
+            file.append( "/" );
+            file.append( warm_fifo[i] );
+            unlink( file.c_str() );
+        }
+        rmdir( _warmdir.c_str() );
+        _warmdir.clear();
+    }
+
+    if( _statfd != -1 ){
+        close( _statfd );
+        _statfd = -1;
+    }
+}
+
+// abort: the worker's child (and anything it started) is in its own
+// process group, our kill(0) does not reach it
+void
+pipeline_warm_kill(void){
+    int pid = warm_child;
+
+    if( pid <= 0 ) return;
+    kill( -pid, 9 );
+    kill( pid, 9 );
 }
 
 void
 Pipeline::abort(void){
     DEBUG("abort");
     _cleanup();
+    if( _pid && _warm ) pipeline_warm_kill();
     if( _pid ) kill( _pid, 9 );
 }
 
@@ -82,21 +140,61 @@ Pipeline::still_producing(void){
     // is the input pipeline still running?
     int ev;
     int w = ::waitpid( _inpid, &ev, WNOHANG );
+    if( w == _inpid ) _inexit = ev;
 
     return (w == _inpid) ? 0 : 1;
 }
 
+// the program succeeded. did the framer?
+int
+Pipeline::_frame_exit(int exitval){
+
+    if( exitval || !_framed ) return exitval;
+
+    if( _inexit == -1 ){
+        int ev;
+        if( ::waitpid( _inpid, &ev, 0 ) == _inpid ) _inexit = ev;
+    }
+
+    if( _inexit != -1 && WIFEXITED(_inexit) && WEXITSTATUS(_inexit) == FRAMEBADREC ){
+        VERBOSE("invalid reduce input");
+        return _inexit;
+    }
+
+    return exitval;
+}
+
 int
 Pipeline::waitpid(void){
     int w, exitval;
 
+    // just the input pipeline
+    if( _native ){
+        w = ::waitpid( _inpid, &exitval, 0 );
+        _cleanup();
+        // still_producing may have already collected it
+        return (w == _inpid) ? exitval : 0;
+    }
+
+    // the worker waits for it, and tells us
+    if( _warm ){
+        if( _warm_status("exit", 10, &exitval) ){
+            DEBUG("warm exit value %d", exitval);
+            warm_child = 0;
+            _cleanup();
+            return _frame_exit( exitval );
+        }
+        abort();
+        return -1;
+    }
+
     for(int t=0; t<10; t++){
         w = ::waitpid( _pid, &exitval, WNOHANG );
         if( w == _pid ){
             // finished
             DEBUG("wait value %d", exitval);
             _cleanup();
-            return exitval;
+            return _frame_exit( exitval );
         }
         // not done yet? wait a bit, maybe kill it
         if( t > 7 ) kill( _pid, 3 );
@@ -130,10 +228,18 @@ set_nbio(int fd){
 // reduce:
 //   sort files | prog
 //   gzcat files | sort | prog
+//   gzcat files | sort | frame | prog
 
 
 Pipeline::Pipeline(const ACPMRMTaskCreate *g, int* outfds){
 
+    _pid    = 0;
+    _warm   = 0;
+    _statfd = -1;
+    _inexit = -1;
+    _framed = 0;
+    _native = native_prog( & g->jobsrc() );
+
     // save job src in tmp file
     _tmpfile = config->basedir;
     _tmpfile.append("/mrtmp/bin");
@@ -156,24 +262,39 @@ Pipeline::Pipeline(const ACPMRMTaskCreate *g, int* outfds){
     int pprogerr[2];	// std err from prog
     int pprogdat[2];	// data from prog
     int pinterm[2];	// intermediate pipe, if needed
-    int unusedfd = pprogerr[1];	// tie unneeded fds to stderr
 
-    // set up pipes for the end-user program
-    DEBUG("creating pipes");
-    if( pipe(pprogin) )  _fail( "pipe failed");
-    if( pipe(pprogout) ) _fail( "pipe failed");
-    if( pipe(pprogerr) ) _fail( "pipe failed");
-    if( pipe(pprogdat) ) _fail( "pipe failed");
+    if( _native ){
+        // the input is our data. nothing writes stdout
+        DEBUG("creating pipes");
+        if( pipe(pprogin) )  _fail( "pipe failed");
+        if( pipe(pprogout) ) _fail( "pipe failed");
+        if( pipe(pprogerr) ) _fail( "pipe failed");
+        pprogdat[0] = dup( pprogin[0] );
+        pprogdat[1] = -1;
+        DEBUG("native job prog");
+    }else if( g->warm() && _warm_start(g, pprogin, pprogout, pprogerr, pprogdat) ){
+        // the program is already running, in a warm worker
+        DEBUG("warm job prog: %d", _pid);
+    }else{
+        // set up pipes for the end-user program
+        DEBUG("creating pipes");
+        if( pipe(pprogin) )  _fail( "pipe failed");
+        if( pipe(pprogout) ) _fail( "pipe failed");
+        if( pipe(pprogerr) ) _fail( "pipe failed");
+        if( pipe(pprogdat) ) _fail( "pipe failed");
+
+        // spawn the end-user program
+        _pid = spawn( _tmpfile.c_str(), 0, pprogin[0], pprogout[1], pprogerr[1], pprogdat[1], 0 );
+        DEBUG("spawn job prog: %d", _pid);
+    }
+
+    int unusedfd = pprogerr[1];	// tie unneeded fds to stderr
 
     // attach these (non-blockingly) back to task.cc:run_task_prog()
     outfds[0] = set_nbio( pprogout[0] );
     outfds[1] = set_nbio( pprogerr[0] );
     outfds[2] = set_nbio( pprogdat[0] );
 
-    // spawn the end-user program
-    _pid = spawn( _tmpfile.c_str(), 0, pprogin[0], pprogout[1], pprogerr[1], pprogdat[1], 0 );
-    DEBUG("spawn job prog: %d", _pid);
-
     // what do we need to run?
     // XXX - currently, all files are assumed to be compressed.
     // should be configurable.
@@ -191,12 +312,30 @@ Pipeline::Pipeline(const ACPMRMTaskCreate *g, int* outfds){
         if( pipe(pinterm) ) _fail( "pipe failed");
     }
 
+    // group the sorted input by key, for the program?
+    bool framed = e2 && g->framed() && !_native;
+    _framed = framed;
+    int pframe[2];
+    int sortout = pprogin[1];
+
+    if( framed ){
+        if( pipe(pframe) ) _fail( "pipe failed");
+        sortout = pframe[1];
+    }
+
     // intermediate?
     if( e2 ){
-        int p2 = spawn( e2, 0, pinterm[0], pprogin[1], pprogerr[1], unusedfd, sort_tmp[0] );
+        int p2 = spawn( e2, 0, pinterm[0], sortout, pprogerr[1], unusedfd, sort_tmp[0] );
         DEBUG("spawn %s: %d", e2, p2);
         _inpid = p2;
     }
+    if( framed ){
+        int p3 = spawn_framer( g, pframe[0], pprogin[1], pprogerr[1] );
+        DEBUG("spawn framer: %d", p3);
+        _inpid = p3;
+        close(pframe[0]);
+        close(pframe[1]);
+    }
 
     // initial prog (with files)
     // QQQ - stdin?
@@ -217,6 +356,384 @@ Pipeline::Pipeline(const ACPMRMTaskCreate *g, int* outfds){
 
 }
 
+/****************************************************************/
+
+// warm workers: for jobs with many small tasks, starting the interpreter
+// and loading the program can take longer than running it.
+// instead, one worker per job + phase loads it once, and forks
+// a copy for each task. (see Runtime.pm)
+//
+// the worker listens on WARMDIR/<job>/<phase>/ctl
+// we create a directory of fifos (in, out, err, dat, status)
+// and send its name. the worker's child opens the other ends.
+// the worker tells us the child's pid, and later, its exit status.
+//
+// the worker quits after enough tasks, or when idle
+
+// open a fifo for writing, once the other end has been opened
+static int
+open_writer(const char *file, int timeout){
+    hrtime_t end = lr_now() + timeout;
+
+    while(1){
+        int fd = open(file, O_WRONLY | O_NONBLOCK);
+        if( fd >= 0 ){
+            fcntl(fd, F_SETFL, 0);
+            return fd;
+        }
+        if( errno != ENXIO && errno != ENOENT ) return -1;
+        if( lr_now() >= end ) return -1;
+        usleep( 100000 );
+    }
+}
+
+// only the worker (and we) may use it
+static int
+warm_own(const char *file, int mode){
+
+    if( chown( file, WARMUID, WARMUID ) || chmod( file, mode ) ){
+        VERBOSE("cannot chown %s: %s", file, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+static int
+open_fifo(const string *dir, const char *name, int flags){
+    string file = *dir;
+    file.append( "/" );
+    file.append( name );
+
+    return open( file.c_str(), flags );
+}
+
+int
+Pipeline::_warm_start(const ACPMRMTaskCreate *g, int *pin, int *pout, int *perr, int *pdat){
+
+    string base = config->basedir;
+    base.append( "/" WARMDIR "/" );
+    base.append( g->jobid() );
+
+    string wdir = base;
+    wdir.append( "/" );
+    for(const char *p=g->phase().c_str(); *p; p++){
+        wdir.push_back( (*p == '/') ? '_' : *p );
+    }
+
+    // the worker runs as nobody, and needs to be able to clean up.
+    // no one else may look at, or write into, the task's fifos
+    mkdirp( wdir.c_str(), 0700 );
+    string top = config->basedir;
+    top.append( "/" WARMDIR );
+    chmod( top.c_str(), 0755 );
+    if( !warm_own( base.c_str(), 0700 ) || !warm_own( wdir.c_str(), 0700 ) ) return 0;
+
+    _warmdir = base;
+    _warmdir.append( "/t" );
+    unique( &_warmdir );
+
+    if( mkdir( _warmdir.c_str(), 0700 ) ){
+        VERBOSE("cannot create %s: %s", _warmdir.c_str(), strerror(errno));
+        _warmdir.clear();
+        return 0;
+    }
+    if( !warm_own( _warmdir.c_str(), 0700 ) ){
+        _warm_remove();
+        return 0;
+    }
+
+    for(int i=0; warm_fifo[i]; i++){
+        string file = _warmdir;
+        file.append( "/" );
+        file.append( warm_fifo[i] );
+
+        if( mkfifo( file.c_str(), 0600 ) || !warm_own( file.c_str(), 0600 ) ){
+            VERBOSE("cannot create fifo %s: %s", file.c_str(), strerror(errno));
+            _warm_remove();
+            return 0;
+        }
+    }
+
+    pin[0] = pin[1] = pout[1] = perr[1] = pdat[1] = -1;
+
+    // open our ends first, so the worker never waits for us
+    _statfd = open_fifo( &_warmdir, "status", O_RDONLY | O_NONBLOCK );
+    pout[0] = open_fifo( &_warmdir, "out",    O_RDONLY | O_NONBLOCK );
+    perr[0] = open_fifo( &_warmdir, "err",    O_RDONLY | O_NONBLOCK );
+    pdat[0] = open_fifo( &_warmdir, "dat",    O_RDONLY | O_NONBLOCK );
+
+    if( _statfd != -1 && pout[0] != -1 && perr[0] != -1 && pdat[0] != -1
+        && _warm_request( &wdir, g->warm() ) ){
+
+        // the task has started once the worker's child opens its stdin
+        string file = _warmdir;
+        file.append( "/in" );
+        pin[1] = open_writer( file.c_str(), WARMSTART );
+
+        // for gzcat + sort
+        if( pin[1] != -1 ) perr[1] = open_fifo( &_warmdir, "err", O_WRONLY );
+
+        if( pin[1] != -1 && perr[1] != -1 && _warm_status("pid", WARMSTART, &_pid) ){
+            // count it as part of this task
+            cgroup_adopt( _pid );
+            _warm = 1;
+            warm_child = _pid;
+            return 1;
+        }
+    }
+
+    VERBOSE("warm worker unavailable, starting fresh");
+    close( pin[1] );
+    close( pout[0] );
+    close( perr[0] );
+    close( perr[1] );
+    close( pdat[0] );
+    _pid = 0;
+    _warm_remove();
+
+    return 0;
+}
+
+// send our request to the worker. start one, if there is none
+int
+Pipeline::_warm_request(const string *wdir, int maxtask){
+    hrtime_t end = lr_now() + WARMSTART;
+    bool started = 0;
+
+    string ctl = *wdir;
+    ctl.append( "/ctl" );
+    string req = _warmdir;
+    req.append( "\n" );
+
+    while(1){
+        int fd = open( ctl.c_str(), O_WRONLY | O_NONBLOCK );
+        if( fd >= 0 ){
+            int w = write( fd, req.data(), req.size() );
+            close(fd);
+            return w == req.size();
+        }
+
+        if( !started ){
+            int pid = spawn_warm( _tmpfile.c_str(), wdir->c_str(), maxtask );
+            DEBUG("spawn warm worker: %d", pid);
+            started = 1;
+        }
+
+        if( lr_now() >= end ) return 0;
+        usleep( 100000 );
+    }
+}
+
+// read "what value" from the worker
+int
+Pipeline::_warm_status(const char *what, int timeout, int *val){
+    hrtime_t end = lr_now() + timeout;
+    int wl = strlen(what);
+    char buf[64];
+
+    while(1){
+        int nl = _statbuf.find('\n');
+        if( nl != -1 ){
+            string line = _statbuf.substr(0, nl);
+            _statbuf.erase(0, nl + 1);
+
+            if( !line.compare(0, wl, what) && line[wl] == ' ' ){
+                *val = atoi( line.c_str() + wl + 1 );
+                return 1;
+            }
+            continue;
+        }
+
+        hrtime_t now = lr_now();
+        if( now >= end ) return 0;
+
+        struct pollfd pf;
+        pf.fd      = _statfd;
+        pf.events  = POLLIN;
+        pf.revents = 0;
+        poll(&pf, 1, (end - now) * 1000);
+
+        int r = read(_statfd, buf, sizeof(buf));
+        if( r > 0 ){
+            _statbuf.append(buf, r);
+            continue;
+        }
+        // the worker went away
+        if( r == 0 && (pf.revents & POLLHUP) ) return 0;
+    }
+}
+
+// the job is over (finished or aborted): tell its workers to quit now,
+// instead of when they have been idle for a while. (see Runtime.pm)
+void
+pipeline_warm_stop(const string *jobid){
+
+    if( jobid->empty() || jobid->find('/') != string::npos || (*jobid)[0] == '.' ) return;
+
+    string base = config->basedir;
+    base.append( "/" WARMDIR "/" );
+    base.append( *jobid );
+
+    DIR *d = opendir( base.c_str() );
+    if( !d ) return;
+
+    struct dirent *de;
+    while( (de = readdir(d)) ){
+        if( de->d_name[0] == '.' ) continue;
+
+        string ctl = base;
+        ctl.append( "/" );
+        ctl.append( de->d_name );
+        ctl.append( "/ctl" );
+
+        // no one listening => no worker
+        int fd = open( ctl.c_str(), O_WRONLY | O_NONBLOCK );
+        if( fd < 0 ) continue;
+        DEBUG("stopping warm worker %s", ctl.c_str());
+        write( fd, "quit\n", 5 );
+        close( fd );
+    }
+    closedir(d);
+
+    // if the workers have already gone
+    rmdir( base.c_str() );
+}
+
+// the worker outlives this task: it gets its own session + cgroup
+static int
+spawn_warm(const char *prog, const char *dir, int maxtask){
+    char nbuf[32];
+
+    snprintf(nbuf, sizeof(nbuf), "%d", maxtask);
+
+    int pid = fork();
+    if( pid == -1 ){
+        VERBOSE("cannot fork: %s", strerror(errno));
+        return -1;
+    }
+
+    // parent => done
+    if( pid ) return pid;
+
+    // child
+    setsid();
+    cgroup_leave();
+
+    int fd = open("/dev/null", O_RDWR);
+    dup2( fd, 0 );
+    dup2( fd, 1 );
+    dup2( fd, 2 );
+    dup2( fd, 3 );
+    for(int i=4; i<256; i++) close(i);
+
+    setenv( "MRQUINCY_WARM",    dir,  1 );
+    setenv( "MRQUINCY_WARMMAX", nbuf, 1 );
+
+    // make sure we are not running as root
+    setregid(65535, 65535);
+    setreuid(65535, 65535);
+
+    signal( SIGPIPE, SIG_DFL );
+
+    execl(prog, prog, (char*)0);
+    _exit(-1);
+}
+
+/****************************************************************/
+
+// reduce input arrives sorted, one record per line: [key,value]
+// instead of the program parsing every line to find where the keys
+// change, we send:
+//   K key
+//   value
+//   value
+//   ...
+//   E
+// and enforce limits on the size of a group
+
+static void
+frame_groups(int maxcount, long long maxsize){
+    char *line   = 0;
+    size_t cap   = 0;
+    bool have    = 0;
+    bool trunc   = 0;
+    int count    = 0;
+    long long size = 0;
+    string key;
+    int l;
+
+    setvbuf(stdout, 0, _IOFBF, 65536);
+
+    while( (l = getline(&line, &cap, stdin)) > 0 ){
+        const char *k, *v;
+        int kl, vl;
+
+        // never drop data quietly, fail the task
+        if( !split_record(line, l, &k, &kl, &v, &vl) ){
+            fprintf(stderr, "invalid record: %.*s\n", (l > 100 ? 100 : l), line);
+            fflush(stdout);
+            _exit(FRAMEBADREC);
+        }
+
+        // new key?
+        if( !have || kl != key.size() || memcmp(k, key.data(), kl) ){
+            if( have ) fputs("E\n", stdout);
+            fputs("K ", stdout);
+            fwrite(k, 1, kl, stdout);
+            fputc('\n', stdout);
+
+            key.assign(k, kl);
+            have  = 1;
+            trunc = 0;
+            count = 0;
+            size  = 0;
+        }
+
+        count ++;
+        size += vl;
+
+        if( (maxcount && count > maxcount) || (maxsize && size > maxsize) ){
+            if( !trunc ) fprintf(stderr, "too many values for key %.*s, truncated\n", (kl > 100 ? 100 : kl), k);
+            trunc = 1;
+            continue;
+        }
+
+        if( vl )
+            fwrite(v, 1, vl, stdout);
+        else
+            fputs("null", stdout);
+        fputc('\n', stdout);
+    }
+
+    if( have ) fputs("E\n", stdout);
+    fflush(stdout);
+}
+
+static int
+spawn_framer(const ACPMRMTaskCreate *g, int fin, int fout, int ferr){
+
+    int pid = fork();
+    if( pid == -1 ) _fail("fork failed");
+
+    // parent => done
+    if( pid ) return pid;
+
+    // child
+    dup2( fin,  0 );
+    dup2( fout, 1 );
+    dup2( ferr, 2 );
+    for(int i=3; i<256; i++) close(i);
+
+    setregid(65535, 65535);
+    setreuid(65535, 65535);
+
+    signal( SIGPIPE, SIG_DFL );
+
+    frame_groups( g->group_max(), g->group_maxsize() );
+    _exit(0);
+}
+
+/****************************************************************/
 
 static int
 spawn(const char *prog, const ACPMRMTaskCreate *g, int fin, int fout, int ferr, int fdat, bool issort){
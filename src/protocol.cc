@@ -41,11 +41,15 @@
 #include <sys/loadavg.h>
 #include <sys/sendfile.h>
 #include <strings.h>
+#include "zlib.h"
+
+#define COMPRESSMIN	16384		// compress requests larger than this
 
 extern int udp4_fd, udp6_fd;
 
 
-static int
+// "ipaddr:port"
+int
 parse_addr(const char *addr, NetAddr *na){
     struct in_addr a;
     char buf[64];
@@ -68,6 +72,24 @@ parse_addr(const char *addr, NetAddr *na){
     return 1;
 }
 
+// 4 byte length (network order), then zlib (which checksums it too)
+// 0 => not compressed, send it as is
+static int
+compress_data(string *data){
+    uLongf zlen = compressBound( data->size() );
+    string z;
+
+    z.resize( 4 + zlen );
+    uint32_t len = htonl( data->size() );
+    memcpy( &z[0], &len, 4 );
+
+    int r = compress2( (Bytef*) &z[4], &zlen, (const Bytef*) data->data(), data->size(), Z_DEFAULT_COMPRESSION );
+    if( r != Z_OK || 4 + zlen >= data->size() ) return 0;
+
+    z.resize( 4 + zlen );
+    data->swap( z );
+    return 1;
+}
 
 int
 write_request(NTD *ntd, int reqno, google::protobuf::Message *g, int contlen, int to){
@@ -75,12 +97,16 @@ write_request(NTD *ntd, int reqno, google::protobuf::Message *g, int contlen, in
 
     string gout;
     g->SerializeToString( &gout );
-    int gsz = gout.length();
     DEBUG("send %s", g->ShortDebugString().c_str());
 
+    int flags = PHFLAG_WANTREPLY;
+    if( config->net_compress && gout.length() > COMPRESSMIN && compress_data(&gout) )
+        flags |= PHFLAGS_DATA_GZIP;
+    int gsz = gout.length();
+
     pho->version        = PHVERSION;
     pho->type           = reqno;
-    pho->flags          = PHFLAG_WANTREPLY;
+    pho->flags          = flags;
     pho->msgidno        = random_n(0xFFFFFFFF);
     pho->auth_length    = 0;
     pho->content_length = contlen;
@@ -101,13 +127,24 @@ write_request(NTD *ntd, int reqno, google::protobuf::Message *g, int contlen, in
 int
 write_reply(NTD *ntd, google::protobuf::Message *g, int contlen, int to){
     protocol_header *phi = (protocol_header*) ntd->gpbuf_in;
-    protocol_header *pho = (protocol_header*) ntd->gpbuf_out;
 
     if( !(phi->flags & PHFLAG_WANTREPLY) ) return 0;
 
     string gout;
     g->SerializeToString( &gout );
-    int gsz = gout.length();
+
+    return write_reply_data(ntd, &gout, contlen, to);
+}
+
+// reply with an already serialized message
+int
+write_reply_data(NTD *ntd, const string *gout, int contlen, int to){
+    protocol_header *phi = (protocol_header*) ntd->gpbuf_in;
+    protocol_header *pho = (protocol_header*) ntd->gpbuf_out;
+
+    if( !(phi->flags & PHFLAG_WANTREPLY) ) return 0;
+
+    int gsz = gout->length();
 
     ntd_copy_header_for_reply(ntd);
     pho->flags          = PHFLAG_ISREPLY;
@@ -122,7 +159,7 @@ write_reply(NTD *ntd, google::protobuf::Message *g, int contlen, int to){
     if( i != sizeof(protocol_header) ) return -1;
 
     // send data
-    i = write_to(ntd->fd, gout.c_str(), gsz, to);
+    i = write_to(ntd->fd, gout->data(), gsz, to);
     if( i != gsz ) return -1;
 
     return sizeof(protocol_header) + gsz;
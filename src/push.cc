@@ -0,0 +1,252 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Aug-06 15:22 (EDT)
+  Function: push map output to the consumers, as it is written
+
+*/
+
+#define CURRENT_SUBSYSTEM	'i'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "network.h"
+#include "thread.h"
+#include "lock.h"
+#include "push.h"
+
+#include "mrmagoo.pb.h"
+#include "scrible.pb.h"
+
+#include <unistd.h>
+#include <string.h>
+
+
+#define TIMEOUT		15
+#define PUSHQMAX	(32 * 1024 * 1024)	// the map waits if more than this is unsent
+
+
+// with push enabled (job option), the master tells the map where each
+// outfile's consumer is running (pushto). the blocks are sent there as
+// they are written (see PushMapOutput), overlapping the shuffle with the
+// map, and saving reading the file back + sending it afterwards.
+//
+// the file is still written here too - it is the copy used if the consumer
+// has to be rerun elsewhere. anything that cannot be pushed (old server,
+// connection fails, ...) is left to the usual xfer.
+
+static void *push_thread(void*);
+
+
+MapPusher::MapPusher(const ACPMRMTaskCreate *g){
+
+    _source  = g->taskid();
+    _qsize   = 0;
+    _nthread = 0;
+    _closing = 0;
+
+    int nfile = g->outfile_size();
+    _dest.resize(  nfile, -1 );
+    _state.resize( nfile, PUSH_FAILED );
+    _size.resize(  nfile, 0 );
+    _hash.resize(  nfile, 0 );
+
+    for(int i=0; i<nfile; i++){
+        _file.push_back( g->outfile(i) );
+
+        if( i >= g->pushto_size() || g->pushto(i).empty() ) continue;
+
+        // one connection per server, shared by its files
+        int d;
+        for(d=0; d<_dests.size(); d++){
+            if( ! _dests[d]->addr.compare( g->pushto(i) ) ) break;
+        }
+        if( d == _dests.size() ){
+            PushDest *pd = new PushDest;
+            pd->pusher   = this;
+            pd->addr     = g->pushto(i);
+            _dests.push_back( pd );
+        }
+
+        _dest[i]  = d;
+        _state[i] = PUSH_SENDING;
+        _hash[i]  = new HashSHA1;
+    }
+}
+
+MapPusher::~MapPusher(){
+
+    for(int i=0; i<_hash.size(); i++)  delete _hash[i];
+    for(int i=0; i<_dests.size(); i++) delete _dests[i];
+}
+
+// a block (a complete gzip member) of file i, in order
+void
+MapPusher::send(int i, const char *buf, int len, bool last){
+
+    // a push thread may have failed it
+    _lock.lock();
+    int state = _state[i];
+    _lock.unlock();
+    if( state != PUSH_SENDING ) return;
+
+    PushBlock *b = new PushBlock;
+    b->file = i;
+    b->off  = _size[i];
+    b->last = last;
+    b->data.assign(buf, len);
+
+    _size[i] += len;
+    _hash[i]->update(buf, len);
+    if( last ){
+        char hash[64];
+        _hash[i]->digest64(hash, sizeof(hash));
+        b->hash.assign( hash );
+    }
+
+    PushDest *d = _dests[ _dest[i] ];
+
+    _lock.lock();
+
+    // do not get too far ahead of the network
+    while( _qsize > PUSHQMAX && !d->failed ) _cond.wait( &_lock );
+
+    if( d->failed ){
+        _state[i] = PUSH_FAILED;
+        _lock.unlock();
+        delete b;
+        return;
+    }
+
+    d->queue.push_back( b );
+    _qsize += len;
+
+    if( !d->running ){
+        d->running = 1;
+        _nthread ++;
+        if( start_thread(push_thread, (void*)d) ){
+            d->running = 0;
+            d->failed  = 1;
+            _nthread --;
+        }
+    }
+
+    _cond.broadcast();
+    _lock.unlock();
+}
+
+// wait until everything is sent
+void
+MapPusher::finish(void){
+
+    _lock.lock();
+    _closing = 1;
+    _cond.broadcast();
+    while( _nthread ) _cond.wait( &_lock );
+
+    for(int i=0; i<_file.size(); i++){
+        if( _state[i] == PUSH_SENDING ) _state[i] = PUSH_FAILED;
+    }
+    _lock.unlock();
+
+    for(int d=0; d<_dests.size(); d++){
+        if( _dests[d]->fd != -1 ) close( _dests[d]->fd );
+        _dests[d]->fd = -1;
+    }
+}
+
+static void *
+push_thread(void *x){
+    PushDest *d = (PushDest*)x;
+
+    d->pusher->run(d);
+    return 0;
+}
+
+void
+MapPusher::run(PushDest *d){
+
+    _lock.lock();
+
+    while(1){
+        while( d->queue.empty() && !_closing ) _cond.wait( &_lock );
+        if( d->queue.empty() ) break;
+
+        PushBlock *b = d->queue.front();
+        d->queue.pop_front();
+        bool skip = d->failed || _state[b->file] != PUSH_SENDING;
+        _lock.unlock();
+
+        int ok = skip ? 0 : _send(d, b);
+
+        _lock.lock();
+        _qsize -= b->data.size();
+        if( !ok ){
+            _state[ b->file ] = PUSH_FAILED;
+        }else if( b->last ){
+            _state[ b->file ] = PUSH_DONE;
+        }
+        delete b;
+        _cond.broadcast();
+    }
+
+    d->running = 0;
+    _nthread --;
+    _cond.broadcast();
+    _lock.unlock();
+}
+
+// send a block, wait for the reply. 0 => failed
+// any failure, and the receiver drops the connection (and the unfinished files)
+int
+MapPusher::_send(PushDest *d, PushBlock *b){
+    NTD ntd;
+    protocol_header *phi = (protocol_header*) ntd.gpbuf_in;
+    ACPScriblRequest req;
+    ACPScriblReply   res;
+    NetAddr na;
+
+    if( d->fd == -1 ){
+        if( !parse_addr( d->addr.c_str(), &na ) ){
+            VERBOSE("invalid push address %s", d->addr.c_str());
+            d->failed = 1;
+            return 0;
+        }
+        d->fd = tcp_connect( &na, TIMEOUT );
+        if( d->fd < 0 ){
+            VERBOSE("cannot push to %s", d->addr.c_str());
+            d->failed = 1;
+            return 0;
+        }
+    }
+
+    req.set_filename( _file[ b->file ].c_str() );
+    req.set_offset( b->off );
+    req.set_source( _source.c_str() );
+    if( b->last ){
+        req.set_length( b->off + b->data.size() );
+        req.set_hash_sha1( b->hash.c_str() );
+    }
+
+    ntd.fd = d->fd;
+    int len = b->data.size();
+    int s = write_request(&ntd, PHMT_MR_PUSH, &req, len, TIMEOUT);
+    if( s > 0 ) s = (write_to(d->fd, b->data.data(), len, TIMEOUT) == len);
+    if( s > 0 ) s = read_proto(&ntd, 0, TIMEOUT);
+
+    if( s > 0 ){
+        res.ParsePartialFromArray( ntd.in_data(), phi->data_length );
+        DEBUG("l=%d, %s", phi->data_length, res.ShortDebugString().c_str());
+        if( res.status_code() == 200 ) return 1;
+        VERBOSE("push %s to %s failed: %s", _file[b->file].c_str(), d->addr.c_str(), res.status_message().c_str());
+    }else{
+        VERBOSE("push %s to %s failed", _file[b->file].c_str(), d->addr.c_str());
+    }
+
+    close( d->fd );
+    d->fd     = -1;
+    d->failed = 1;
+    return 0;
+}
@@ -19,23 +19,158 @@
 
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "mrmagoo.pb.h"
 #include "std_reply.pb.h"
 
 #define MINSTATUS	5
+#define STATUSBATCHMAX	(UDPMAXSIZE - 1024)
+#define MAXDISPATCH	5	// recheck at least this often, even if nobody wakes us
+
+
+// queued elems are indexed by id (dupes, abort), and by elem (done)
+// each fair share group keeps its queued elems in a heap, by priority
+// so starting, finishing, and aborting do not scan the whole queue
+//
+// a dispatch thread starts queued elems as soon as a slot frees up
+// the periodic threads only send statuses
+
+
+void
+QueueGroup::_set(int i, QueueElem *e){
+    _heap[i] = e;
+    e->_heappos = i;
+}
 
+void
+QueueGroup::_up(int i){
+    QueueElem *e = _heap[i];
+
+    while( i > 0 ){
+        int p = (i - 1) / 2;
+        if( !QueueElem::before(e, _heap[p]) ) break;
+        _set(i, _heap[p]);
+        i = p;
+    }
+    _set(i, e);
+}
+
+void
+QueueGroup::_down(int i){
+    QueueElem *e = _heap[i];
+    int n = _heap.size();
+
+    while( 1 ){
+        int c = 2 * i + 1;
+        if( c >= n ) break;
+        if( c + 1 < n && QueueElem::before(_heap[c+1], _heap[c]) ) c ++;
+        if( !QueueElem::before(_heap[c], e) ) break;
+        _set(i, _heap[c]);
+        i = c;
+    }
+    _set(i, e);
+}
+
+void
+QueueGroup::push(QueueElem *e){
+    _heap.push_back(e);
+    _up( _heap.size() - 1 );
+}
+
+void
+QueueGroup::remove(QueueElem *e){
+    int i = e->_heappos;
+    QueueElem *last = _heap.back();
+
+    _heap.pop_back();
+    e->_heappos = -1;
+    if( last == e ) return;
+
+    _set(i, last);
+    _up(i);
+    _down( last->_heappos );
+}
+
+/****************************************************************/
 
 int
 Queued::nrunning(void){
     _lock.r_lock();
-    int n = _running.size();
+    int n = _nrunning;
     _lock.r_unlock();
     return n;
 }
 
+QueueElem *
+Queued::_find_x(const char *id){
+
+    unordered_map<string,QueueElem*>::iterator it = _index.find(id);
+    if( it == _index.end() ) return 0;
+    return it->second;
+}
+
+QueueGroup *
+Queued::_group_x(const QueueElem *e){
+
+    QueueGroup *q = _groups[ e->_group ];
+    if( !q ){
+        q = new QueueGroup;
+        _groups[ e->_group ] = q;
+    }
+    q->_weight = e->_weight;
+    return q;
+}
 
 void
-Queued::start_or_queue(void *g, const char *id, int prio, int max){
+Queued::_run_x(QueueElem *e){
+
+    _running.push_back(e);
+    e->_runpos = -- _running.end();
+    _group_x(e)->_nrunning ++;
+    _nrunning ++;
+    start( e->_elem );
+}
+
+// remove from everywhere (queued or running)
+void
+Queued::_remove_x(QueueElem *e){
+    map<string,QueueGroup*>::iterator git = _groups.find( e->_group );
+    QueueGroup *q = (git == _groups.end()) ? 0 : git->second;
+
+    if( e->_heappos >= 0 ){
+        if( q ) q->remove(e);
+        _nqueued --;
+    }else{
+        _running.erase( e->_runpos );
+        if( q ) q->_nrunning --;
+        _nrunning --;
+    }
+
+    // nothing left in the group? discard
+    if( q && !q->_nrunning && q->_heap.empty() ){
+        _groups.erase(git);
+        delete q;
+    }
+
+    _index.erase( e->_id );
+    _byelem.erase( e->_elem );
+}
+
+// all of the queued elems, in priority order
+void
+Queued::_queued_x(vector<QueueElem*> *dst){
+
+    dst->reserve( _nqueued );
+    for(map<string,QueueGroup*>::iterator it=_groups.begin(); it != _groups.end(); it++){
+        QueueGroup *q = it->second;
+        dst->insert( dst->end(), q->_heap.begin(), q->_heap.end() );
+    }
+    std::sort( dst->begin(), dst->end(), QueueElem::before );
+}
+
+void
+Queued::start_or_queue(void *g, const char *id, int prio, int max, const string *group, int weight){
 
     _lock.w_lock();
 
@@ -47,56 +182,43 @@ Queued::start_or_queue(void *g, const char *id, int prio, int max){
 
     QueueElem *e = new QueueElem(g, id, prio);
     e->_last_status = lr_now() - random_n(MINSTATUS);
+    e->_seq = _seq ++;
+    if( group ) e->_group.assign( *group );
+    if( weight > 0 ) e->_weight = weight;
 
-    if( _running.size() >= max ){
+    _index[ e->_id ] = e;
+    _byelem[ g ]     = e;
 
-        // insert in priority order
-        list<QueueElem*>::iterator it;
-        for(it=_queue.begin(); it != _queue.end(); it++){
-            QueueElem *c = *it;
-            if( c->_prio > prio ) break;
-        }
-        _queue.insert(it, e);
+    bool queued = _nrunning >= max;
 
+    if( queued ){
+        _group_x(e)->push(e);
+        _nqueued ++;
     }else{
-        _running.push_back(e);
-        start(g);
+        _run_x(e);
     }
     _lock.w_unlock();
+
+    // something may have finished while we were busy
+    if( queued ) wakeup();
 }
 
 bool
 Queued::is_dupe(const char *id){
-    bool dupe = 0;
-
-    for(list<QueueElem*>::iterator it=_queue.begin(); it != _queue.end(); it++){
-        QueueElem *e = *it;
-        if( e->_id == id ){
-            dupe = 1;
-            break;
-        }
-    }
-    for(list<QueueElem*>::iterator it=_running.begin(); it != _running.end(); it++){
-        QueueElem *e = *it;
-        if( e->_id == id ){
-            dupe = 1;
-            break;
-        }
-    }
-
-    return dupe;
+    return _find_x(id) != 0;
 }
 
 void
 Queued::json(string *dst){
     int n = 0;
+    vector<QueueElem*> queued;
 
     dst->append("[");
 
     _lock.r_lock();
-    for(list<QueueElem*>::iterator it=_queue.begin(); it != _queue.end(); it++){
-        QueueElem *e = *it;
-        void *x = e->_elem;
+    _queued_x( &queued );
+    for(int i=0; i<queued.size(); i++){
+        void *x = queued[i]->_elem;
         if( n++ ) dst->append(",\n    ");
         json1("queued", x, dst);
     }
@@ -115,36 +237,25 @@ Queued::json(string *dst){
 void
 Queued::abort(const char *id){
 
-    QueueElem *found = 0;
-
     _lock.w_lock();
 
-    for(list<QueueElem*>::iterator it=_queue.begin(); it != _queue.end(); it++){
-        QueueElem *e = *it;
-        if( e->_id == id ){
-            found = e;
-            break;
-        }
-    }
+    QueueElem *found = _find_x(id);
+    bool freed = found != 0;
+
     if( found ){
-        _queue.remove(found);
-        _abort_q( found->_elem );
-        delete found;
-    }else{
-        for(list<QueueElem*>::iterator it=_running.begin(); it != _running.end(); it++){
-            QueueElem *e = *it;
-            if( e->_id == id ){
-                found = e;
-                break;
-            }
-        }
-        if( found ){
-            _running.remove(found);
+        bool queued = found->_heappos >= 0;
+        _remove_x(found);
+
+        if( queued )
+            _abort_q( found->_elem );
+        else
             _abort_r( found->_elem );
-        }
+        delete found;
     }
 
     _lock.w_unlock();
+
+    if( freed ) wakeup();
 }
 
 // system is shutting down - kill running tasks, drain the queue
@@ -153,18 +264,28 @@ Queued::shutdown(void){
 
     _lock.w_lock();
 
-    for(list<QueueElem*>::iterator it=_queue.begin(); it != _queue.end(); it++){
-        QueueElem *e = *it;
-        _abort_q( e->_elem );
-        delete e;
+    for(map<string,QueueGroup*>::iterator it=_groups.begin(); it != _groups.end(); it++){
+        QueueGroup *q = it->second;
+        for(int i=0; i<q->_heap.size(); i++){
+            QueueElem *e = q->_heap[i];
+            _abort_q( e->_elem );
+            delete e;
+        }
+        delete q;
     }
-    _queue.clear();
+    _groups.clear();
+    _nqueued = 0;
 
     for(list<QueueElem*>::iterator it=_running.begin(); it != _running.end(); it++){
         QueueElem *e = *it;
         _abort_r( e->_elem );
+        delete e;
     }
     _running.clear();
+    _nrunning = 0;
+
+    _index.clear();
+    _byelem.clear();
 
     _lock.w_unlock();
 }
@@ -174,53 +295,172 @@ Queued::done(void *g){
 
     _lock.w_lock();
 
-    // find + remove
-    for(list<QueueElem*>::iterator it=_running.begin(); it != _running.end(); it++){
-        QueueElem *e = *it;
-        if( e->_elem == g ){
-            _running.remove(e);
-            delete e;
-            break;
-        }
+    unordered_map<void*,QueueElem*>::iterator it = _byelem.find(g);
+    bool found = it != _byelem.end();
+
+    if( found ){
+        QueueElem *e = it->second;
+        _remove_x(e);
+        delete e;
     }
 
     _lock.w_unlock();
+
+    // start another one
+    if( found ) wakeup();
+}
+
+// the slots are divided among the groups, by weight.
+// start the next one from the group furthest below its share
+// (the best within the group is at the top of its heap)
+QueueElem *
+Queued::_next_x(void){
+    QueueGroup *best = 0;
+    float bestr = 0;
+
+    for(map<string,QueueGroup*>::iterator it=_groups.begin(); it != _groups.end(); it++){
+        QueueGroup *q = it->second;
+        if( q->_heap.empty() ) continue;
+
+        float r = q->_nrunning / (float)q->_weight;
+
+        if( !best || r < bestr || (r == bestr && QueueElem::before(q->top(), best->top())) ){
+            best  = q;
+            bestr = r;
+        }
+    }
+
+    if( !best ) return 0;
+
+    QueueElem *e = best->top();
+    best->remove(e);
+    _nqueued --;
+    return e;
+}
+
+// how much is each group using?
+void
+Queued::share_status(ACPMRMStatus *g){
+
+    _lock.r_lock();
+
+    for(map<string,QueueGroup*>::iterator it=_groups.begin(); it != _groups.end(); it++){
+        QueueGroup *q = it->second;
+        ACPMRMShareUse *u = g->add_share();
+
+        u->set_group( it->first.c_str() );
+        u->set_weight( q->_weight );
+        u->set_running( q->_nrunning );
+        u->set_queued( q->_heap.size() );
+    }
+
+    _lock.r_unlock();
 }
 
 void
 Queued::start_more(int max){
 
     _lock.w_lock();
-    while( 1 ){
-        if( _queue.empty() ) break;
-        if( _running.size() >= max ) break;
-
-        QueueElem *e = _queue.front();
-        void *g = e->_elem;
-        _queue.pop_front();
-        _running.push_back(e);
-        start(g);
+    while( _nqueued && _nrunning < max ){
+        QueueElem *e = _next_x();
+        if( !e ) break;
+        _run_x(e);
     }
     _lock.w_unlock();
+}
+
+// one udp packet per master, (or a few, if there are very many)
+static void
+send_batch(const string *master, const ACPMRMActionStatusBatch *all){
+    ACPMRMActionStatusBatch b;
+    int size = 0;
+
+    for(int i=0; i<all->status_size(); i++){
+        const ACPMRMActionStatus *st = & all->status(i);
+        int sz = st->ByteSizeLong() + 8;
+
+        if( size && size + sz > STATUSBATCHMAX ){
+            toss_request( udp4_fd, master->c_str(), PHMT_MR_STATUSBATCH, &b );
+            b.Clear();
+            size = 0;
+        }
+        b.add_status()->CopyFrom( *st );
+        size += sz;
+    }
+
+    if( size ) toss_request( udp4_fd, master->c_str(), PHMT_MR_STATUSBATCH, &b );
+}
+
+void
+Queued::_status_x(QueueElem *e, hrtime_t old, map<string,ACPMRMActionStatusBatch> *batch){
+    ACPMRMActionStatus st;
+
+    if( e->_last_status > old ) return;
+
+    const string *master = status1( e->_elem, &st );
+    if( !master ) return;
+
+    (*batch)[ *master ].add_status()->CopyFrom( st );
+}
 
-    // send statuses
+void
+Queued::send_statuses(void){
     hrtime_t old = lr_now() - MINSTATUS;
+    map<string,ACPMRMActionStatusBatch> batch;	// by master
 
     _lock.r_lock();
-    for(list<QueueElem*>::iterator it=_queue.begin(); it != _queue.end(); it++){
-        QueueElem *e = *it;
-        void *g = e->_elem;
-        if( e->_last_status > old ) continue;
-        send_status(g);
-        usleep( 1000 );
+    for(map<string,QueueGroup*>::iterator it=_groups.begin(); it != _groups.end(); it++){
+        QueueGroup *q = it->second;
+        for(int i=0; i<q->_heap.size(); i++){
+            _status_x( q->_heap[i], old, &batch );
+        }
     }
     for(list<QueueElem*>::iterator it=_running.begin(); it != _running.end(); it++){
-        QueueElem *e = *it;
-        void *g = e->_elem;
-        if( e->_last_status > old ) continue;
-        send_status(g);
-        usleep( 1000 );
+        _status_x( *it, old, &batch );
     }
     _lock.r_unlock();
+
+    // send them without holding the lock
+    for(map<string,ACPMRMActionStatusBatch>::iterator it=batch.begin(); it != batch.end(); it++){
+        DEBUG("sending %d statuses to %s", it->second.status_size(), it->first.c_str());
+        send_batch( &it->first, &it->second );
+    }
+}
+
+/****************************************************************/
+
+// a slot freed up, or new work arrived
+void
+Queued::wakeup(void){
+
+    _wakelock.lock();
+    _kick = 1;
+    _wake.signal();
+    _wakelock.unlock();
+}
+
+void
+Queued::dispatch(void){
+
+    while(1){
+        _wakelock.lock();
+        if( !_kick ) _wake.timedwait( &_wakelock, MAXDISPATCH );
+        _kick = 0;
+        _wakelock.unlock();
+
+        start_more( max_running() );
+    }
 }
 
+static void *
+queued_dispatch(void *x){
+    Queued *q = (Queued*)x;
+
+    q->dispatch();
+    return 0;
+}
+
+void
+Queued::start_dispatch(void){
+    start_thread(queued_dispatch, (void*)this);
+}
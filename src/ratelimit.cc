@@ -0,0 +1,127 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Aug-04 12:10 (EDT)
+  Function: limit file transfer bandwidth
+
+*/
+
+#define CURRENT_SUBSYSTEM	'x'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "lock.h"
+#include "hrtime.h"
+#include "ratelimit.h"
+
+#include <unistd.h>
+
+#include <map>
+using std::map;
+
+
+#define BURSTTIME	4	// may save up 1/4 sec worth of tokens
+
+
+// token buckets, config (MB/s):
+//   xfernetrate   - everything we send (scriblr_get)
+//   xferdiskrate  - everything we receive (xfers, scriblr_put)
+//   xferjobrate   - what we receive, for each job
+//
+// senders + receivers take tokens as the bytes move, and sleep when the
+// bucket is empty. the shuffle then runs at a steady rate, instead of
+// swamping the network + disks and starving the running tasks.
+
+TokenBucket xfer_net_tb;
+TokenBucket xfer_disk_tb;
+
+static Mutex                      job_lock;
+static map<string, TokenBucket*>  job_tb;
+
+
+void
+TokenBucket::set_rate(long long rate){
+
+    _lock.lock();
+    _rate = rate;
+    _lock.unlock();
+}
+
+// reserve n bytes, wait until they are paid for
+void
+TokenBucket::take(long long n){
+
+    if( !_rate ) return;
+
+    _lock.lock();
+    hrtime_t now = hr_now();
+
+    if( !_rate ){
+        _lock.unlock();
+        return;
+    }
+
+    _tokens += (double)(now - _last) * _rate / ONE_SECOND_HR;
+    if( _tokens > _rate / BURSTTIME ) _tokens = _rate / BURSTTIME;
+    _last    = now;
+    _tokens -= n;
+
+    // later takers wait behind us
+    long long wait = (_tokens < 0) ? (long long)(- _tokens * 1000000 / _rate) : 0;
+    _lock.unlock();
+
+    if( wait ) usleep( wait );
+}
+
+// config may have changed
+void
+ratelimit_update(void){
+
+    xfer_net_tb.set_rate(  config->xfer_net_rate  * 1048576LL );
+    xfer_disk_tb.set_rate( config->xfer_disk_rate * 1048576LL );
+
+    job_lock.lock();
+    for(map<string, TokenBucket*>::iterator it=job_tb.begin(); it != job_tb.end(); it++){
+        it->second->set_rate( config->xfer_job_rate * 1048576LL );
+    }
+    job_lock.unlock();
+}
+
+// shared by all of the job's xfers
+TokenBucket *
+ratelimit_job(const string *jobid){
+
+    job_lock.lock();
+    TokenBucket *tb = job_tb[ *jobid ];
+
+    if( !tb ){
+        tb = new TokenBucket;
+        tb->set_rate( config->xfer_job_rate * 1048576LL );
+        job_tb[ *jobid ] = tb;
+    }
+    tb->_refs ++;
+    job_lock.unlock();
+
+    return tb;
+}
+
+void
+ratelimit_job_done(TokenBucket *tb){
+
+    job_lock.lock();
+    if( -- tb->_refs ){
+        job_lock.unlock();
+        return;
+    }
+
+    for(map<string, TokenBucket*>::iterator it=job_tb.begin(); it != job_tb.end(); it++){
+        if( it->second != tb ) continue;
+        job_tb.erase(it);
+        break;
+    }
+    job_lock.unlock();
+
+    delete tb;
+}
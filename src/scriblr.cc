@@ -13,7 +13,9 @@
 #include "config.h"
 #include "misc.h"
 #include "network.h"
+#include "thread.h"
 #include "crypto.h"
+#include "ratelimit.h"
 
 #include "std_reply.pb.h"
 #include "scrible.pb.h"
@@ -25,8 +27,25 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+
+#include <vector>
+#include <map>
+using std::vector;
+using std::map;
 
 #define TIMEOUT		15
+#define PARTSUFFIX	".part"
+#define PUSHSUFFIX	".push."
+#define PUSHIDLE	120		// close an idle push connection
+#define PUSHMAXCONN	256
+
+extern void jobsrc_served(const string *);
+
+
+// unfinished files are kept, so a transfer can resume where it left off
+//   file.tmp       - the data
+//   file.tmp.part  - what it will be (key), then the verified ranges: offset length
 
 
 static int
@@ -51,8 +70,27 @@ file_hash(const char *file, char *buf, int len){
     h.digest64(buf, len);
 }
 
+// hash part of the file
+static int
+range_hash(int fd, long long off, int size, char *buf, int len){
+    HashSHA1 h;
+    char data[8192];
+
+    while( size > 0 ){
+        int s = size > sizeof(data) ? sizeof(data) : size;
+        int r = pread(fd, data, s, off);
+        if( r < 1 ) return 0;
+        h.update(data, r);
+        off  += r;
+        size -= r;
+    }
+
+    h.digest64(buf, len);
+    return 1;
+}
+
 static int
-reply(NTD *ntd, int code, const char *msg, const char *hash){
+reply(NTD *ntd, int code, const char *msg, const char *hash, long long fsize=-1, long long psize=-1){
     protocol_header *phi = (protocol_header*) ntd->gpbuf_in;
     protocol_header *pho = (protocol_header*) ntd->gpbuf_out;
     ACPScriblReply g;
@@ -70,6 +108,8 @@ reply(NTD *ntd, int code, const char *msg, const char *hash){
     g.set_status_code( code );
     g.set_status_message( msg );
     if( hash && hash[0] ) g.set_hash_sha1( hash );
+    if( fsize >= 0 ) g.set_file_size( fsize );
+    if( psize >= 0 ) g.set_partial_size( psize );
     g.SerializeToArray( ntd->out_data(), ntd->data_size() );
     pho->data_length = g.GetCachedSize();
 
@@ -107,41 +147,211 @@ parse_and_validate(NTD *ntd, ACPScriblRequest *req){
     return 0;
 }
 
-// for scriblr_put + file xfer
+/****************************************************************/
+
+static void
+part_name(const string *tmp, string *part){
+    part->assign( *tmp );
+    part->append( PARTSUFFIX );
+}
+
+// the verified ranges, if the partial file is for the same thing. 0 => it isn't
+static int
+part_read(const string *tmp, const string *key, vector<long long> *done){
+    string part;
+    char buf[256];
+    long long o, l;
+
+    done->clear();
+    part_name(tmp, &part);
+
+    FILE *f = fopen( part.c_str(), "r" );
+    if( !f ) return 0;
+
+    if( !fgets(buf, sizeof(buf), f) || strncmp(buf, key->c_str(), key->size()) || buf[key->size()] != '\n' ){
+        fclose(f);
+        return 0;
+    }
+
+    while( fgets(buf, sizeof(buf), f) ){
+        if( sscanf(buf, "%lld %lld", &o, &l) != 2 ) continue;
+        done->push_back(o);
+        done->push_back(l);
+    }
+    fclose(f);
+
+    return 1;
+}
+
+// continue with the partial file, or start over. 1 => continuing
+int
+scriblr_part_load(const string *tmp, const string *key, vector<long long> *done){
+    string part;
+
+    if( part_read(tmp, key, done) ) return 1;
+
+    part_name(tmp, &part);
+    FILE *f = fopen( part.c_str(), "w" );
+    if( f ){
+        fprintf(f, "%s\n", key->c_str());
+        fclose(f);
+    }
+
+    return 0;
+}
+
+// this range is in place, and verified
+void
+scriblr_part_add(const string *tmp, long long off, long long len){
+    string part;
+    char buf[64];
+
+    part_name(tmp, &part);
+    int l  = snprintf(buf, sizeof(buf), "%lld %lld\n", off, len);
+    int fd = open( part.c_str(), O_WRONLY | O_APPEND );
+    if( fd < 0 ) return;
+    write(fd, buf, l);
+    close(fd);
+}
+
+void
+scriblr_part_remove(const string *tmp){
+    string part;
+
+    part_name(tmp, &part);
+    unlink( part.c_str() );
+}
+
+// so a resumed xfer can check a kept range against the source
 int
-scriblr_save_file(int fd, const string *filename, int size, string *hash, int to){
+scriblr_range_hash(int fd, long long off, int size, char *buf, int len){
+    return range_hash(fd, off, size, buf, len);
+}
+
+// how much do we have, from the start?
+static long long
+part_prefix(const vector<long long> *done){
+    long long have = 0;
+    bool more = 1;
+
+    while( more ){
+        more = 0;
+        for(int i=0; i<done->size(); i+=2){
+            long long o = (*done)[i], e = o + (*done)[i+1];
+            if( o <= have && e > have ){
+                have = e;
+                more = 1;
+            }
+        }
+    }
+
+    return have;
+}
+
+/****************************************************************/
+
+// create (or reopen) the tmp file, the pieces are written into it
+// file => the final name, once everything arrives
+int
+scriblr_open_tmp(const string *filename, string *file, string *tmp){
 
     if( !validate( filename->c_str() ) ){
         VERBOSE("invalid filename: %s", filename->c_str());
-        return 0;
+        return -1;
     }
 
-    // file -> dir, file
-    string file = config->basedir;
-    file.append("/");
-    file.append( *filename );
-    DEBUG("filename: %s", file.c_str());
+    file->assign( config->basedir );
+    file->append( "/" );
+    file->append( *filename );
 
-    // create dirs
-    int lsl = file.rfind('/');
-    string dir;
+    int lsl = file->rfind('/');
     if( lsl != -1 ){
-        dir.append(file, 0, lsl);
+        string dir( *file, 0, lsl );
         mkdirp( dir.c_str(), 0777 );
     }
-    DEBUG("dir: %s", dir.c_str());
 
-    // open tmp file
-    string tmp = file;
-    tmp.append(".tmp");
+    tmp->assign( *file );
+    tmp->append( ".tmp" );
 
-    FILE *f = fopen( tmp.c_str(), "w" );
-    if( !f ){
-        PROBLEM("cannot save file %s: %s", tmp.c_str(), strerror(errno));
+    int fd = open( tmp->c_str(), O_WRONLY | O_CREAT, 0666 );
+    if( fd < 0 )
+        PROBLEM("cannot save file %s: %s", tmp->c_str(), strerror(errno));
+
+    return fd;
+}
+
+// pay for received bytes: all xfers, and the job's
+static void
+recv_take(TokenBucket *jtb, int n){
+
+    xfer_disk_tb.take(n);
+    if( jtb ) jtb->take(n);
+}
+
+// read size bytes from the network, write them at off, and verify
+int
+scriblr_recv_range(int fd, int dst, long long off, int size, const string *hash, TokenBucket *jtb, int to){
+    HashSHA1 h;
+    char buf[8192];
+    int writ = 0, unpaid = 0;
+
+    while( writ != size ){
+        int s = size - writ;
+        if( s > sizeof(buf) ) s = sizeof(buf);
+
+        int r = read_to(fd, buf, s, to);
+        if( r<1 ) break;
+        if( pwrite(dst, buf, r, off + writ) != r ){
+            PROBLEM("cannot write file: %s", strerror(errno));
+            return 0;
+        }
+        h.update(buf, r);
+        writ   += r;
+        unpaid += r;
+
+        if( unpaid >= RATECHUNK ){
+            recv_take(jtb, unpaid);
+            unpaid = 0;
+        }
+    }
+    if( unpaid ) recv_take(jtb, unpaid);
+
+    h.digest64(buf, sizeof(buf));
+
+    if( writ != size || hash->compare(buf) ){
+        VERBOSE("verify failed at %lld, %d %s != %d %s", off, size, hash->c_str(), writ, buf);
         return 0;
     }
 
-    int writ = 0;
+    return 1;
+}
+
+// for scriblr_put
+// the file may arrive in pieces (offset, and length = the whole file), or be
+// resent after a failure. the unfinished file is kept, keyed by its expected hash
+// 1 => done, 2 => waiting for more, 0 => failed
+int
+scriblr_save_file(int fd, const string *filename, long long off, int size, long long total, string *hash, long long *have, int to){
+    string file, tmp;
+    vector<long long> done;
+
+    int dst = scriblr_open_tmp(filename, &file, &tmp);
+    if( dst < 0 ) return 0;
+    DEBUG("filename: %s", file.c_str());
+
+    string key = "put ";
+    key.append( *hash );
+    scriblr_part_load(&tmp, &key, &done);
+    *have = part_prefix(&done);
+
+    // no gaps
+    if( off > *have ){
+        VERBOSE("cannot save %s at %lld, only have %lld", tmp.c_str(), off, *have);
+        close(dst);
+        return 0;
+    }
+
+    int writ = 0, unpaid = 0;
     char buf[8192];
 
     // copy data
@@ -153,22 +363,41 @@ scriblr_save_file(int fd, const string *filename, int size, string *hash, int to
         int r = read_to(fd, buf, s, to);
         DEBUG("read %d -> %d", s, r);
         if( r<1 ) break;
-        fwrite(buf, 1, r, f);
+        if( pwrite(dst, buf, r, off + writ) != r ) break;
 
-        writ += r;
+        writ   += r;
+        unpaid += r;
+
+        if( unpaid >= RATECHUNK ){
+            recv_take(0, unpaid);
+            unpaid = 0;
+        }
     }
-    fclose(f);
+    if( unpaid ) recv_take(0, unpaid);
+
+    if( writ ) scriblr_part_add(&tmp, off, writ);
+    if( off + writ > *have ) *have = off + writ;
+
+    if( writ != size || *have < total ){
+        close(dst);
+        if( writ != size ) VERBOSE("incomplete %s, have %lld of %lld", tmp.c_str(), *have, total);
+        return writ == size ? 2 : 0;
+    }
+
+    ftruncate(dst, total);
+    close(dst);
 
     // verify
     int vfysz  = file_size( tmp.c_str() );
-    if( vfysz > 0 )
+    if( vfysz >= 0 )
         file_hash( tmp.c_str(), buf, sizeof(buf) );
     else
         buf[0] = 0;
 
-    if( vfysz != size || hash->compare(buf) ){
-        VERBOSE("verify failed %s, %d %s != %d %s", tmp.c_str(), size, hash->c_str(), vfysz, buf);
+    if( vfysz != total || hash->compare(buf) ){
+        VERBOSE("verify failed %s, %lld %s != %d %s", tmp.c_str(), total, hash->c_str(), vfysz, buf);
         unlink( tmp.c_str() );
+        scriblr_part_remove( &tmp );
         return 0;
     }
 
@@ -176,6 +405,7 @@ scriblr_save_file(int fd, const string *filename, int size, string *hash, int to
     hash->assign( buf );
 
     rename( tmp.c_str(), file.c_str() );
+    scriblr_part_remove( &tmp );
 
     return 1;
 }
@@ -184,6 +414,7 @@ int
 scriblr_put(NTD *ntd){
     ACPScriblRequest req;
     protocol_header *phi = (protocol_header*) ntd->gpbuf_in;
+    long long have;
 
     if( ! config->enable_scriblr )
         return reply(ntd, 500, "Error (writes off)", 0);
@@ -194,16 +425,250 @@ scriblr_put(NTD *ntd){
     int size = phi->content_length;
     const string *filename = & req.filename();
     string *hash           = req.mutable_hash_sha1();
-    VERBOSE("put file %s size %d", filename->c_str(), size);
+    long long off          = req.has_offset() ? req.offset() : 0;
+    long long total        = req.has_length() ? req.length() : off + size;
+    VERBOSE("put file %s size %d @%lld", filename->c_str(), size, off);
 
-    r = scriblr_save_file(ntd->fd, filename, size, hash, TIMEOUT);
+    r = scriblr_save_file(ntd->fd, filename, off, size, total, hash, &have, TIMEOUT);
 
+    if( r == 2 )
+        return reply(ntd, 200, "Partial", 0, -1, have);
     if( !r )
+        return reply(ntd, 500, "Error", 0, -1, have);
+
+    return reply(ntd, 200, "OK", hash->c_str(), total );
+}
+
+/****************************************************************/
+
+// map output is pushed to us as the map runs (see push.cc), instead of
+// being fetched after it finishes. a connection stays open for the whole
+// map, and carries blocks for each of the files it sends us, in order.
+//   file.push.$source  - until the last block (with the length + hash)
+// then it is verified and renamed. anything unfinished is removed
+// when the connection closes.
+
+class PushFile {
+public:
+    string		_file;
+    string		_tmp;
+    int			_fd;
+    long long		_size;
+    HashSHA1		_hash;
+
+    PushFile(){ _fd = -1; _size = 0; }
+};
+
+class PushConn {
+    map<string, PushFile*>	_files;
+
+    int _fail(NTD *, const char *);
+    PushFile *_open(const ACPScriblRequest *);
+    int _commit(NTD *, PushFile *, const ACPScriblRequest *);
+public:
+    int			_fd;
+    bool		_err;
+
+    PushConn(){ _fd = -1; _err = 0; }
+    ~PushConn();
+    int recv(NTD *);
+};
+
+static int push_nconn = 0;
+
+
+PushConn::~PushConn(){
+
+    for(map<string, PushFile*>::iterator it=_files.begin(); it != _files.end(); it++){
+        PushFile *f = it->second;
+        if( !f ) continue;
+        VERBOSE("discarding unfinished push %s", f->_tmp.c_str());
+        close( f->_fd );
+        unlink( f->_tmp.c_str() );
+        delete f;
+    }
+}
+
+int
+PushConn::_fail(NTD *ntd, const char *msg){
+
+    _err = 1;
+    return reply(ntd, 500, msg, 0);
+}
+
+PushFile *
+PushConn::_open(const ACPScriblRequest *req){
+
+    // the source becomes part of the name
+    if( !req->has_source() || req->source().empty() || req->source().find('/') != string::npos ) return 0;
+
+    PushFile *f = new PushFile;
+    string tmp;
+
+    f->_fd = scriblr_open_tmp( & req->filename(), & f->_file, &tmp );
+    if( f->_fd < 0 ){
+        delete f;
+        return 0;
+    }
+    // not the usual tmp file, other senders may be pushing the same file
+    close( f->_fd );
+    f->_tmp = f->_file;
+    f->_tmp.append( PUSHSUFFIX );
+    f->_tmp.append( req->source() );
+
+    f->_fd = open( f->_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    if( f->_fd < 0 ){
+        PROBLEM("cannot save file %s: %s", f->_tmp.c_str(), strerror(errno));
+        delete f;
+        return 0;
+    }
+
+    return f;
+}
+
+int
+PushConn::_commit(NTD *ntd, PushFile *f, const ACPScriblRequest *req){
+    char buf[64];
+
+    _files.erase( req->filename() );
+    close( f->_fd );
+    f->_hash.digest64(buf, sizeof(buf));
+
+    if( req->length() != f->_size || req->hash_sha1().compare(buf) ){
+        VERBOSE("verify failed %s, %lld %s != %lld %s", f->_tmp.c_str(), req->length(), req->hash_sha1().c_str(), f->_size, buf);
+        unlink( f->_tmp.c_str() );
+        delete f;
+        return _fail(ntd, "Error (verify failed)");
+    }
+
+    if( rename( f->_tmp.c_str(), f->_file.c_str() ) ){
+        PROBLEM("cannot save file %s: %s", f->_file.c_str(), strerror(errno));
+        unlink( f->_tmp.c_str() );
+        delete f;
+        return _fail(ntd, "Error");
+    }
+    DEBUG("pushed %s %lld", f->_file.c_str(), f->_size);
+    delete f;
+
+    return reply(ntd, 200, "OK", buf, req->length());
+}
+
+// one block
+int
+PushConn::recv(NTD *ntd){
+    ACPScriblRequest req;
+    protocol_header *phi = (protocol_header*) ntd->gpbuf_in;
+    char buf[8192];
+
+    int r = parse_and_validate(ntd, &req);
+    if( r ){
+        _err = 1;
+        return r;
+    }
+
+    int size      = phi->content_length;
+    long long off = req.has_offset() ? req.offset() : 0;
+    PushFile *f   = _files[ req.filename() ];
+
+    if( !f ){
+        if( off ) return _fail(ntd, "Error (unknown push)");
+        f = _open(&req);
+        if( !f ) return _fail(ntd, "Error");
+        _files[ req.filename() ] = f;
+    }
+
+    // no gaps, no overlaps
+    if( off != f->_size ) return _fail(ntd, "Invalid Range");
+
+    int writ = 0;
+    while( writ != size ){
+        int s = size - writ;
+        if( s > sizeof(buf) ) s = sizeof(buf);
+
+        int r = read_to(ntd->fd, buf, s, TIMEOUT);
+        if( r<1 ) return _fail(ntd, "Error (read failed)");
+        if( write(f->_fd, buf, r) != r ) return _fail(ntd, "Error (write failed)");
+        f->_hash.update(buf, r);
+        writ += r;
+    }
+    if( writ ) recv_take(0, writ);
+    f->_size += writ;
+
+    if( req.has_length() ) return _commit(ntd, f, &req);
+
+    return reply(ntd, 200, "OK", 0);
+}
+
+// the rest of the connection
+static void *
+push_conn(void *x){
+    PushConn *pc = (PushConn*)x;
+    NTD ntd;
+    protocol_header *phi = (protocol_header*) ntd.gpbuf_in;
+    struct pollfd pf[1];
+
+    ntd.fd     = pc->_fd;
+    ntd.is_tcp = 1;
+
+    while( !pc->_err ){
+        // the map may take a while to produce more
+        pf[0].fd      = pc->_fd;
+        pf[0].events  = POLLIN;
+        pf[0].revents = 0;
+        if( poll( pf, 1, PUSHIDLE * 1000 ) < 1 ) break;
+
+        ntd.have_data = 0;
+        if( read_proto(&ntd, 0, TIMEOUT) < 1 ) break;
+        if( phi->type != PHMT_MR_PUSH ) break;
+
+        int rl = pc->recv(&ntd);
+        if( rl && write_to(ntd.fd, ntd.gpbuf_out, rl, TIMEOUT) != rl ) break;
+    }
+
+    close( pc->_fd );
+    delete pc;
+    ATOMIC_ADD32(push_nconn, -1);
+    return 0;
+}
+
+int
+scriblr_push(NTD *ntd){
+
+    if( ! config->enable_scriblr )
+        return reply(ntd, 500, "Error (writes off)", 0);
+
+    if( push_nconn >= PUSHMAXCONN )
+        return reply(ntd, 503, "Busy", 0);
+
+    PushConn *pc = new PushConn;
+    int r = pc->recv(ntd);
+
+    if( pc->_err ){
+        delete pc;
+        return r;
+    }
+
+    // keep the connection, and give it a thread of its own
+    // (the first reply goes out the usual way, the sender waits for it)
+    pc->_fd = dup( ntd->fd );
+    if( pc->_fd < 0 ){
+        delete pc;
         return reply(ntd, 500, "Error", 0);
+    }
 
-    return reply(ntd, 200, "OK", hash->c_str() );
+    ATOMIC_ADD32(push_nconn, 1);
+    if( start_thread(push_conn, (void*)pc) ){
+        // the sender will find out on the next block
+        close( pc->_fd );
+        delete pc;
+        ATOMIC_ADD32(push_nconn, -1);
+    }
+
+    return r;
 }
 
+/****************************************************************/
+
 int
 scriblr_get(NTD *ntd){
     ACPScriblRequest req;
@@ -226,24 +691,41 @@ scriblr_get(NTD *ntd){
     if( size == -1 )
         return reply(ntd, 404, "File Not Found", 0);
 
-    char buf[64];
-    file_hash( file.c_str(), buf, sizeof(buf) );
-
     int f = open( file.c_str(), O_RDONLY );
 
-    if( !f )
+    if( f < 0 )
+        return reply( ntd, 500, "Error", 0);
+
+    // all or part?
+    long long off = req.has_offset() ? req.offset() : 0;
+    int len = size - off;
+    if( off < 0 || off > size ){
+        close(f);
+        return reply( ntd, 416, "Invalid Range", 0);
+    }
+    if( req.has_length() && req.length() < len ) len = req.length();
+
+    char buf[64];
+    if( !req.has_offset() && !req.has_length() ){
+        file_hash( file.c_str(), buf, sizeof(buf) );
+    }else if( !range_hash( f, off, len, buf, sizeof(buf) ) ){
+        close(f);
         return reply( ntd, 500, "Error", 0);
-    DEBUG("file %s -> %d %s", file.c_str(), size, buf);
+    }
+
+    DEBUG("file %s -> %d @%lld %s", file.c_str(), len, off, buf);
+    jobsrc_served( & req.filename() );
 
     // build reply
     res.set_status_code( 200 );
     res.set_status_message( "OK" );
     res.set_hash_sha1( buf );
+    res.set_file_size( size );
 
-    write_reply(ntd, &res, size, TIMEOUT );
+    write_reply(ntd, &res, len, TIMEOUT );
 
     // stream file -> network
-    sendfile_to(ntd->fd, f, size, TIMEOUT);
+    sendfile_range(ntd->fd, f, off, len, TIMEOUT, &xfer_net_tb);
     close(f);
 
     // caller needs to do nothing
@@ -261,6 +743,12 @@ scriblr_delete_file(const string *filename){
     file.append( *filename );
     DEBUG("filename: %s", file.c_str());
 
+    // and any unfinished copy
+    string tmp = file;
+    tmp.append(".tmp");
+    unlink( tmp.c_str() );
+    scriblr_part_remove( &tmp );
+
     struct stat st;
 
     // already gone?
@@ -311,9 +799,41 @@ scriblr_chk(NTD *ntd){
     file.append( req.filename() );
     int s = file_size( file.c_str() );
 
-    if( s == -1 )
-        return reply(ntd, 500, "Error", 0);
+    if( s != -1 && req.has_length() ){
+        // the hash of a range of it
+        long long off = req.has_offset() ? req.offset() : 0;
+        int len = s - off;
+        if( off < 0 || off > s )
+            return reply(ntd, 416, "Invalid Range", 0);
+        if( req.length() < len ) len = req.length();
+
+        char buf[64];
+        int f = open( file.c_str(), O_RDONLY );
+        if( f < 0 )
+            return reply(ntd, 500, "Error", 0);
+        int ok = range_hash( f, off, len, buf, sizeof(buf) );
+        close(f);
+        if( !ok )
+            return reply(ntd, 500, "Error", 0);
+
+        return reply(ntd, 200, "OK", buf, s);
+    }
 
-    return reply(ntd, 200, "OK", 0);
+    if( s != -1 )
+        return reply(ntd, 200, "OK", 0, s);
+
+    // do we have part of it? (so the sender can resume)
+    if( req.has_hash_sha1() ){
+        vector<long long> done;
+        string tmp = file;
+        string key = "put ";
+        tmp.append(".tmp");
+        key.append( req.hash_sha1() );
+
+        if( part_read(&tmp, &key, &done) )
+            return reply(ntd, 404, "Partial", 0, -1, part_prefix(&done));
+    }
+
+    return reply(ntd, 500, "Error", 0);
 }
 
@@ -21,28 +21,38 @@
 #include "mapio.h"
 #include "euconsole.h"
 #include "pipeline.h"
+#include "cgroup.h"
+#include "native.h"
 
 #include "mrmagoo.pb.h"
 #include "std_reply.pb.h"
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <poll.h>
 #include <sys/socket.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <string.h>
+#include <arpa/inet.h>
 
 #include <sstream>
 using std::ostringstream;
 
 
-#define MAXTASK		(config->hw_cpus ? 3 * config->hw_cpus / 2 : 1)
+#define MAXTASK		capacity_task_limit()		// depends on memory, disk, ...
 #define TIMEOUT		15
 #define MAXTRIES	3	// try running task up to this many times
 #define TASKMAXRUN	7200	// RSN - config, task conf
 #define TASKTIMEOUT	300	// ''
 #define EUBUFSIZE	8192
+#define PROGRESSTIME	5	// report progress this often
+#define PROGRESSFD	3	// the task process reports progress here
+#define SRCEXPIRE	3600	// remove old cached programs this often
 
 
 class Task {
@@ -54,13 +64,28 @@ public:
     int               _progress;
     int               _runtime;
     bool	      _aborted;
-
-    Task() { _pid = 0; _status = "PENDING"; _progress = 0; _created = lr_now(); _runtime = 0; _aborted = 0; }
+    int               _rss;		// MB
+    int               _peak_rss;
+    string            _cgroup;		// empty => not using cgroups
+    CGroupStats       _usage;
+    vector<int>       _pushed;		// outfiles delivered to their consumer
+
+    Task() { _pid = 0; _status = "PENDING"; _progress = 0; _created = lr_now(); _runtime = 0; _aborted = 0;
+        _rss = 0; _peak_rss = 0; }
 };
 
 
 extern void install_handler(int, void(*)(int));
+extern void pipeline_init(void);
+extern void pipeline_warm_stop(const string *);
+extern void pipeline_warm_kill(void);
 extern int  create_pipeline(ACPMRMTaskCreate *, int*);
+extern int  capacity_task_limit(void);
+extern void capacity_task_done(int);
+extern void capacity_update(const vector<int> *);
+extern void capacity_rss(map<int,int> *);
+extern int  jobsrc_fetch(ACPMRMTaskCreate *);
+extern void jobsrc_expire(void);
 
 static void *task_periodic(void*);
 static void *do_task(void*);
@@ -73,6 +98,8 @@ static QueuedTask	taskq;
 
 void
 task_init(void){
+    cgroup_init();
+    taskq.start_dispatch();
     start_thread(task_periodic, 0);
 }
 
@@ -83,10 +110,18 @@ task_shutdown(void){
 
 static void *
 task_periodic(void *notused){
+    hrtime_t expired = lr_now();
 
     while(1){
-        // can we start any queued tasks?
-        taskq.start_more(MAXTASK);
+        // how much more can we run?
+        taskq.measure();
+        // queued tasks are started by the dispatcher
+        taskq.send_statuses();
+
+        if( lr_now() - expired > SRCEXPIRE ){
+            jobsrc_expire();
+            expired = lr_now();
+        }
         sleep(1);
     }
 }
@@ -96,6 +131,13 @@ task_nrunning(void){
     return taskq.nrunning();
 }
 
+// for status gossip
+void
+task_share_status(ACPMRMStatus *g){
+    g->set_task_slots( MAXTASK );
+    taskq.share_status( g );
+}
+
 // handle task request from network
 int
 handle_task(NTD *ntd){
@@ -115,7 +157,11 @@ handle_task(NTD *ntd){
 
     DEBUG("recvd task request");
 
-    taskq.start_or_queue( (void*)req, req->_g.taskid().c_str(), req->_g.priority(), MAXTASK );
+    // our slots are shared fairly between jobs (or groups of jobs)
+    const string *group = req->_g.has_sharegroup() ? & req->_g.sharegroup() : & req->_g.jobid();
+    int weight = req->_g.has_shareweight() ? req->_g.shareweight() : SHARE_DEFAULT;
+
+    taskq.start_or_queue( (void*)req, req->_g.taskid().c_str(), req->_g.priority(), MAXTASK, group, weight );
 
     return reply_ok(ntd);
 }
@@ -137,6 +183,12 @@ handle_taskabort(NTD *ntd){
 
     DEBUG("recvd task abort %s", req.taskid().c_str());
 
+    // no task => the job is over, its warm workers can go
+    if( req.taskid().empty() ){
+        pipeline_warm_stop( & req.jobid() );
+        return reply_ok(ntd);
+    }
+
     taskq.abort(req.taskid().c_str());
 
     return reply_ok(ntd);
@@ -155,7 +207,42 @@ QueuedTask::_abort_r(void *x){
     Task *t = (Task*)x;
 
     t->_aborted = 1;
-    if( t->_pid ) kill( t->_pid, 3 );
+    if( !t->_pid ) return;
+
+    // everything it started, or else, its process group
+    if( ! cgroup_kill( &t->_cgroup ) ) kill( t->_pid, 3 );
+}
+
+int
+QueuedTask::max_running(void){
+    return MAXTASK;
+}
+
+// how much memory are the running tasks using?
+void
+QueuedTask::measure(void){
+    map<int,int> rss;
+    vector<int> taskrss;
+
+    capacity_rss( &rss );
+
+    // updates the tasks
+    _lock.w_lock();
+    for(list<QueueElem*>::iterator it=_running.begin(); it != _running.end(); it++){
+        Task *t = (Task*)(*it)->_elem;
+        map<int,int>::iterator r = rss.find( t->_pid );
+
+        t->_rss = (t->_pid && r != rss.end()) ? r->second : 0;
+        if( t->_rss > t->_peak_rss ) t->_peak_rss = t->_rss;
+        taskrss.push_back( t->_rss );
+    }
+    bool queued = _nqueued;
+    _lock.w_unlock();
+
+    capacity_update( &taskrss );
+
+    // there may be room for more now
+    if( queued ) wakeup();
 }
 
 void
@@ -165,22 +252,32 @@ QueuedTask::start(void *xg){
     start_thread(do_task, (void*)t);
 }
 
-void
-QueuedTask::send_status(void *xg){
+// for the periodic batch
+const string *
+QueuedTask::status1(void *xg, ACPMRMActionStatus *st){
     Task *t = (Task*)xg;
     const ACPMRMTaskCreate *g = & t->_g;
-    ACPMRMActionStatus st;
 
-    if( !g->has_master() || g->master().empty() ) return;
+    if( !g->has_master() || g->master().empty() ) return 0;
 
-    st.set_jobid( g->jobid().c_str() );
-    st.set_xid( g->taskid().c_str() );
-    st.set_phase( t->_status );
-    st.set_progress( t->_progress );
+    st->set_jobid( g->jobid().c_str() );
+    st->set_xid( g->taskid().c_str() );
+    st->set_phase( t->_status );
+    st->set_progress( t->_progress );
+
+    return & g->master();
+}
+
+void
+QueuedTask::send_status(void *xg){
+    ACPMRMActionStatus st;
 
-    DEBUG("sending status to %s", g->master().c_str());
+    const string *master = status1(xg, &st);
+    if( !master ) return;
 
-    toss_request( udp4_fd, g->master().c_str(), PHMT_MR_TASKSTATUS, &st);
+    DEBUG("sending status to %s", master->c_str());
+
+    toss_request( udp4_fd, master->c_str(), PHMT_MR_TASKSTATUS, &st);
 }
 
 // the final status goes over tcp
@@ -197,6 +294,31 @@ send_final_status(const Task *t){
     st.set_progress( t->_progress );
     st.set_final_amount(  t->_runtime );
 
+    if( t->_usage.cpu_usec ) st.set_cpu_usec( t->_usage.cpu_usec );
+    if( t->_usage.mem_peak ) st.set_mem_peak( t->_usage.mem_peak );
+    if( t->_usage.io_bytes ) st.set_io_bytes( t->_usage.io_bytes );
+
+    // so the master can keep track of disk use
+    if( t->_status && !strcmp(t->_status, "FINISHED") ){
+        for(int i=0; i<g->outfile_size(); i++){
+            struct stat sb;
+            string file = config->basedir;
+            file.append( "/" );
+            file.append( g->outfile(i) );
+
+            st.add_outsize( stat(file.c_str(), &sb) ? 0 : sb.st_size );
+        }
+
+        // these need no xfer
+        for(int i=0; i<g->pushto_size(); i++){
+            bool p = 0;
+            for(int j=0; j<t->_pushed.size(); j++){
+                if( t->_pushed[j] == i ) p = 1;
+            }
+            st.add_pushed( p );
+        }
+    }
+
     DEBUG("sending final status to %s", g->master().c_str());
 
     make_request(g->master().c_str(), PHMT_MR_TASKSTATUS, &st, TIMEOUT );
@@ -218,7 +340,8 @@ QueuedTask::json1(const char *st, void *x, string *dst){
       << "\"status\": \""       << st           << "\", "
       << "\"phase\": \""        << g->phase()   << "\", "
       << "\"start_time\": "     << t->_created  << ", "
-      << "\"pid\": "            << t->_pid
+      << "\"pid\": "            << t->_pid       << ", "
+      << "\"rss\": "            << t->_rss
       << "}";
 
     dst->append(b.str().c_str());
@@ -234,9 +357,22 @@ do_task(void *x){
     taskq.send_status(x);
     t->_status = "RUNNING";
 
+    // each task gets its own cgroup
+    string cgname = "task_";
+    cgname.append( g->taskid() );
+    cgroup_name( cgname.c_str(), &t->_cgroup );
+
     //  try several times
-    int tries = MAXTRIES;
-    for(int i=0; i<tries; i++){
+    for(int i=0; i<MAXTRIES; i++){
+        // a large program is sent once, by hash
+        if( ! jobsrc_fetch( &t->_g ) ){
+            VERBOSE("cannot get program for task %s", g->taskid().c_str());
+            ok = 0;
+            if( t->_aborted ) break;
+            sleep(5);
+            continue;
+        }
+
         hrtime_t start = lr_now();
         ok = try_task(t);
         t->_runtime = lr_now() - start;
@@ -251,31 +387,71 @@ do_task(void *x){
     else
         t->_status = "FAILED";
 
-    DEBUG("task done (%s) %s - %d sec", t->_status, g->taskid().c_str(), t->_runtime);
+    DEBUG("task done (%s) %s - %d sec, %d MB", t->_status, g->taskid().c_str(), t->_runtime, t->_peak_rss);
     send_final_status(t);
 
-    taskq.done(x);
-    delete t;
+    // the cgroup sees everything, we may have missed short-lived processes
+    int peak = t->_usage.mem_peak / 1048576;
+    capacity_task_done( peak > t->_peak_rss ? peak : t->_peak_rss );
 
     // and start another one...
-    taskq.start_more(MAXTASK);
+    taskq.done(x);
+    delete t;
 }
 
 /****************************************************************/
 
-extern int tcp4_fd;
+extern char **environ;
+extern char *filename_self;
+extern char *filename_config;
+extern int  flag_debugall;
+
+// everything but stdin/out/err + progress
 static void
-close_files(int pfd){
+close_files(void){
     int maxfd = getdtablesize();
     DEBUG("maxfd %d", maxfd);
 
-    // close most fds
-    for(int i=tcp4_fd; i<maxfd; i++){
-        if( i == pfd ) continue;
+    for(int i=PROGRESSFD+1; i<maxfd; i++){
         close(i);
     }
 }
 
+static int
+cloexec_pipe(int *fds){
+
+    if( pipe(fds) ) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+// send the task request to the child, on its stdin
+// our running config goes first (4 byte length, text), so the task
+// sees what we see, not whatever is in the file now
+static int
+send_task(int fd, const ACPMRMTaskCreate *g){
+    string buf;
+    Config *cf = config;
+
+    uint32_t cl = htonl( cf->text.size() );
+    buf.append( (char*)&cl, 4 );
+    buf.append( cf->text );
+    g->AppendToString( &buf );
+
+    const char *p = buf.data();
+    int len = buf.size();
+
+    while( len > 0 ){
+        int w = write(fd, p, len);
+        if( w == -1 && errno == EINTR ) continue;
+        if( w <= 0 ) return 0;
+        p   += w;
+        len -= w;
+    }
+    return 1;
+}
+
 static void
 read_progress(int fd, Task *t){
     int progress;
@@ -284,45 +460,89 @@ read_progress(int fd, Task *t){
     // NB. nothing bad happens if this blocks
     int r = read(fd, &progress, sizeof(int));
     if( r != sizeof(int) ) return;
+
+    // at the end: -1 - outfile, for each one pushed
+    if( progress < 0 ){
+        t->_pushed.push_back( -1 - progress );
+        return;
+    }
     t->_progress = progress;
     DEBUG("progress %d", progress);
 }
 
 // start the task in a child process + wait for it to finish
 // use a pipe to detect the child ending
+//
+// the child is a fresh copy of this program (see task_main), started with
+// posix_spawn. forking this large, multi-threaded daemon is slow, and
+// the child could inherit a lock (eg. malloc's) held by another thread.
 
 static int
 try_task(Task *t){
     const ACPMRMTaskCreate *g = & t->_g;
 
     DEBUG("task running %s", g->taskid().c_str());
+    t->_pushed.clear();
 
-    // create pipe
-    int pipfd[2];	// [read, write]
-    int pr = pipe( pipfd );
+    // create pipes
+    int pipfd[2];	// [read, write] - progress + exit detection
+    int reqfd[2];	// the task request
+    int pr = cloexec_pipe( pipfd );
     if( pr ){
         VERBOSE("cannot open pipes: ", strerror(errno));
         return 0;
     }
-
-    // fork child
-    int pid = fork();
-    if( pid == -1 ){
-        VERBOSE("cannot fork: %s", strerror(errno));
+    pr = cloexec_pipe( reqfd );
+    if( pr ){
+        VERBOSE("cannot open pipes: ", strerror(errno));
         close(pipfd[0]);
         close(pipfd[1]);
         return 0;
     }
-    if( pid == 0 ){
-        // child
+
+    cgroup_create( &t->_cgroup );
+
+    // child: stdin = request, fd 3 = progress
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init( &fa );
+    posix_spawn_file_actions_adddup2( &fa, reqfd[0], 0 );
+    posix_spawn_file_actions_adddup2( &fa, pipfd[1], PROGRESSFD );
+
+    const char *argv[12];
+    int argc = 0;
+    argv[argc++] = filename_self;
+    argv[argc++] = "-T";
+    argv[argc++] = "-c";
+    argv[argc++] = filename_config;
+    argv[argc++] = "-S";
+    argv[argc++] = myserver_id.c_str();
+    if( !t->_cgroup.empty() ){
+        argv[argc++] = "-G";
+        argv[argc++] = t->_cgroup.c_str();
+    }
+    if( flag_debugall ) argv[argc++] = "-d";
+    argv[argc] = 0;
+
+    int pid;
+    int e = posix_spawnp( &pid, filename_self, &fa, 0, (char* const*)argv, environ );
+    posix_spawn_file_actions_destroy( &fa );
+
+    close(reqfd[0]);
+    close(pipfd[1]);
+
+    if( e ){
+        VERBOSE("cannot spawn task: %s", strerror(e));
+        close(reqfd[1]);
         close(pipfd[0]);
-        close_files(pipfd[1]);
-        run_task_prog(pipfd[1], t);
-        _exit(-1);
+        cgroup_remove( &t->_cgroup );
+        return 0;
     }
+
     // parent
     t->_pid = pid;
-    close(pipfd[1]);
+
+    if( ! send_task(reqfd[1], g) ) VERBOSE("cannot send task request: %s", strerror(errno));
+    close(reqfd[1]);
 
     DEBUG("child pid %d - running", pid);
 
@@ -344,23 +564,30 @@ try_task(Task *t){
 
         pr = poll( pf, 1, to * 1000 );
         DEBUG("poll done %d %d %x", pr, errno, pf[0].revents);
-        if( pf[0].revents & (POLLHUP | POLLERR) ) break;
 
-        // if any data comes through, suck it in
-        if( pf[0].revents & POLLIN ) read_progress(pipfd[0], t);
+        // if any data comes through, suck it in (all of it, before the hangup)
+        if( pf[0].revents & POLLIN ){
+            read_progress(pipfd[0], t);
+            continue;
+        }
+        if( pf[0].revents & (POLLHUP | POLLERR) ) break;
     }
 
     close(pipfd[0]);
 
-    // if it didn't finish, kill it
+    // if it didn't finish, kill it (and everything it started)
     if( lr_now() >= timeout ){
-        kill(pid, 9);
+        if( ! cgroup_kill( &t->_cgroup ) ) kill(pid, 9);
     }
 
     // wait for it
     int exitval;
     waitpid(pid, &exitval, 0);
 
+    // tally + clean up anything left behind
+    cgroup_stats( &t->_cgroup, &t->_usage );
+    cgroup_remove( &t->_cgroup );
+
     DEBUG("child pid %d exited %d", pid, exitval);
 
     if( exitval ) VERBOSE("task child exited %d", exitval);
@@ -375,6 +602,8 @@ static void
 run_task_sig(int sig){
     // 0 => all processes in my process group
     VERBOSE("signal %d: abort", sig);
+    // a warm worker's child is not in our group
+    pipeline_warm_kill();
     kill(0, 9);
     _exit(1);
 }
@@ -387,8 +616,12 @@ setup_process(int need){
     // all signals -> abort
     for(int i=1; i<32; i++){
         if( i == 18 ) continue;		// sig child
+        if( i == SIGPIPE ) continue;
         install_handler(i, run_task_sig);
     }
+    // a push receiver going away is a failed write, not a reason to kill the task
+    // (the pipeline resets it for its children)
+    install_handler(SIGPIPE, SIG_IGN);
 
     // increase open file limit - we have lots of output files
     struct rlimit fdrl;
@@ -407,6 +640,22 @@ setup_process(int need){
 }
 
 
+static int
+open_save_file(const char *file){
+
+    string dir = file;
+    int lsl = dir.rfind('/');
+    if( lsl != -1 ){
+        dir.erase(lsl);
+        mkdirp( dir.c_str(), 0777 );
+    }
+
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if( fd < 0 ) VERBOSE("cannot open file %s: %s", file, strerror(errno));
+
+    return fd;
+}
+
 /****************************************************************/
 
 // set up io and run the program
@@ -418,24 +667,15 @@ run_task_prog(int parent_fd, Task *t){
 
     setup_process(g->outfile_size() + 8);
 
-    // there is a possibility of deadlock:
-    // if another thread malloc()s during the fork, this process will inherit the lock
-    // and malloc will hang.
-    // workarounds:
-    //   alarm + retry
-    //   serialize g -> tmpfile + execv
-    //   fix malloc
     // NB: this runs in a seperate process because it needs ~37 gajillion file descriptors
     // and is process group leader of the pipeline process group
 
     // for end user output
     DEBUG("setting up eu consoles");
-    alarm(10);
     EUConsole eu_out("stdout", g);
     EUConsole eu_err("stderr", g);
     char *eubuf = (char*)malloc(EUBUFSIZE);
     if( !eubuf ) FATAL("out of memory");
-    alarm(0);
 
     // create the processing pipeline (eg. gzcat files | sort | program)
     //   progfd 0 - is program stdout, 1 is stderr, 2 is crunched data
@@ -451,12 +691,22 @@ run_task_prog(int parent_fd, Task *t){
     DEBUG("creating output files");
     MapOutSet out(g);
 
-    // RSN - thread{ sleep, send status }
+    // and maybe a copy of stdout (for the result cache)
+    int savefd = -1;
+    if( g->has_stdoutfile() ){
+        savefd = open_save_file( g->stdoutfile().c_str() );
+    }
+
+    // a native plugin reads the input directly (after everything is opened, it drops privileges)
+    NativeProg *native = 0;
+    if( pl.native() ) native = new NativeProg( pl.native_file(), g, &out, &eu_out, savefd );
+    RecordSink *sink = native ? (RecordSink*)native : (RecordSink*)&out;
 
     DEBUG("running task io loop");
     int tasktimeout = g->timeout();
     if( !tasktimeout ) tasktimeout = TASKTIMEOUT;
     bool producing = 1;
+    hrtime_t progress_time = lr_now() + PROGRESSTIME;
     DEBUG("task timeout %d", tasktimeout);
 
     while(1){
@@ -488,13 +738,21 @@ run_task_prog(int parent_fd, Task *t){
         // read + process
 
         if( pf[2].revents & POLLIN ){
-            inbuf.read( &out );
+            inbuf.read( sink );
+        }
+
+        // progress = KB of output so far. the master uses it to find stragglers
+        if( lr_now() >= progress_time ){
+            int progress = inbuf.nread() >> 10;
+            write(parent_fd, &progress, sizeof(progress));
+            progress_time = lr_now() + PROGRESSTIME;
         }
 
         if( pf[0].revents & POLLIN ){
             int r = read(progfd[0], eubuf, EUBUFSIZE);
             //DEBUG("read eu-out %d", r);
             if( r > 0 ) eu_out.send(eubuf, r);
+            if( r > 0 && savefd != -1 ) write(savefd, eubuf, r);
         }
         if( pf[1].revents & POLLIN ){
             int r = read(progfd[1], eubuf, EUBUFSIZE);
@@ -502,19 +760,29 @@ run_task_prog(int parent_fd, Task *t){
             if( r > 0 ) eu_err.send(eubuf, r);
         }
 
-        // done
+        // done (and everything read)
         if( (pf[0].revents & (POLLHUP | POLLERR))
             && (pf[1].revents & (POLLHUP | POLLERR))
-            && (pf[2].revents & (POLLHUP | POLLERR)) ) break;
+            && (pf[2].revents & (POLLHUP | POLLERR))
+            && !((pf[0].revents | pf[1].revents | pf[2].revents) & POLLIN) ) break;
 
     }
 
 
     // get program exit value - use it as our exit value
     int exitval = pl.waitpid();
+    if( native && native->finish() ) exitval = -1;
 
     // close outfiles
     out.close();
+    if( savefd != -1 ) close(savefd);
+
+    // tell the parent which outfiles were pushed to their consumers
+    for(int i=0; i<g->outfile_size() && !exitval; i++){
+        if( !out.pushed(i) ) continue;
+        int p = -1 - i;
+        write(parent_fd, &p, sizeof(p));
+    }
 
     eu_out.done();
     eu_err.done();
@@ -528,13 +796,65 @@ run_task_prog(int parent_fd, Task *t){
     _exit( exitval ? -1 : 0 );
 }
 
+// mrquincyd -T: run one task, for the daemon
+// the request arrives on stdin, progress goes to fd 3
+void
+task_main(const char *cgroup){
+    Task *t = new Task;
+    string buf;
+    char rbuf[8192];
+
+    while(1){
+        int r = read(0, rbuf, sizeof(rbuf));
+        if( r == -1 && errno == EINTR ) continue;
+        if( r <= 0 ) break;
+        buf.append(rbuf, r);
+    }
+
+    // the config first. a request never starts with a 0 byte, the length
+    // of a config does. an older daemon (before a restart) sends only the request
+    uint32_t cl = 0;
+    int off = 0;
+    if( buf.size() >= 4 && buf[0] == 0 ){
+        memcpy( &cl, buf.data(), 4 );
+        cl = ntohl( cl );
+        if( cl > buf.size() - 4 ) FATAL("invalid task request");
+        off = 4 + cl;
+
+        string text( buf, 4, cl );
+        read_config_text( &text );
+    }else if( read_config(filename_config) ){
+        FATAL("cannot read config file");
+    }
+    pipeline_init();
+
+    if( ! t->_g.ParseFromArray( buf.data() + off, buf.size() - off ) ){
+        VERBOSE("invalid task request");
+        _exit(-1);
+    }
+
+    close(0);
+    open("/dev/null", O_RDONLY);
+    close_files();
+
+    // everything we start is in the task's cgroup
+    if( cgroup ){
+        string cg = cgroup;
+        cgroup_enter( &cg );
+    }
+
+    DEBUG("task %s", t->_g.taskid().c_str());
+    run_task_prog(PROGRESSFD, t);
+    _exit(-1);
+}
+
 /*
   a task ends up running as:
 
   a thread doing do_task
 
-  (which starts up)
-  a process running run_task_prog
+  (which starts up, with posix_spawn)
+  a process (mrquincyd -T) running run_task_prog
 
   (which starts up)
   a pipeline of processes including the end-user program, sort, and gzcat
@@ -18,18 +18,32 @@
 #include "lock.h"
 #include "peers.h"
 #include "queued.h"
+#include "ratelimit.h"
 
 #include "mrmagoo.pb.h"
 #include "scrible.pb.h"
 #include "std_reply.pb.h"
 
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include <sstream>
+#include <vector>
 using std::ostringstream;
+using std::vector;
 
 #define MAXXFER		(config->hw_cpus ? 5 * config->hw_cpus / 4 : 2)
 #define TIMEOUT		15
+#define CHUNKSIZE	(16 * 1024 * 1024)
+#define SRCMAXFAIL	3		// stop using a location after this many failures
+#define LOCALSUFFIX	".lnk"
 
 class Xfer {
 public:
@@ -37,23 +51,38 @@ public:
     hrtime_t        _created;
     const char     *_status;
     int             _filesize;
+    TokenBucket    *_tb;		// the job's bandwidth
 
-    Xfer() { _status = "PENDING"; _created = lr_now(); _filesize = 0; }
+    Xfer() { _status = "PENDING"; _created = lr_now(); _filesize = 0; _tb = 0; }
 };
 
 
 
 static void *xfer_periodic(void*);
 static void *do_xfer(void*);
-static int  try_xfer(Xfer *, int);
-
-extern int scriblr_save_file(int fd, const string *filename, int size, string *hash, int to);
+static void *fetch_chunks(void*);
+static int  fetch_file(Xfer *);
+static long long get_range(Xfer *, int, int, long long, long long, long long *, string *);
+static int  check_range(Xfer *, int, int, long long, long long, long long);
+
+extern int  scriblr_open_tmp(const string *, string *, string *);
+extern int  scriblr_recv_range(int, int, long long, int, const string *, TokenBucket *, int);
+extern int  scriblr_part_load(const string *, const string *, vector<long long> *);
+extern void scriblr_part_add(const string *, long long, long long);
+extern void scriblr_part_remove(const string *);
+extern int  scriblr_range_hash(int, long long, int, char *, int);
 
 static QueuedXfer	xferq;
 
+// copied without the network (same host, or same filesystem)
+static long long	xfer_local_files = 0;
+static long long	xfer_local_bytes = 0;
+
 
 void
 xfer_init(void){
+    ratelimit_update();
+    xferq.start_dispatch();
     start_thread(xfer_periodic, 0);
 }
 
@@ -61,8 +90,9 @@ static void *
 xfer_periodic(void *notused){
 
     while(1){
-        // can we start any queued xfers?
-        xferq.start_more(MAXXFER);
+        // queued xfers are started by the dispatcher
+        xferq.send_statuses();
+        ratelimit_update();
         sleep(1);
     }
 }
@@ -85,7 +115,8 @@ handle_xfer(NTD *ntd){
 
     DEBUG("recvd xfer request");
 
-    xferq.start_or_queue( (void*)req, req->_g.copyid().c_str(), 0, MAXXFER );
+    // the master says which files are most needed
+    xferq.start_or_queue( (void*)req, req->_g.copyid().c_str(), req->_g.priority(), MAXXFER );
 
     return reply_ok(ntd);
 }
@@ -95,6 +126,17 @@ json_xfer(string *dst){
     xferq.json(dst);
 }
 
+void
+json_xfer_stats(string *dst){
+    ostringstream b;
+
+    b << "{\"local_files\": "    << xfer_local_files
+      << ", \"local_bytes\": "   << xfer_local_bytes
+      << "}";
+
+    dst->append(b.str().c_str());
+}
+
 void
 QueuedXfer::json1(const char *st, void *x, string *dst){
     Xfer *g = (Xfer*)x;
@@ -117,6 +159,11 @@ QueuedXfer::_abort_q(void *x){
     delete t;
 }
 
+int
+QueuedXfer::max_running(void){
+    return MAXXFER;
+}
+
 void
 QueuedXfer::start(void *xg){
     Xfer *g = (Xfer*)xg;
@@ -124,18 +171,28 @@ QueuedXfer::start(void *xg){
     start_thread(do_xfer, (void*)g);
 }
 
+// for the periodic batch
+const string *
+QueuedXfer::status1(void *xg, ACPMRMActionStatus *st){
+    Xfer *g = (Xfer*)xg;
+
+    if( !g->_g.has_master() ) return 0;
+
+    st->set_jobid( g->_g.jobid().c_str() );
+    st->set_xid( g->_g.copyid().c_str() );
+    st->set_phase( g->_status );
+
+    return & g->_g.master();
+}
+
 void
 QueuedXfer::send_status(void *xg){
-    Xfer *g = (Xfer*)xg;
     ACPMRMActionStatus st;
 
-    if( !g->_g.has_master() ) return;
-
-    st.set_jobid( g->_g.jobid().c_str() );
-    st.set_xid( g->_g.copyid().c_str() );
-    st.set_phase( g->_status );
+    const string *master = status1(xg, &st);
+    if( !master ) return;
 
-    toss_request( udp4_fd, g->_g.master().c_str(), PHMT_MR_XFERSTATUS, &st);
+    toss_request( udp4_fd, master->c_str(), PHMT_MR_XFERSTATUS, &st);
 }
 
 // the final status goes over tcp
@@ -156,22 +213,61 @@ send_final_status(const Xfer *g){
 }
 
 
+// a file is fetched in chunks, from all of its locations at once.
+// each chunk is verified on its own, so a failure costs only that
+// chunk, which is then fetched from another location.
+// if the xfer fails, the verified chunks are kept, and a later xfer
+// of the same file (same size, same first chunk) resumes.
+// the chunks it kept may be stale, each is checked against the
+// source's hash of that range before it counts.
+
+#define XCHUNK_TODO	0
+#define XCHUNK_BUSY	1
+#define XCHUNK_DONE	2
+#define XCHUNK_KEPT	3	// from an earlier xfer, not yet checked
+
+class XferFile {
+public:
+    Xfer		*_x;
+    int			_fd;		// tmp file
+    string		_tmp;
+    long long		_start;		// chunks start here
+    long long		_size;
+    vector<char>	_chunk;		// XCHUNK_*
+    int			_ndone;
+    int			_nworker;
+    Mutex		_lock;
+    CondVar		_cond;
+
+    XferFile(Xfer *x, int fd){ _x = x; _fd = fd; _start = 0; _size = -1; _ndone = 0; _nworker = 0; }
+    int next(void);
+};
+
+struct XferWorker {
+    XferFile		*f;
+    int			loc;
+};
+
+// lock held. -1 => nothing to do now
+int
+XferFile::next(void){
+
+    for(int i=0; i<_chunk.size(); i++){
+        if( _chunk[i] == XCHUNK_TODO || _chunk[i] == XCHUNK_KEPT ) return i;
+    }
+    return -1;
+}
+
 static void *
 do_xfer(void *x){
     Xfer *g = (Xfer*)x;
-    bool ok = 1;
 
     g->_status = "RUNNING";
     xferq.send_status(x);
 
-    // try each location, several times
-    int tries = 2 * g->_g.location_size() + 1;
-
-    for(int i=0; i<tries; i++){
-        ok = try_xfer(g, i % g->_g.location_size());
-        if( ok ) break;
-        sleep(5);	// maybe the problem will clear
-    }
+    g->_tb = ratelimit_job( & g->_g.jobid() );
+    int ok = fetch_file(g);
+    ratelimit_job_done( g->_tb );
 
     DEBUG("xfer done");
 
@@ -182,21 +278,281 @@ do_xfer(void *x){
 
     send_final_status(g);
 
+    // start another one
     xferq.done(x);
     delete g;
+}
 
-    // start another one
-    xferq.start_more(MAXXFER);
+// copy the file, in the kernel. clone it, if the filesystem can
+static const char *
+copy_local(const char *src, const char *dst, long long size){
+#ifdef __linux__
+    const char *how = 0;
+
+    int in = open(src, O_RDONLY);
+    if( in < 0 ) return 0;
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if( out < 0 ){
+        close(in);
+        return 0;
+    }
+
+# ifdef FICLONE
+    if( ! ioctl(out, FICLONE, in) ) how = "clone";
+# endif
+
+    if( !how ){
+        long long done = 0;
+        while( done < size ){
+            long long n = size - done;
+            if( n > RATECHUNK ) n = RATECHUNK;
+            int r = copy_file_range(in, 0, out, 0, n, 0);
+            if( r < 1 ) break;
+            xfer_disk_tb.take(r);
+            done += r;
+        }
+        if( done == size ) how = "copy";
+    }
+
+    close(in);
+    close(out);
+    if( !how ) unlink(dst);
+    return how;
+#else
+    return 0;
+#endif
+}
+
+// is one of the locations on this host, or sharing our filesystem?
+// then link (or copy) it, instead of going over the network. 1 => done
+static int
+local_copy(Xfer *g, const string *file){
+    string dir, dirid;
+    struct stat st;
+    char buf[64];
+
+    for(int l=0; l<g->_g.location_size(); l++){
+        const string *location = & g->_g.location(l);
+
+        if( ! peerdb->basedir(location->c_str(), &dir, &dirid) ) continue;
+
+        // the same directory, not just one with the same name
+        if( stat(dir.c_str(), &st) ) continue;
+        snprintf(buf, sizeof(buf), "%lld %lld", (long long)st.st_dev, (long long)st.st_ino);
+        if( dirid.compare(buf) ) continue;
+
+        string src = dir;
+        src.append( "/" );
+        src.append( g->_g.filename() );
+        if( stat(src.c_str(), &st) ) continue;
+
+        // it is already here. (the same file, by another name)
+        struct stat dst;
+        if( !stat(file->c_str(), &dst) && dst.st_dev == st.st_dev && dst.st_ino == st.st_ino ){
+            DEBUG("xfer %s from %s: already here", file->c_str(), location->c_str());
+            g->_filesize = st.st_size;
+            return 1;
+        }
+
+        // never partly there: link or copy, then rename
+        string lnk = *file;
+        lnk.append( LOCALSUFFIX );
+        unlink( lnk.c_str() );
+
+        const char *how = "link";
+        if( link(src.c_str(), lnk.c_str()) ){
+            how = copy_local(src.c_str(), lnk.c_str(), st.st_size);
+            if( !how ) continue;
+        }
+
+        if( rename(lnk.c_str(), file->c_str()) ){
+            unlink( lnk.c_str() );
+            continue;
+        }
+        // if file became a link to src meanwhile, rename did nothing
+        unlink( lnk.c_str() );
+
+        DEBUG("xfer %s from %s: %s", file->c_str(), location->c_str(), how);
+        g->_filesize = st.st_size;
+        ATOMIC_ADD64(xfer_local_files, 1);
+        ATOMIC_ADD64(xfer_local_bytes, st.st_size);
+        return 1;
+    }
+
+    return 0;
 }
 
 static int
-try_xfer(Xfer *g, int l){
+fetch_file(Xfer *g){
+    string file, tmp;
+    const string *dstfile;
+    int nloc = g->_g.location_size();
+
+    if( g->_g.has_dstname() )
+        dstfile = & g->_g.dstname();
+    else
+        dstfile = & g->_g.filename();
+
+    int fd = scriblr_open_tmp(dstfile, &file, &tmp);
+    if( fd < 0 ) return 0;
+
+    if( local_copy(g, &file) ){
+        close(fd);
+        unlink( tmp.c_str() );
+        scriblr_part_remove( &tmp );
+        return 1;
+    }
+
+    XferFile f(g, fd);
+    string hash;
+    f._tmp = tmp;
+
+    // the first chunk tells us how big the file is
+    // try each location, several times
+    int tries = 2 * nloc + 1;
+
+    for(int i=0; i<tries; i++){
+        f._start = get_range(g, i % nloc, fd, 0, CHUNKSIZE, &f._size, &hash);
+        if( f._start >= 0 ) break;
+        sleep(5);	// maybe the problem will clear
+    }
+
+    // and the rest, from everywhere
+    if( f._start >= 0 && f._start < f._size ){
+        int nchunk = (f._size - f._start + CHUNKSIZE - 1) / CHUNKSIZE;
+        int nwork  = nloc < nchunk ? nloc : nchunk;
+        vector<long long> done;
+        char key[128];
+
+        f._chunk.resize( nchunk, XCHUNK_TODO );
+
+        // do we already have some of it?
+        snprintf(key, sizeof(key), "get %lld %s", f._size, hash.c_str());
+        string skey = key;
+
+        if( scriblr_part_load(&tmp, &skey, &done) ){
+            int nkept = 0;
+            for(int i=0; i<done.size(); i+=2){
+                long long c = (done[i] - f._start) / CHUNKSIZE;
+                if( done[i] < f._start || (done[i] - f._start) % CHUNKSIZE || c >= nchunk ) continue;
+                if( f._chunk[c] == XCHUNK_KEPT ) continue;
+                f._chunk[c] = XCHUNK_KEPT;
+                nkept ++;
+            }
+            VERBOSE("resuming xfer %s, %d of %d chunks", dstfile->c_str(), nkept, nchunk);
+        }
+        scriblr_part_add( &tmp, 0, f._start );
+
+        DEBUG("xfer %lld bytes, %d chunks, %d sources", f._size, nchunk, nwork);
+
+        f._lock.lock();
+        for(int i=0; i<nwork; i++){
+            XferWorker *w = new XferWorker;
+            w->f   = &f;
+            w->loc = i;
+            f._nworker ++;
+            if( start_thread(fetch_chunks, (void*)w) ){
+                f._nworker --;
+                delete w;
+            }
+        }
+        while( f._nworker ) f._cond.wait( &f._lock );
+        f._lock.unlock();
+    }
+
+    if( f._start < 0 || f._ndone != f._chunk.size() ){
+        // keep what we have, unless we have nothing
+        close(fd);
+        if( f._start < 0 ) unlink( tmp.c_str() );
+        return 0;
+    }
+
+    // there may have been more, from an older version
+    ftruncate(fd, f._size);
+    close(fd);
+
+    if( rename( tmp.c_str(), file.c_str() ) ){
+        // keep the chunks, a retry can resume
+        VERBOSE("xfer rename %s failed: %s", file.c_str(), strerror(errno));
+        return 0;
+    }
+    scriblr_part_remove( &tmp );
+    g->_filesize = f._size;
+    return 1;
+}
+
+// fetch chunks from one location, until there are none left, or it fails too often
+static void *
+fetch_chunks(void *x){
+    XferWorker *w = (XferWorker*)x;
+    XferFile   *f = w->f;
+    int fails = 0;
+
+    f->_lock.lock();
+
+    while( fails < SRCMAXFAIL && f->_ndone < f->_chunk.size() ){
+        int c = f->next();
+
+        if( c == -1 ){
+            // others are working on the rest. if they fail, we'll pick it up
+            f->_cond.wait( &f->_lock );
+            continue;
+        }
+
+        bool kept = (f->_chunk[c] == XCHUNK_KEPT);
+        f->_chunk[c] = XCHUNK_BUSY;
+        f->_lock.unlock();
+
+        long long off = f->_start + (long long)c * CHUNKSIZE;
+        long long len = f->_size - off;
+        long long size;
+        if( len > CHUNKSIZE ) len = CHUNKSIZE;
+
+        // what we kept is good, if it matches the source. else fetch it
+        bool ok = kept && check_range(f->_x, w->loc, f->_fd, off, len, f->_size);
+
+        if( !ok ){
+            long long got = get_range(f->_x, w->loc, f->_fd, off, len, &size, 0);
+            ok = (got == len) && (size == f->_size);
+            if( ok ) scriblr_part_add( &f->_tmp, off, len );
+        }
+
+        f->_lock.lock();
+        if( ok ){
+            f->_chunk[c] = XCHUNK_DONE;
+            f->_ndone ++;
+        }else{
+            // someone else can have it
+            f->_chunk[c] = XCHUNK_TODO;
+            fails ++;
+        }
+        f->_cond.broadcast();
+
+        if( !ok && fails < SRCMAXFAIL ){
+            f->_lock.unlock();
+            sleep(5);
+            f->_lock.lock();
+        }
+    }
+
+    f->_nworker --;
+    f->_cond.broadcast();
+    f->_lock.unlock();
+
+    delete w;
+    return 0;
+}
+
+// fetch [off, off+len) from location l, into dst
+// returns the number of bytes received, -1 on failure. *fsize => size of the whole file
+static long long
+get_range(Xfer *g, int l, int dst, long long off, long long len, long long *fsize, string *hash){
     NTD ntd;
     protocol_header *phi = (protocol_header*) ntd.gpbuf_in;
     ACPScriblRequest req;
     ACPScriblReply   res;
 
-    DEBUG("trying xfer %s", g->_g.jobid().c_str());
+    DEBUG("trying xfer %s @%lld", g->_g.jobid().c_str(), off);
 
     // find addr of remote
     const string *location = & g->_g.location(l);
@@ -206,17 +562,19 @@ try_xfer(Xfer *g, int l){
         VERBOSE("cannot find xfer peer %s", location->c_str());
         // extra delay, maybe it will show up
         sleep(2);
-        return 0;
+        return -1;
     }
 
     // build get req
     req.set_filename( g->_g.filename().c_str() );
+    req.set_offset( off );
+    req.set_length( len );
 
     // connect
     int fd = tcp_connect(na, TIMEOUT);
     if( fd<0 ){
         VERBOSE("xfer cannot connect to %s", location->c_str());
-        return 0;
+        return -1;
     }
 
     ntd.fd = fd;
@@ -225,7 +583,7 @@ try_xfer(Xfer *g, int l){
     if( s<1 ){
         VERBOSE("xfer write failed");
         close(fd);
-        return 0;
+        return -1;
     }
 
     // recv response
@@ -233,7 +591,7 @@ try_xfer(Xfer *g, int l){
     if( s<1 ){
         VERBOSE("xfer read failed");
         close(fd);
-        return 0;
+        return -1;
     }
 
     // parse response
@@ -243,26 +601,77 @@ try_xfer(Xfer *g, int l){
     if( res.status_code() != 200 ){
         VERBOSE("xfer request failed: %s", res.status_message().c_str());
         close(fd);
-        return 0;
+        return -1;
     }
 
-    // stream to disk
-    string *dstfile;
-    if( g->_g.has_dstname() )
-        dstfile = g->_g.mutable_dstname();
-    else
-        dstfile = g->_g.mutable_filename();
+    long long clen = phi->content_length;
+
+    if( res.has_file_size() ){
+        *fsize = res.file_size();
+    }else{
+        // an older server sends the whole file
+        if( off ){
+            VERBOSE("xfer peer %s cannot send partial files", location->c_str());
+            close(fd);
+            return -1;
+        }
+        *fsize = clen;
+    }
 
-    s = scriblr_save_file(fd, dstfile, phi->content_length, res.mutable_hash_sha1(), TIMEOUT );
+    // stream to disk
+    s = scriblr_recv_range(fd, dst, off, clen, & res.hash_sha1(), g->_tb, TIMEOUT );
     close(fd);
 
     if( !s ){
         VERBOSE("xfer save file failed");
-        return 0;
+        return -1;
     }
 
-    g->_filesize = phi->content_length;
-    return 1;
+    if( hash ) hash->assign( res.hash_sha1() );
 
+    return clen;
 }
 
+// does our copy of [off, off+len) match location l's?
+// 1 => yes. an older server does not send the hash => no
+static int
+check_range(Xfer *g, int l, int dst, long long off, long long len, long long fsize){
+    NTD ntd;
+    protocol_header *phi = (protocol_header*) ntd.gpbuf_in;
+    ACPScriblRequest req;
+    ACPScriblReply   res;
+    char buf[64];
+
+    const string *location = & g->_g.location(l);
+    NetAddr *na = peerdb->find_addr(location->c_str() );
+    if( !na ) return 0;
+
+    // hash our copy
+    if( !scriblr_range_hash(dst, off, len, buf, sizeof(buf)) ) return 0;
+
+    // ask for theirs
+    req.set_filename( g->_g.filename().c_str() );
+    req.set_offset( off );
+    req.set_length( len );
+
+    int fd = tcp_connect(na, TIMEOUT);
+    if( fd<0 ) return 0;
+
+    ntd.fd = fd;
+    int s = write_request(&ntd, PHMT_SCRIB_STAT, &req, 0, TIMEOUT);
+    if( s>0 ) s = read_proto(&ntd, 0, TIMEOUT);
+    close(fd);
+    if( s<1 ) return 0;
+
+    res.ParsePartialFromArray( ntd.in_data(), phi->data_length );
+    DEBUG("l=%d, %s", phi->data_length, res.ShortDebugString().c_str());
+
+    if( res.status_code() != 200 || !res.has_hash_sha1() ) return 0;
+    if( !res.has_file_size() || res.file_size() != fsize ) return 0;
+    if( res.hash_sha1().compare(buf) ){
+        DEBUG("xfer kept chunk @%lld is stale", off);
+        return 0;
+    }
+
+    return 1;
+}